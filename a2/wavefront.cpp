@@ -6,6 +6,9 @@
 #include "gpuProgram.h"
 #include "linalg.h"
 
+#include <thread>
+#include <atomic>
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -25,27 +28,14 @@ unsigned char wfMaterial::defaultTexmap[] = { 255, 255, 255, 255, 255, 255,
 
 
 /* Read a Wavefront model into this structure.  See ObjectFile.html
- * for a description of the Wavefront file format.  This code is from
- * the Nate Robins GLM library.
+ * for a description of the Wavefront file format.  The file itself is
+ * parsed by parse(), in wavefrontParse.cpp.  This code is from the
+ * Nate Robins GLM library.
  */
 
-void wfModel::read( char *filename )
+void wfModel::read( const char *filename )
 
 {
-  FILE* file;
-  char  buf[1000];
-  float x, y, z;
-  wfGroup    *currentGroup;
-  wfMaterial *currentMaterial;
-  int   nextGroupNum = 0;
-
-  // Counts of different vertex formats
-
-  int numVTN = 0;
-  int numVT = 0;
-  int numVN = 0;
-  int numV = 0;
-
   /* init */
 
   vertices.clear();
@@ -58,259 +48,13 @@ void wfModel::read( char *filename )
   pathname = strdup(filename);
 
   groups.add( new wfGroup( "default" ) );
-  currentGroup = groups[0];
-
   materials.add( new wfMaterial( "default" ) );
-  currentMaterial = materials[0];
-
-  currentGroup->material = currentMaterial;
-
-  /* open the file */
-
-  file = fopen(filename, "r");
-  if (!file) {
-    cerr << "wfModel::read() failed: can't open data file '" << filename << "'." << endl;
-    exit(-1);
-  }
-
-  /* process each line */
-
-  lineNum = 0;
-
-  while(fscanf(file, "%s", buf) != EOF) {
-
-    lineNum++;
-
-    if (strncmp( buf, "transform", 9 ) == 0) {
-
-      for (int r=0; r<4; r++)
-	for (int c=0; c<4; c++) {
-	  float val;
-	  fscanf( file, "%f", &val );
-	  objToWorldTransform[r][c] = val;
-	}
-
-    } else {
-      int v = 0, n = 0, t = 0;
-      wfTriangle *tri, *prevTri;
-
-      switch(buf[0]) {
-
-      case '#':				/* comment */
-	/* eat up rest of line */
-	fgets(buf, sizeof(buf), file);
-	break;
-
-      case 's':				/* smoothing group ... ignore */
-	/* eat up rest of line */
-	fgets(buf, sizeof(buf), file);
-	break;
-
-      case 'v':				/* v, vn, vt */
-	switch(buf[1]) {
-
-	case '\0':			/* vertex */
-	  fscanf(file, "%f %f %f", &x, &y, &z );
-	  vertices.add( vec3(x,y,z) );
-	  break;
-
-	case 'n':				/* normal */
-	  fscanf(file, "%f %f %f", &x, &y, &z );
-	  normals.add( vec3(x,y,z).normalize() );
-	  break;
 
-	case 't':				/* texcoord */
-	  fscanf(file, "%f %f", &x, &y );
-	  texcoords.add( vec3(x,y,0) );
-	  fgets(buf, sizeof(buf), file); // skip rest of line
-	  break;
-	}
-	break;
-
-      case 'm':			        /* mtllib filename */
-	fgets(buf, sizeof(buf), file);
-	sscanf(buf, "%s %s", buf, buf);
-	mtllibname = strdup(buf);
-	readMaterialLibrary( buf );
-	break;
-
-      case 'u':			        /* usemtl name */
-
-	if (newGroupWithNewMaterial) {
-	  char buffer[100];
-	  sprintf( buffer, "g%d", nextGroupNum++ );
-	  currentGroup = findGroup( buffer );
-	}
-      
-	fgets(buf, sizeof(buf), file);
-	sscanf(buf, "%s %s", buf, buf);
-	currentGroup->material = currentMaterial = findMaterial( buf );
-	break;
-
-      case 'g':				/* group */
-	/* eat up rest of line */
-	fgets(buf, sizeof(buf), file);
-	sscanf(buf, "%s", buf);
-	if (buf[0] == '\n')
-	  currentGroup = findGroup( "default" );
-	else
-	  currentGroup = findGroup( buf );
-	currentGroup->material = currentMaterial;
-	break;
-
-      case 'f':				/* face */
-
-	fscanf(file, "%s", buf);
-
-	/* can be one of %d, %d//%d, %d/%d, or %d/%d/%d */
-
-	tri = new wfTriangle();
+  groups[0]->material = materials[0];
 
-	if (strstr(buf, "//")) {	/* v//n */
+  /* read it */
 
-	  numVN++;
-
-	  /* First three vertices define a triangle */
-
-	  sscanf(buf, "%d//%d", &v, &n);	v--; checkVindex(v); n--; tri->vindices[0] = v; tri->nindices[0] = n;
-	    fscanf(file, "%d//%d", &v, &n);	v--; checkVindex(v); n--; tri->vindices[1] = v; tri->nindices[1] = n;
-	    fscanf(file, "%d//%d", &v, &n);	v--; checkVindex(v); n--; tri->vindices[2] = v; tri->nindices[2] = n;
-
-	    currentGroup->triangles.add( tri );
-
-	    /* More vertices (a convex polygon) are converted to a fan of triangles: */
-
-	    while(fscanf(file, "%d//%d", &v, &n) > 0) {
-
-	      v--; checkVindex(v); n--;
-
-	      prevTri = tri;
-	      tri = new wfTriangle();
-
-	      tri->vindices[0] = prevTri->vindices[0];
-	      tri->nindices[0] = prevTri->nindices[0];
-	      tri->vindices[1] = prevTri->vindices[2];
-	      tri->nindices[1] = prevTri->nindices[2];
-	      tri->vindices[2] = v;
-	      tri->nindices[2] = n;
-
-	      currentGroup->triangles.add( tri );
-	    }
-	
-	} else if (sscanf(buf, "%d/%d/%d", &v, &t, &n) == 3) {  /* v/t/n */
-
-	  numVTN++;
-
-	  v--; checkVindex(v); n--; t--;
-
-	  tri->vindices[0] = v;
-	  tri->tindices[0] = t;
-	  tri->nindices[0] = n;
-	  fscanf(file, "%d/%d/%d", &v, &t, &n);	v--; checkVindex(v); n--; t--;
-	  tri->vindices[1] = v;
-	  tri->tindices[1] = t;
-	  tri->nindices[1] = n;
-	  fscanf(file, "%d/%d/%d", &v, &t, &n);	v--; checkVindex(v); n--; t--;
-	  tri->vindices[2] = v;
-	  tri->tindices[2] = t;
-	  tri->nindices[2] = n;
-
-	  currentGroup->triangles.add( tri );
-	
-	  while(fscanf(file, "%d/%d/%d", &v, &t, &n) > 0) {
-
-	    v--; checkVindex(v); n--; t--;
-
-	    prevTri = tri;
-	    tri = new wfTriangle();
-
-	    tri->vindices[0] = prevTri->vindices[0];
-	    tri->tindices[0] = prevTri->tindices[0];
-	    tri->nindices[0] = prevTri->nindices[0];
-	    tri->vindices[1] = prevTri->vindices[2];
-	    tri->tindices[1] = prevTri->tindices[2];
-	    tri->nindices[1] = prevTri->nindices[2];
-	    tri->vindices[2] = v;
-	    tri->tindices[2] = t;
-	    tri->nindices[2] = n;
-
-	    currentGroup->triangles.add( tri );
-	  }
-	
-	} else if (sscanf(buf, "%d/%d", &v, &t) == 2) { /* v/t */
-
-	  numVT++;
-
-	  v--; checkVindex(v); t--;
-
-	  tri->vindices[0] = v;
-	  tri->tindices[0] = t;
-	  fscanf(file, "%d/%d", &v, &t);	v--; checkVindex(v); t--;
-	  tri->vindices[1] = v;
-	  tri->tindices[1] = t;
-	  fscanf(file, "%d/%d", &v, &t);	v--; checkVindex(v); t--;
-	  tri->vindices[2] = v;
-	  tri->tindices[2] = t;
-
-	  currentGroup->triangles.add( tri );
-
-	  while(fscanf(file, "%d/%d", &v, &t) > 0) {
-
-	    v--; checkVindex(v); t--;
-
-	    prevTri = tri;
-	    tri = new wfTriangle();
-
-	    tri->vindices[0] = prevTri->vindices[0];
-	    tri->tindices[0] = prevTri->tindices[0];
-	    tri->vindices[1] = prevTri->vindices[2];
-	    tri->tindices[1] = prevTri->tindices[2];
-	    tri->vindices[2] = v;
-	    tri->tindices[2] = t;
-
-	    currentGroup->triangles.add( tri );
-	  }
-	
-	} else {	/* v */
-
-	  numV++;
-
-	  sscanf(buf, "%d", &v); v--; checkVindex(v);
-	  tri->vindices[0] = v;
-	  fscanf(file, "%d", &v); v--; checkVindex(v);
-	  tri->vindices[1] = v;
-	  fscanf(file, "%d", &v); v--; checkVindex(v);
-	  tri->vindices[2] = v;
-
-	  currentGroup->triangles.add( tri );
-	
-	  while(fscanf(file, "%d", &v) > 0) {
-
-	    v--; checkVindex(v);
-
-	    prevTri = tri;
-	    tri = new wfTriangle();
-
-	    tri->vindices[0] = prevTri->vindices[0];
-	    tri->vindices[1] = prevTri->vindices[2];
-	    tri->vindices[2] = v;
-
-	    currentGroup->triangles.add( tri );
-	  }
-	}
-	break;
-
-      default:
-	cerr << "Warning: unrecognized Wavefront command on line " << lineNum << ": " << buf << endl;
-	break;
-      }
-    }
-  }
-
-  // Determine a consistent format for each vertex
-
-  hasVertexNormals   = (numVTN > 0 || numVN > 0);
-  hasVertexTexCoords = (numVTN > 0 || numVT > 0);
+  parse( filename );
 
   // Compute all face normals
 
@@ -559,9 +303,107 @@ public:
   bool operator == (const VertexSignature p) {
     return sig[0] == p.sig[0] && sig[1] == p.sig[1] && sig[2] == p.sig[2];
   }
+  unsigned int hash() {		// mix all bits of the indices
+    unsigned int h = sig[0] * 0x9e3779b1u ^ sig[1] * 0x85ebca77u ^ sig[2] * 0xc2b2ae3du;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+  }
 };
 
 
+#define NO_VERTEX 0xffffffff
+
+
+// Build the OpenGL vertex and face index buffers of one group.
+//
+// Each distinct signature (position, normal, and texture coordinate
+// indices) becomes one OpenGL vertex, in order of first use.  A hash
+// table from signatures to OpenGL vertices finds the earlier uses, so
+// this takes time linear in the number of triangles.
+
+void wfModel::buildGroupBuffers( wfGroup *thisGroup, unsigned int vertexSize, wfGroupBuffers &buffers )
+
+{
+  int numTriangles = thisGroup->triangles.size();
+
+  GLfloat *vertexBuffer = new GLfloat[ numTriangles * 3 * vertexSize ];
+  GLuint *faceIndexBuffer = new GLuint[ numTriangles * 3 ];
+
+  unsigned int nVerts = 0;
+  int nFaces = 0;
+
+  VertexSignature *vertSig = new VertexSignature[ numTriangles * 3 ];
+
+  // Hash table of indices into vertSig[], at most half full
+
+  unsigned int tableSize = 1;
+  while (tableSize < 2 * 3 * (unsigned int) numTriangles)
+    tableSize *= 2;
+
+  unsigned int *table = new unsigned int[ tableSize ];
+  for (unsigned int i=0; i<tableSize; i++)
+    table[i] = NO_VERTEX;
+
+  for (int j=0; j<numTriangles; j++) {
+
+    wfTriangle *tri = thisGroup->triangles[j];
+
+    for (int k=0; k<3; k++) {
+
+      // Find an already-stored vertex with this signature
+
+      VertexSignature vs;
+
+      vs.sig[0] = tri->vindices[k];
+      vs.sig[1] = tri->nindices[k];
+      vs.sig[2] = tri->tindices[k];
+
+      unsigned int slot = vs.hash() & (tableSize-1);
+      while (table[slot] != NO_VERTEX && !(vs == vertSig[ table[slot] ]))
+	slot = (slot+1) & (tableSize-1);
+
+      unsigned int l = table[slot];
+
+      if (l == NO_VERTEX) {	// none found ... create a new vertex
+
+	l = nVerts;
+	table[slot] = l;
+
+	* (vec3*) &vertexBuffer[nVerts*vertexSize] = vertices[ tri->vindices[k] ];
+	if (hasVertexNormals)
+	  * (vec3*) &vertexBuffer[nVerts*vertexSize+3] = normals[ tri->nindices[k] ];
+	if (hasVertexTexCoords) {
+	  if (hasVertexNormals)
+	    * (vec2*) &vertexBuffer[nVerts*vertexSize+6] = * (vec2*) &texcoords[ tri->tindices[k] ];
+	  else
+	    * (vec2*) &vertexBuffer[nVerts*vertexSize+3] = * (vec2*) &texcoords[ tri->tindices[k] ];
+	}
+
+	vertSig[ nVerts ] = vs;
+
+	nVerts++;
+      }
+
+      // Store this vertex index
+
+      faceIndexBuffer[ nFaces * 3 + k ] = l;
+    }
+
+    nFaces++;
+  }
+
+  delete [] vertSig;
+  delete [] table;
+
+  buffers.vertexBuffer    = vertexBuffer;
+  buffers.faceIndexBuffer = faceIndexBuffer;
+  buffers.nVerts          = nVerts;
+  buffers.nFaces          = nFaces;
+}
+
+
 
 void wfModel::setupVAO( TextureMode textureMode )
 
@@ -583,66 +425,45 @@ void wfModel::setupVAO( TextureMode textureMode )
   if (hasVertexTexCoords)
     vertexSize += 2;
 
-  // Process each group separately
+  // Build the buffers of all groups, with groups spread over threads
 
-  for (int i=0; i<groups.size(); i++) {
+  wfGroupBuffers *buffers = new wfGroupBuffers[ groups.size() ];
 
-    wfGroup *thisGroup = groups[i];
+  int numThreads = (numReadThreads > 0 ? numReadThreads : (int) std::thread::hardware_concurrency());
+  if (numThreads > groups.size())
+    numThreads = groups.size();
 
-    int numTriangles = thisGroup->triangles.size();
+  std::atomic<int> nextGroup( 0 );
 
-    if (numTriangles > 0) {
-      
-      GLfloat *vertexBuffer = new GLfloat[ numTriangles * 3 * vertexSize ];
-      GLuint *faceIndexBuffer = new GLuint[ numTriangles * 3 ];
+  auto buildGroups = [&]() {
+    int i;
+    while ((i = nextGroup++) < groups.size())
+      if (groups[i]->triangles.size() > 0)
+	buildGroupBuffers( groups[i], vertexSize, buffers[i] );
+  };
 
-      unsigned int nVerts = 0;
-      int nFaces = 0;
+  std::thread *threads = new std::thread[ numThreads > 1 ? numThreads-1 : 1 ];
 
-      VertexSignature *vertSig = new VertexSignature[ numTriangles * 3 ];
-
-      for (int j=0; j<thisGroup->triangles.size(); j++) {
-      
-	wfTriangle *tri = thisGroup->triangles[j];
+  for (int t=0; t<numThreads-1; t++)
+    threads[t] = std::thread( buildGroups );
+  buildGroups();
+  for (int t=0; t<numThreads-1; t++)
+    threads[t].join();
 
-	for (int k=0; k<3; k++) {
+  delete [] threads;
 
-	  // Find an already-stored vertex with this signature (brute force)
+  // Give them to OpenGL (on this thread, which has the context)
 
-	  VertexSignature vs;
-
-	  vs.sig[0] = tri->vindices[k];
-	  vs.sig[1] = tri->nindices[k];
-	  vs.sig[2] = tri->tindices[k];
-
-	  unsigned int l;
-	  for (l=0; l<nVerts; l++)
-	    if (vs == vertSig[l])
-	      break;
-
-	  if (l == nVerts) {	// none found ... create a new vertex
-	    * (vec3*) &vertexBuffer[nVerts*vertexSize] = vertices[ tri->vindices[k] ];
-	    if (hasVertexNormals)
-	      * (vec3*) &vertexBuffer[nVerts*vertexSize+3] = normals[ tri->nindices[k] ];
-	    if (hasVertexTexCoords) {
-	      if (hasVertexNormals)
-		* (vec2*) &vertexBuffer[nVerts*vertexSize+6] = * (vec2*) &texcoords[ tri->tindices[k] ];
-	      else
-		* (vec2*) &vertexBuffer[nVerts*vertexSize+3] = * (vec2*) &texcoords[ tri->tindices[k] ];
-	    }
-	  
-	    vertSig[ nVerts ] = vs;
-
-	    nVerts++;
-	  }
+  for (int i=0; i<groups.size(); i++) {
 
-	  // Store this vertex index
+    wfGroup *thisGroup = groups[i];
 
-	  faceIndexBuffer[ nFaces * 3 + k ] = l;
-	}
+    if (thisGroup->triangles.size() > 0) {
 
-	nFaces++;
-      }
+      GLfloat     *vertexBuffer    = buffers[i].vertexBuffer;
+      GLuint      *faceIndexBuffer = buffers[i].faceIndexBuffer;
+      unsigned int nVerts          = buffers[i].nVerts;
+      int          nFaces          = buffers[i].nFaces;
 
       // Set up the VAO
 
@@ -696,12 +517,13 @@ void wfModel::setupVAO( TextureMode textureMode )
 
       delete [] vertexBuffer;
       delete [] faceIndexBuffer;
-      delete [] vertSig;
 
       glBindVertexArray( 0 );
     }
   }
 
+  delete [] buffers;
+
   initTextures( textureMode );
 }
 
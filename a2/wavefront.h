@@ -127,6 +127,20 @@ class wfGroup {
 };
 
 
+/* The OpenGL vertices and face indices of a group, before they are
+ * given to OpenGL
+ */
+
+
+class wfGroupBuffers {
+ public:
+  GLfloat      *vertexBuffer;
+  GLuint       *faceIndexBuffer;
+  unsigned int  nVerts;
+  int           nFaces;
+};
+
+
 /* A model consisting of groups
  */
 
@@ -151,6 +165,8 @@ class wfModel {
   wfMaterial* findMaterial( char *name );            /* find a named material */
   wfGroup*    findGroup( char *name );               /* find a named group */
   void        readMaterialLibrary( char *filename ); /* read all materials */
+  void        parse( const char *filename );         /* read the OBJ file (in wavefrontParse.cpp) */
+  void        buildGroupBuffers( wfGroup *group, unsigned int vertexSize, wfGroupBuffers &buffers );
 
   int lineNum;
 
@@ -165,6 +181,7 @@ class wfModel {
 
   static bool newGroupWithNewMaterial; /* create a new group each time the material changes */
   static bool verticesAreCW;	       /* calculate opposite-to-usual face normals */
+  static int  numReadThreads;	       /* threads to parse a file and build its VAOs (0 = one per core) */
 
   vec3 min, max;		/* extents */
 
@@ -174,7 +191,7 @@ class wfModel {
     objToWorldTransform = identity4();
   }
 
-  wfModel( char *filename, TextureMode textureMode ) {
+  wfModel( const char *filename, TextureMode textureMode ) {
     texturesInitialized = false;
     pathname = mtllibname = NULL;
     objToWorldTransform = identity4();
@@ -185,7 +202,7 @@ class wfModel {
   ~wfModel() {
   }
 
-  void read( char *filename );         /* instantiate this model from a file */
+  void read( const char *filename );   /* instantiate this model from a file */
   void draw( GPUProgram * gpuProg );
   void setupVAO( TextureMode textureMode );
   void initTextures( TextureMode tm );        /* assign texture IDs and store all textures */
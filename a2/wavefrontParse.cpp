@@ -0,0 +1,738 @@
+/* wavefrontParse.cpp
+ *
+ * Fast reading of Wavefront OBJ files, for wfModel::read().
+ *
+ * The file is mapped into memory and split into chunks at line
+ * boundaries.  The chunks are parsed in parallel, each into its own
+ * arrays of vertices, normals, texture coordinates, and triangles.
+ * Commands that change the parser's state (g, usemtl, mtllib, and
+ * transform) are not applied while parsing, but are listed with their
+ * position among the chunk's triangles.  The chunks are then joined in
+ * order, and the commands applied to assign triangles to groups, so
+ * the model is the same as if the file were read line by line.
+ *
+ * Numbers are read by hand rather than with scanf().  A float is
+ * exactly what strtof() would give: the common cases are computed
+ * exactly in double precision, and the rest use strtof().
+ *
+ * All triangles are stored in one array, to which the groups point.
+ */
+
+
+#include "headers.h"
+#include "gpuProgram.h"
+#include "linalg.h"
+#include "mappedFile.h"
+
+#include <thread>
+#include <cmath>
+#include <cfloat>
+
+#include "wavefront.h"
+
+
+#define WF_MIN_CHUNK_SIZE (1 << 20) // bytes of file per parsing thread, at least
+#define WF_MAX_DIGITS     19	    // significant digits that fit in 64 bits
+
+
+int wfModel::numReadThreads = 0;
+
+
+// A command to be applied after parsing
+
+enum wfCommandType { WF_GROUP, WF_USEMTL, WF_MTLLIB, WF_TRANSFORM, WF_UNKNOWN, WF_MALFORMED };
+
+class wfCommand {
+ public:
+  wfCommandType type;
+  int           firstTriangle;	// index in the chunk of the first triangle after this command
+  const char   *line;		// start of the command's line
+  const char   *arg;		// rest of the line, after the command's name
+  const char   *argEnd;
+  float         transform[16];
+};
+
+
+// The results of parsing one chunk of the file
+
+class wfChunk {
+ public:
+  const char *start, *end;
+
+  seq<vec3>       vertices;
+  seq<vec3>       normals;
+  seq<vec3>       texcoords;
+  seq<wfTriangle> triangles;
+  seq<wfCommand>  commands;
+
+  int numVTN, numVT, numVN, numV; // faces of each vertex format
+
+  unsigned int maxVindex;	// largest vertex index in a face (or ~0 for a bad one)
+  const char  *maxVindexLine;
+
+  wfChunk() {
+    numVTN = numVT = numVN = numV = 0;
+    maxVindex = 0;
+    maxVindexLine = NULL;
+  }
+};
+
+
+enum wfFaceFormat { WF_V, WF_VT, WF_VN, WF_VTN };
+
+
+
+static inline bool isBlank( char c )
+
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+
+static inline bool isDigit( char c )
+
+{
+  return c >= '0' && c <= '9';
+}
+
+
+static inline const char *skipBlanks( const char *p, const char *end )
+
+{
+  while (p < end && isBlank(*p))
+    p++;
+  return p;
+}
+
+
+static inline const char *skipToken( const char *p, const char *end )
+
+{
+  while (p < end && *p != '\n' && !isBlank(*p))
+    p++;
+  return p;
+}
+
+
+// Position after the end of this line
+
+static inline const char *nextLine( const char *p, const char *end )
+
+{
+  const char *q = (const char *) memchr( p, '\n', end - p );
+  return (q != NULL ? q+1 : end);
+}
+
+
+static inline const char *endOfLine( const char *p, const char *end )
+
+{
+  const char *q = (const char *) memchr( p, '\n', end - p );
+  return (q != NULL ? q : end);
+}
+
+
+static const double powersOf10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+				     1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+
+// Read a float at 'p', after any blanks (and newlines, if
+// 'acrossLines').  Returns the position after it, or NULL if there is
+// no float there.
+//
+// With at most 19 significant digits and a power of ten up to 1e22,
+// both the digits and the power are exact doubles, so one multiply or
+// divide gives the correctly rounded double.  Rounding that to a float
+// is then correct unless the double is exactly halfway between two
+// floats (a double rounding), so that case and any others go to
+// strtof().
+
+static const char *scanFloat( const char *p, const char *end, float &result, bool acrossLines = false )
+
+{
+  while (p < end && (isBlank(*p) || (acrossLines && *p == '\n')))
+    p++;
+
+  const char *start = p;
+
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = (*p == '-');
+    p++;
+  }
+
+  unsigned long long mantissa = 0;
+  int  numDigits = 0;		// significant digits in mantissa
+  int  exponent = 0;
+  bool anyDigits = false;
+  bool exact = true;
+
+  for (; p < end && isDigit(*p); p++) {
+    anyDigits = true;
+    if (mantissa == 0 && *p == '0')
+      continue;
+    if (numDigits == WF_MAX_DIGITS)
+      exact = false;
+    else {
+      mantissa = 10 * mantissa + (*p - '0');
+      numDigits++;
+    }
+  }
+
+  if (p < end && *p == '.')
+    for (p++; p < end && isDigit(*p); p++) {
+      anyDigits = true;
+      if (mantissa == 0 && *p == '0')
+	exponent--;
+      else if (numDigits == WF_MAX_DIGITS)
+	exact = false;
+      else {
+	mantissa = 10 * mantissa + (*p - '0');
+	numDigits++;
+	exponent--;
+      }
+    }
+
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    const char *q = p+1;
+    bool negativeExp = false;
+    if (q < end && (*q == '-' || *q == '+')) {
+      negativeExp = (*q == '-');
+      q++;
+    }
+    if (q == end || !isDigit(*q))
+      exact = false;
+    int e = 0;
+    for (; q < end && isDigit(*q); q++)
+      if (e < 10000)
+	e = 10 * e + (*q - '0');
+    exponent += (negativeExp ? -e : e);
+    p = q;
+  }
+
+  // Anything else (inf, nan, hex, '1e', ...) or a number that isn't
+  // followed by a separator is left to strtof()
+
+  if (!anyDigits || (p < end && !isBlank(*p) && *p != '\n' && *p != '/'))
+    exact = false;
+
+  if (exact && mantissa == 0) {
+    result = (negative ? -0.0f : 0.0f);
+    return p;
+  }
+
+  if (exact && exponent >= -22 && exponent <= 22 && mantissa < (1ULL << 53)) {
+
+    double d = (exponent >= 0 ? mantissa * powersOf10[exponent] : mantissa / powersOf10[-exponent]);
+
+    unsigned long long bits;
+    memcpy( &bits, &d, sizeof(d) );
+
+    // A normal float whose double isn't on a float midpoint
+
+    if (d >= FLT_MIN && d <= FLT_MAX && (bits & 0x1fffffffULL) != 0x10000000ULL) {
+      result = (float) (negative ? -d : d);
+      return p;
+    }
+  }
+
+  // Slow path
+
+  char buf[128];
+  const char *tokenEnd = skipToken( start, end );
+  int len = tokenEnd - start;
+
+  if (len == 0 || len >= (int) sizeof(buf))
+    return NULL;
+
+  memcpy( buf, start, len );
+  buf[len] = '\0';
+
+  char *after;
+  result = strtof( buf, &after );
+
+  if (after == buf)
+    return NULL;
+
+  return start + (after - buf);
+}
+
+
+// Read an int at 'p'.  Returns the position after it, or NULL if
+// there is none.
+
+static inline const char *scanInt( const char *p, const char *end, int &result )
+
+{
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = (*p == '-');
+    p++;
+  }
+
+  if (p == end || !isDigit(*p))
+    return NULL;
+
+  int i = 0;
+  for (; p < end && isDigit(*p); p++)
+    i = 10 * i + (*p - '0');
+
+  result = (negative ? -i : i);
+  return p;
+}
+
+
+// Read one vertex of a face: "v", "v/t", "v//n" or "v/t/n"
+
+static inline const char *scanFaceVertex( const char *p, const char *end, int &v, int &t, int &n, wfFaceFormat &format )
+
+{
+  p = scanInt( p, end, v );
+  if (p == NULL)
+    return NULL;
+
+  t = n = 0;
+
+  if (p == end || *p != '/')
+    format = WF_V;
+
+  else if (p+1 < end && p[1] == '/') {
+    p = scanInt( p+2, end, n );
+    format = WF_VN;
+  }
+
+  else {
+    p = scanInt( p+1, end, t );
+    if (p != NULL && p < end && *p == '/') {
+      p = scanInt( p+1, end, n );
+      format = WF_VTN;
+    } else
+      format = WF_VT;
+  }
+
+  if (p != NULL && p < end && !isBlank(*p) && *p != '\n')
+    return NULL;
+
+  return p;
+}
+
+
+
+static void addCommand( wfChunk &chunk, wfCommandType type, const char *line, const char *arg, const char *end )
+
+{
+  wfCommand c;
+
+  c.type = type;
+  c.firstTriangle = chunk.triangles.size();
+  c.line = line;
+  c.arg = arg;
+  c.argEnd = endOfLine( arg, end );
+
+  chunk.commands.add( c );
+}
+
+
+
+// Parse the faces, vertices, and commands of one chunk
+
+static void parseChunk( wfChunk &chunk )
+
+{
+  const char *p = chunk.start, *end = chunk.end;
+  float x, y, z;
+
+  while (p < end) {
+
+    const char *line = p;
+
+    p = skipBlanks( p, end );
+
+    if (p == end)
+      break;
+
+    if (*p == '\n') {
+      p++;
+      continue;
+    }
+
+    const char *name = p;
+    p = skipToken( p, end );
+    int nameLen = p - name;
+
+    bool ok = true;
+
+    if (nameLen >= 9 && strncmp( name, "transform", 9 ) == 0) {
+
+      // Sixteen numbers, which may be on the following lines
+
+      addCommand( chunk, WF_TRANSFORM, line, p, end );
+      wfCommand &c = chunk.commands[ chunk.commands.size()-1 ];
+
+      for (int i=0; i<16 && p != NULL; i++)
+	p = scanFloat( p, end, c.transform[i], true );
+
+      if (p == NULL)
+	c.type = WF_MALFORMED;
+
+    } else switch (name[0]) {
+
+      case '#':			// comment
+      case 's':			// smoothing group ... ignore
+	break;
+
+      case 'v':			// v, vn, vt
+
+	if (nameLen == 1) {
+	  ok = ((p = scanFloat( p, end, x )) && (p = scanFloat( p, end, y )) && (p = scanFloat( p, end, z )));
+	  if (ok)
+	    chunk.vertices.add( vec3(x,y,z) );
+	} else if (name[1] == 'n') {
+	  ok = ((p = scanFloat( p, end, x )) && (p = scanFloat( p, end, y )) && (p = scanFloat( p, end, z )));
+	  if (ok)
+	    chunk.normals.add( vec3(x,y,z).normalize() );
+	} else if (name[1] == 't') {
+	  ok = ((p = scanFloat( p, end, x )) && (p = scanFloat( p, end, y )));
+	  if (ok)
+	    chunk.texcoords.add( vec3(x,y,0) );
+	}
+	break;
+
+      case 'm':			// mtllib filename
+	addCommand( chunk, WF_MTLLIB, line, p, end );
+	break;
+
+      case 'u':			// usemtl name
+	addCommand( chunk, WF_USEMTL, line, p, end );
+	break;
+
+      case 'g':			// group
+	addCommand( chunk, WF_GROUP, line, p, end );
+	break;
+
+      case 'f': {		// face
+
+	// A convex polygon is converted to a fan of triangles.  All
+	// vertices have the format of the first.
+
+	wfFaceFormat format = WF_V, f;
+	wfTriangle   tri;
+	int          numVerts = 0;
+
+	while (true) {
+
+	  p = skipBlanks( p, end );
+	  if (p == end || *p == '\n')
+	    break;
+
+	  int v, t, n;
+	  const char *q = scanFaceVertex( p, end, v, t, n, f );
+
+	  if (q == NULL || (numVerts > 0 && f != format))
+	    break;
+
+	  p = q;
+	  format = f;
+
+	  unsigned int vi = v-1;
+	  unsigned int ti = (format == WF_VT || format == WF_VTN ? t-1 : 0);
+	  unsigned int ni = (format == WF_VN || format == WF_VTN ? n-1 : 0);
+
+	  if (vi >= chunk.maxVindex) {
+	    chunk.maxVindex = vi;
+	    chunk.maxVindexLine = line;
+	  }
+
+	  if (numVerts < 2) {
+	    tri.vindices[numVerts] = vi;
+	    tri.tindices[numVerts] = ti;
+	    tri.nindices[numVerts] = ni;
+	  } else {
+	    if (numVerts > 2) {
+	      tri.vindices[1] = tri.vindices[2];
+	      tri.tindices[1] = tri.tindices[2];
+	      tri.nindices[1] = tri.nindices[2];
+	    }
+	    tri.vindices[2] = vi;
+	    tri.tindices[2] = ti;
+	    tri.nindices[2] = ni;
+	    tri.findex = 0;
+	    chunk.triangles.add( tri );
+	  }
+
+	  numVerts++;
+	}
+
+	if (numVerts < 3)
+	  ok = false;
+	else
+	  switch (format) {
+	  case WF_V:   chunk.numV++;   break;
+	  case WF_VT:  chunk.numVT++;  break;
+	  case WF_VN:  chunk.numVN++;  break;
+	  case WF_VTN: chunk.numVTN++; break;
+	  }
+
+	break;
+      }
+
+      default:
+	addCommand( chunk, WF_UNKNOWN, line, name, end );
+	break;
+      }
+
+    if (!ok)
+      addCommand( chunk, WF_MALFORMED, line, name, end );
+
+    p = nextLine( (p != NULL ? p : name), end );
+  }
+}
+
+
+
+// Line numbers of positions in the file, for messages.  Positions must
+// be asked for in increasing order.
+
+class wfLineCounter {
+
+  const char *pos;
+  int         line;
+
+ public:
+
+  wfLineCounter( const char *start ) {
+    pos = start;
+    line = 1;
+  }
+
+  int lineOf( const char *p ) {
+    for (; pos < p; pos++)
+      if (*pos == '\n')
+	line++;
+    return line;
+  }
+};
+
+
+// Copy the first word of [p,end) into buf
+
+static void firstWord( const char *p, const char *end, char *buf, int bufSize )
+
+{
+  p = skipBlanks( p, end );
+  const char *q = skipToken( p, end );
+
+  int len = q - p;
+  if (len > bufSize-1)
+    len = bufSize-1;
+
+  memcpy( buf, p, len );
+  buf[len] = '\0';
+}
+
+
+template <class T> static void joinChunks( seq<T> &all, seq<T> wfChunk::*part, wfChunk *chunks, int numChunks )
+
+{
+  int total = 0;
+  for (int i=0; i<numChunks; i++)
+    total += (chunks[i].*part).size();
+
+  all = seq<T>( total > 2 ? total : 2 );
+
+  for (int i=0; i<numChunks; i++) {
+    seq<T> &s = chunks[i].*part;
+    for (int j=0; j<s.size(); j++)
+      all.add( s[j] );
+  }
+}
+
+
+
+// Read the vertices, normals, texture coordinates, groups, and
+// materials of an OBJ file.  'groups' and 'materials' must already
+// have their defaults.
+
+void wfModel::parse( const char *filename )
+
+{
+  MappedFile file;
+
+  if (!file.open( filename )) {
+    cerr << "wfModel::read() failed: can't open data file '" << filename << "'." << endl;
+    exit(-1);
+  }
+
+  const char *start = file.data;
+  const char *end   = file.data + file.size;
+
+  // Split into chunks.  Each chunk starts on a 'v' or 'f' line, so
+  // that a multi-line command (i.e. transform) isn't split.
+
+  int numThreads = (numReadThreads > 0 ? numReadThreads : (int) std::thread::hardware_concurrency());
+  int numChunks  = file.size / WF_MIN_CHUNK_SIZE;
+
+  if (numChunks > numThreads)
+    numChunks = numThreads;
+  if (numChunks < 1)
+    numChunks = 1;
+
+  wfChunk *chunks = new wfChunk[ numChunks ];
+
+  const char *p = start;
+
+  for (int i=0; i<numChunks; i++) {
+
+    chunks[i].start = p;
+
+    if (i == numChunks-1)
+      p = end;
+    else {
+      const char *target = start + (file.size / numChunks) * (i+1);
+      if (target > p)
+	p = target;
+      p = nextLine( p, end );
+      while (p < end && *p != 'v' && *p != 'f')
+	p = nextLine( p, end );
+    }
+
+    chunks[i].end = p;
+  }
+
+  // Parse them
+
+  if (numChunks == 1)
+    parseChunk( chunks[0] );
+  else {
+    std::thread *threads = new std::thread[ numChunks-1 ];
+    for (int i=0; i<numChunks-1; i++)
+      threads[i] = std::thread( parseChunk, std::ref( chunks[i] ) );
+    parseChunk( chunks[numChunks-1] );
+    for (int i=0; i<numChunks-1; i++)
+      threads[i].join();
+    delete [] threads;
+  }
+
+  // Join them
+
+  joinChunks( vertices,  &wfChunk::vertices,  chunks, numChunks );
+  joinChunks( normals,   &wfChunk::normals,   chunks, numChunks );
+  joinChunks( texcoords, &wfChunk::texcoords, chunks, numChunks );
+
+  int numTriangles = 0;
+  int numVTN = 0, numVT = 0, numVN = 0, numV = 0;
+
+  for (int i=0; i<numChunks; i++) {
+    numTriangles += chunks[i].triangles.size();
+    numVTN += chunks[i].numVTN;
+    numVT  += chunks[i].numVT;
+    numVN  += chunks[i].numVN;
+    numV   += chunks[i].numV;
+  }
+
+  // Check vertex indices
+
+  wfLineCounter indexLines( start );
+
+  for (int i=0; i<numChunks; i++)
+    if (chunks[i].maxVindexLine != NULL && chunks[i].maxVindex >= (unsigned int) vertices.size()) {
+      lineNum = indexLines.lineOf( chunks[i].maxVindexLine );
+      checkVindex( chunks[i].maxVindex );
+    }
+
+  // All triangles in one array
+
+  wfTriangle *allTriangles = new wfTriangle[ numTriangles > 0 ? numTriangles : 1 ];
+  wfTriangle *next = allTriangles;
+
+  for (int i=0; i<numChunks; i++)
+    if (chunks[i].triangles.size() > 0) {
+      memcpy( next, &chunks[i].triangles[0], chunks[i].triangles.size() * sizeof(wfTriangle) );
+      next += chunks[i].triangles.size();
+    }
+
+  // Apply the commands in order, giving each group its triangles
+
+  wfGroup    *currentGroup    = groups[0];
+  wfMaterial *currentMaterial = materials[0];
+  int         nextGroupNum    = 0;
+
+  wfLineCounter lines( start );
+  char buf[1000];
+
+  wfTriangle *chunkTriangles = allTriangles;
+
+  for (int i=0; i<numChunks; i++) {
+
+    wfChunk &chunk = chunks[i];
+    int added = 0;
+
+    for (int j=0; j<=chunk.commands.size(); j++) {
+
+      // Add the triangles before this command to the current group
+
+      int upTo = (j < chunk.commands.size() ? chunk.commands[j].firstTriangle : chunk.triangles.size());
+
+      for (; added < upTo; added++)
+	currentGroup->triangles.add( &chunkTriangles[added] );
+
+      if (j == chunk.commands.size())
+	break;
+
+      wfCommand &c = chunk.commands[j];
+
+      switch (c.type) {
+
+      case WF_TRANSFORM:
+	for (int r=0; r<4; r++)
+	  for (int col=0; col<4; col++)
+	    objToWorldTransform[r][col] = c.transform[ 4*r + col ];
+	break;
+
+      case WF_MTLLIB:
+	firstWord( c.arg, c.argEnd, buf, sizeof(buf) );
+	mtllibname = strdup(buf);
+	readMaterialLibrary( buf );
+	break;
+
+      case WF_USEMTL:
+	if (newGroupWithNewMaterial) {
+	  char buffer[100];
+	  sprintf( buffer, "g%d", nextGroupNum++ );
+	  currentGroup = findGroup( buffer );
+	}
+	firstWord( c.arg, c.argEnd, buf, sizeof(buf) );
+	currentGroup->material = currentMaterial = findMaterial( buf );
+	break;
+
+      case WF_GROUP:
+	firstWord( c.arg, c.argEnd, buf, sizeof(buf) );
+	if (buf[0] == '\0')
+	  currentGroup = findGroup( "default" );
+	else
+	  currentGroup = findGroup( buf );
+	currentGroup->material = currentMaterial;
+	break;
+
+      case WF_UNKNOWN:
+	firstWord( c.arg, c.argEnd, buf, sizeof(buf) );
+	cerr << "Warning: unrecognized Wavefront command on line " << lines.lineOf( c.line ) << ": " << buf << endl;
+	break;
+
+      case WF_MALFORMED:
+	firstWord( c.arg, c.argEnd, buf, sizeof(buf) );
+	cerr << "Warning: malformed Wavefront command on line " << lines.lineOf( c.line ) << ": " << buf << endl;
+	break;
+      }
+    }
+
+    chunkTriangles += chunk.triangles.size();
+  }
+
+  delete [] chunks;
+
+  // Determine a consistent format for each vertex
+
+  hasVertexNormals   = (numVTN > 0 || numVN > 0);
+  hasVertexTexCoords = (numVTN > 0 || numVT > 0);
+}
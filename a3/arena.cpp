@@ -0,0 +1,140 @@
+// arena.cpp
+
+
+#include "arena.h"
+#include "threadPool.h"
+
+
+void Arena::setup( int numThreads )
+
+{
+  clear();
+
+  numSlots = numThreads + 1;
+  slots = new ArenaSlot[ numSlots ];
+}
+
+
+ArenaSlot &Arena::thisSlot()
+
+{
+  int i = ThreadPool::workerIndex() + 1;
+
+  if (i >= numSlots)
+    i = 0;
+
+  return slots[i];
+}
+
+
+
+// Allocate 'bytes', aligned to ARENA_ALIGNMENT.  The memory is not
+// initialized.
+
+void *Arena::alloc( size_t bytes )
+
+{
+  if (slots == NULL)
+    setup( 0 );
+
+  bytes = (bytes + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+
+  ArenaSlot &s = thisSlot();
+
+  if (s.current < 0 || s.blocks[s.current].used + bytes > s.blocks[s.current].size) {
+
+    // Move to the next block.  A block beyond the current one is
+    // unused (it was released), so it can be replaced if too small.
+
+    int    next = s.current + 1;
+    size_t size = (bytes > ARENA_BLOCK_SIZE ? bytes : ARENA_BLOCK_SIZE);
+
+    if (next == s.blocks.size()) {
+      ArenaBlock b;
+      b.data = (char *) malloc( size );
+      b.size = size;
+      s.blocks.add( b );
+    } else if (s.blocks[next].size < bytes) {
+      free( s.blocks[next].data );
+      s.blocks[next].data = (char *) malloc( size );
+      s.blocks[next].size = size;
+    }
+
+    if (s.blocks[next].data == NULL) {
+      cerr << "Arena: out of memory allocating " << size << " bytes" << endl;
+      exit(1);
+    }
+
+    s.blocks[next].used = 0;
+    s.current = next;
+  }
+
+  ArenaBlock &b = s.blocks[s.current];
+
+  void *p = b.data + b.used;
+  b.used += bytes;
+
+  return p;
+}
+
+
+
+ArenaMark Arena::mark()
+
+{
+  if (slots == NULL)
+    setup( 0 );
+
+  ArenaSlot &s = thisSlot();
+
+  ArenaMark m;
+  m.block = s.current;
+  m.used  = (s.current >= 0 ? s.blocks[s.current].used : 0);
+
+  return m;
+}
+
+
+void Arena::release( ArenaMark m )
+
+{
+  ArenaSlot &s = thisSlot();
+
+  s.current = m.block;
+
+  if (m.block >= 0)
+    s.blocks[m.block].used = m.used;
+}
+
+
+
+// Free all blocks
+
+void Arena::clear()
+
+{
+  if (slots == NULL)
+    return;
+
+  for (int i=0; i<numSlots; i++)
+    for (int j=0; j<slots[i].blocks.size(); j++)
+      free( slots[i].blocks[j].data );
+
+  delete [] slots;
+
+  slots = NULL;
+  numSlots = 0;
+}
+
+
+size_t Arena::bytesAllocated()
+
+{
+  size_t total = 0;
+
+  for (int i=0; i<numSlots; i++)
+    for (int j=0; j<slots[i].blocks.size(); j++)
+      total += slots[i].blocks[j].size;
+
+  return total;
+}
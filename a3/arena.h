@@ -0,0 +1,92 @@
+/* arena.h
+ *
+ * A bump allocator for data that is built once and freed all at once,
+ * such as the pointer tree of a BVH while it is being built.
+ *
+ * Memory comes in blocks of ARENA_BLOCK_SIZE bytes (or larger, for
+ * larger requests).  Allocation just advances a pointer in the current
+ * block, and nothing is freed individually: clear() frees every block.
+ *
+ * Each threadPool worker (and the one thread outside the pool) has its
+ * own blocks, so threads allocate without locking.
+ *
+ * mark() and release() make the arena a stack, for scratch memory that
+ * is used by one call and then reused by the next.  release() goes
+ * back to a mark() made by the same thread, freeing everything this
+ * thread allocated since, but keeps the blocks for reuse.  A thread
+ * that runs other tasks while waiting (see ThreadPool::wait()) must
+ * only release what it marked, which nested tasks do if each releases
+ * its own scratch before returning.
+ */
+
+
+#ifndef ARENA_H
+#define ARENA_H
+
+
+#include <cstddef>
+#include "seq.h"
+
+
+#define ARENA_BLOCK_SIZE (256 * 1024)
+#define ARENA_ALIGNMENT  16
+
+
+class ArenaBlock {
+ public:
+  char  *data;
+  size_t size;
+  size_t used;
+};
+
+
+class ArenaSlot {		// blocks of one thread
+ public:
+  seq<ArenaBlock> blocks;
+  int current;			// index of the block being allocated from, or -1
+  ArenaSlot() { current = -1; }
+};
+
+
+class ArenaMark {
+ public:
+  int    block;
+  size_t used;
+};
+
+
+class Arena {
+
+  ArenaSlot *slots;		// slots[0] is for threads outside the pool
+  int        numSlots;
+
+  ArenaSlot &thisSlot();
+
+ public:
+
+  Arena() {
+    slots = NULL;
+    numSlots = 0;
+  }
+
+  ~Arena() {
+    clear();
+  }
+
+  void setup( int numThreads );	// call once, with the threadPool size, before allocating
+
+  void *alloc( size_t bytes );
+
+  template <class T> T *alloc( int n ) {
+    return (T *) alloc( n * sizeof(T) );
+  }
+
+  ArenaMark mark();
+  void      release( ArenaMark m );
+
+  void   clear();
+  size_t bytesAllocated();	// in all blocks
+};
+
+
+#endif
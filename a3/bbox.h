@@ -8,6 +8,7 @@
 
 
 #include "linalg.h"
+#include <cfloat>
 
 
 class BBox {
@@ -24,6 +25,38 @@ class BBox {
     max = c1;
   }
 
+  void makeEmpty() {		// box that includes nothing
+    min = vec3(  FLT_MAX,  FLT_MAX,  FLT_MAX );
+    max = vec3( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+  }
+
+  void include( vec3 p ) {	// grow to include a point
+    if (p.x < min.x) min.x = p.x;
+    if (p.y < min.y) min.y = p.y;
+    if (p.z < min.z) min.z = p.z;
+    if (p.x > max.x) max.x = p.x;
+    if (p.y > max.y) max.y = p.y;
+    if (p.z > max.z) max.z = p.z;
+  }
+
+  void include( BBox &b ) {	// grow to include another box
+    if (b.min.x <= b.max.x) {
+      include( b.min );
+      include( b.max );
+    }
+  }
+
+  vec3 centre() {
+    return 0.5 * (min + max);
+  }
+
+  float area() {		// surface area (0 for an empty box)
+    if (min.x > max.x)
+      return 0;
+    vec3 d = max - min;
+    return 2 * (d.x*d.y + d.y*d.z + d.z*d.x);
+  }
+
   void renderGL( mat4 &WCS_to_CCS ); 
 };
 
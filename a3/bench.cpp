@@ -0,0 +1,493 @@
+// bench.cpp
+//
+// Benchmark over a list of worlds.  See bench.h.
+
+
+#include "headers.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "bench.h"
+#include "seq.h"
+#include "threadPool.h"
+#include "bvh.h"
+
+#ifdef _WIN32
+  #include <windows.h>
+  #include <psapi.h>
+  #ifdef _MSC_VER
+    #pragma comment( lib, "psapi.lib" )
+  #endif
+  #define NULL_DEVICE "NUL"
+#else
+  #include <sys/resource.h>
+  #define NULL_DEVICE "/dev/null"
+#endif
+
+
+// Measurements of one world
+
+class BenchResult {
+
+ public:
+
+  string    world;
+  double    loadSeconds;	// reading the world, including bvhBuildSeconds
+  double    bvhBuildSeconds;	// building all BVHs
+  double    renderSeconds;
+  long long rays;
+  long      peakRSS;		// KB
+
+  double mraysPerSecond() {
+    return (renderSeconds > 0 ? rays / renderSeconds / 1e6 : 0);
+  }
+};
+
+
+// Settings of a benchmark, which a baseline must match
+
+class BenchSettings {
+
+ public:
+
+  double width, height, samples, seed, threads, runs;
+  string kernel;
+};
+
+
+// Peak resident memory of this process, in KB
+
+static long peakRSS()
+
+{
+#ifdef _WIN32
+
+  PROCESS_MEMORY_COUNTERS pmc;
+
+  if (!GetProcessMemoryInfo( GetCurrentProcess(), &pmc, sizeof(pmc) ))
+    return 0;
+
+  return (long) (pmc.PeakWorkingSetSize / 1024);
+
+#else
+
+  struct rusage usage;
+
+  if (getrusage( RUSAGE_SELF, &usage ) != 0)
+    return 0;
+
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024; // bytes on macOS
+#else
+  return usage.ru_maxrss;
+#endif
+
+#endif
+}
+
+
+
+bool writeBenchRecord( const char *filename, double loadSeconds, double buildSeconds, double renderSeconds, long long rays )
+
+{
+  FILE *out = fopen( filename, "a" );
+  if (out == NULL) {
+    cerr << "Could not open " << filename << " for writing." << endl;
+    return false;
+  }
+
+  fprintf( out, "%.9g %.9g %.9g %lld %ld\n", loadSeconds, buildSeconds, renderSeconds, rays, peakRSS() );
+  fclose( out );
+
+  return true;
+}
+
+
+
+// Render 'world' once, in a new process running 'program', and return
+// its measurements in 'r'.  The image goes to 'imageFile' and the
+// measurements come back through 'recordFile'.
+
+static bool runWorld( const char *program, const char *world, int numThreads, const char *imageFile, const char *recordFile, BenchResult &r )
+
+{
+  char settings[200];
+  sprintf( settings, " --headless --no-mesh-cache --width %d --height %d --samples %d --seed 0 -j %d",
+	   BENCH_WIDTH, BENCH_HEIGHT, BENCH_SAMPLES, numThreads );
+
+  string command = string( "\"" ) + program + "\"" + settings
+    + " -o \"" + imageFile + "\" --bench-record \"" + recordFile + "\" \"" + world + "\" > " + NULL_DEVICE;
+
+  remove( recordFile );
+
+  if (system( command.c_str() ) != 0) {
+    cerr << "Failed: " << command << endl;
+    return false;
+  }
+
+  FILE *in = fopen( recordFile, "r" );
+  if (in == NULL) {
+    cerr << "No measurements from " << command << endl;
+    return false;
+  }
+
+  int n = fscanf( in, "%lf %lf %lf %lld %ld", &r.loadSeconds, &r.bvhBuildSeconds, &r.renderSeconds, &r.rays, &r.peakRSS );
+
+  fclose( in );
+  remove( recordFile );
+  remove( imageFile );
+
+  r.world = world;
+
+  return (n == 5);
+}
+
+
+
+// JSON strings: only '\' and '"' can occur in a world's filename
+
+static string jsonEscape( const string &s )
+
+{
+  string out;
+
+  for (int i=0; i<(int) s.size(); i++) {
+    if (s[i] == '\\' || s[i] == '"')
+      out += '\\';
+    out += s[i];
+  }
+
+  return out;
+}
+
+
+// Find '"key": number' or '"key": "string"' in one line of a results
+// file
+
+static bool jsonNumber( const char *line, const char *key, double &value )
+
+{
+  string pattern = string( "\"" ) + key + "\": ";
+
+  const char *p = strstr( line, pattern.c_str() );
+  if (p == NULL)
+    return false;
+
+  value = atof( p + pattern.size() );
+  return true;
+}
+
+
+static bool jsonString( const char *line, const char *key, string &value )
+
+{
+  string pattern = string( "\"" ) + key + "\": \"";
+
+  const char *p = strstr( line, pattern.c_str() );
+  if (p == NULL)
+    return false;
+
+  value = "";
+
+  for (p += pattern.size(); *p != '\0' && *p != '"'; p++) {
+    if (*p == '\\' && p[1] != '\0')
+      p++;
+    value += *p;
+  }
+
+  return true;
+}
+
+
+
+// Read the results of an earlier --bench, which have the settings on
+// one line and then one world per line
+
+static bool readBaseline( const char *filename, seq<BenchResult> &baseline, BenchSettings &settings )
+
+{
+  FILE *in = fopen( filename, "r" );
+  if (in == NULL) {
+    cerr << "Could not open baseline " << filename << endl;
+    return false;
+  }
+
+  char line[10000];
+  bool haveSettings = false;
+
+  while (fgets( line, sizeof(line), in ) != NULL) {
+
+    BenchResult r;
+    double rays, rss;
+
+    if (strstr( line, "\"settings\": " ) != NULL)
+      haveSettings = (jsonNumber( line, "width", settings.width ) &&
+		      jsonNumber( line, "height", settings.height ) &&
+		      jsonNumber( line, "samples", settings.samples ) &&
+		      jsonNumber( line, "seed", settings.seed ) &&
+		      jsonNumber( line, "threads", settings.threads ) &&
+		      jsonNumber( line, "runs", settings.runs ) &&
+		      jsonString( line, "kernel", settings.kernel ));
+
+    else if (jsonString( line, "world", r.world ) &&
+	jsonNumber( line, "loadSeconds", r.loadSeconds ) &&
+	jsonNumber( line, "bvhBuildSeconds", r.bvhBuildSeconds ) &&
+	jsonNumber( line, "renderSeconds", r.renderSeconds ) &&
+	jsonNumber( line, "rays", rays ) &&
+	jsonNumber( line, "peakRSSKB", rss )) {
+      r.rays = (long long) rays;
+      r.peakRSS = (long) rss;
+      baseline.add( r );
+    }
+  }
+
+  fclose( in );
+
+  if (!haveSettings) {
+    cerr << "Baseline " << filename << " has no settings." << endl;
+    return false;
+  }
+
+  return true;
+}
+
+
+// Report each setting that differs from the baseline's
+
+static bool sameSettings( BenchSettings &a, BenchSettings &base )
+
+{
+  bool same = true;
+
+#define COMPARE(field)							\
+  if (a.field != base.field) {						\
+    cerr << "  " #field ": " << a.field << ", baseline " << base.field << endl; \
+    same = false;							\
+  }
+
+  COMPARE( width );
+  COMPARE( height );
+  COMPARE( samples );
+  COMPARE( seed );
+  COMPARE( threads );
+  COMPARE( runs );
+  COMPARE( kernel );
+
+#undef COMPARE
+
+  return same;
+}
+
+
+
+// Is a time worse than its baseline by more than the tolerance (and
+// by more than timer noise)?
+
+static bool slower( double seconds, double baseSeconds, double tolerance )
+
+{
+  return (seconds > baseSeconds * (1+tolerance) && seconds - baseSeconds > BENCH_MIN_SECONDS);
+}
+
+
+
+int runBenchmark( int argc, char **argv )
+
+{
+  const char *program = argv[0];
+
+  const char *outputFilename   = "bench.json";
+  const char *baselineFilename = NULL;
+  double      tolerance        = BENCH_TOLERANCE;
+  int         numRuns          = BENCH_RUNS;
+  int         numThreads       = ThreadPool::defaultNumThreads();
+  seq<char *> worlds;
+
+  for (int i=1; i<argc; i++)
+    if (strcmp( argv[i], "--bench" ) == 0)
+      ;
+    else if (strcmp( argv[i], "-o" ) == 0 && i+1 < argc)
+      outputFilename = argv[++i];
+    else if (strcmp( argv[i], "--baseline" ) == 0 && i+1 < argc)
+      baselineFilename = argv[++i];
+    else if (strcmp( argv[i], "--tolerance" ) == 0 && i+1 < argc)
+      tolerance = atof( argv[++i] );
+    else if (strcmp( argv[i], "--runs" ) == 0 && i+1 < argc)
+      numRuns = atoi( argv[++i] );
+    else if (strcmp( argv[i], "-j" ) == 0 && i+1 < argc)
+      numThreads = atoi( argv[++i] );
+    else if (argv[i][0] == '-')
+      cerr << "Unrecognized --bench option " << argv[i] << endl;
+    else
+      worlds.add( argv[i] );
+
+  if (worlds.size() == 0) {
+    cerr << "Usage: " << program << " --bench [-o results.json] [--baseline old.json] [--tolerance #] [--runs #] [-j #] world ..." << endl;
+    return 1;
+  }
+
+  if (numRuns < 1)
+    numRuns = 1;
+
+  BenchSettings settings;
+
+  settings.width   = BENCH_WIDTH;
+  settings.height  = BENCH_HEIGHT;
+  settings.samples = BENCH_SAMPLES;
+  settings.seed    = 0;
+  settings.threads = numThreads;
+  settings.runs    = numRuns;
+  settings.kernel  = BVH::kernelName( BVH::kernel );
+
+  // Times are only comparable with the same settings
+
+  seq<BenchResult> baseline;
+  BenchSettings    baseSettings;
+
+  if (baselineFilename != NULL) {
+
+    if (!readBaseline( baselineFilename, baseline, baseSettings ))
+      return 1;
+
+    if (!sameSettings( settings, baseSettings )) {
+      cerr << "These settings differ from those of baseline " << baselineFilename
+	   << ", so it can't be compared.  Use the baseline's settings, or make a new baseline." << endl;
+      return 1;
+    }
+  }
+
+  string imageFile  = string( outputFilename ) + ".ppm";
+  string recordFile = string( outputFilename ) + ".run";
+
+  // Run each world, keeping the best of its runs for each measurement
+
+  seq<BenchResult> results;
+  bool failed = false;
+
+  printf( "%-24s %9s %9s %9s %9s %9s\n", "world", "load s", "build s", "render s", "Mrays/s", "peak MB" );
+  fflush( stdout );		// before any errors from the runs
+
+  for (int w=0; w<worlds.size(); w++) {
+
+    BenchResult best;
+
+    int run;
+    for (run=0; run<numRuns; run++) {
+
+      BenchResult r;
+
+      if (!runWorld( program, worlds[w], numThreads, imageFile.c_str(), recordFile.c_str(), r ))
+	break;
+
+      if (run == 0)
+	best = r;
+      else {
+	if (r.loadSeconds     < best.loadSeconds)     best.loadSeconds     = r.loadSeconds;
+	if (r.bvhBuildSeconds < best.bvhBuildSeconds) best.bvhBuildSeconds = r.bvhBuildSeconds;
+	if (r.renderSeconds   < best.renderSeconds)   best.renderSeconds   = r.renderSeconds;
+	if (r.peakRSS         < best.peakRSS)         best.peakRSS         = r.peakRSS;
+      }
+    }
+
+    if (run < numRuns) {
+      failed = true;
+      continue;
+    }
+
+    results.add( best );
+
+    printf( "%-24s %9.4f %9.4f %9.4f %9.2f %9.1f\n", best.world.c_str(),
+	    best.loadSeconds, best.bvhBuildSeconds, best.renderSeconds, best.mraysPerSecond(), best.peakRSS / 1024.0 );
+    fflush( stdout );
+  }
+
+  // Write the results, comparing each world with its baseline
+
+  FILE *out = fopen( outputFilename, "w" );
+  if (out == NULL) {
+    cerr << "Could not open " << outputFilename << " for writing." << endl;
+    return 1;
+  }
+
+  fprintf( out, "{\n" );
+  fprintf( out, "  \"settings\": { \"width\": %g, \"height\": %g, \"samples\": %g, \"seed\": %g, \"threads\": %g, \"runs\": %g, \"kernel\": \"%s\" },\n",
+	   settings.width, settings.height, settings.samples, settings.seed, settings.threads, settings.runs, settings.kernel.c_str() );
+
+  if (baselineFilename != NULL)
+    fprintf( out, "  \"baseline\": \"%s\",\n  \"tolerance\": %g,\n", jsonEscape( baselineFilename ).c_str(), tolerance );
+
+  fprintf( out, "  \"worlds\": [\n" );
+
+  int numRegressions = 0;
+  int numMissing     = 0;	// worlds not in the baseline
+
+  for (int i=0; i<results.size(); i++) {
+
+    BenchResult &r = results[i];
+
+    fprintf( out, "    { \"world\": \"%s\", \"loadSeconds\": %.6g, \"bvhBuildSeconds\": %.6g, \"renderSeconds\": %.6g, \"rays\": %lld, \"mraysPerSecond\": %.6g, \"peakRSSKB\": %ld",
+	     jsonEscape( r.world ).c_str(), r.loadSeconds, r.bvhBuildSeconds, r.renderSeconds, r.rays, r.mraysPerSecond(), r.peakRSS );
+
+    int b;
+    for (b=0; b<baseline.size(); b++)
+      if (baseline[b].world == r.world)
+	break;
+
+    if (b < baseline.size()) {
+
+      BenchResult &base = baseline[b];
+
+      seq<const char *> worse;
+
+      if (slower( r.loadSeconds, base.loadSeconds, tolerance ))
+	worse.add( "loadSeconds" );
+      if (slower( r.bvhBuildSeconds, base.bvhBuildSeconds, tolerance ))
+	worse.add( "bvhBuildSeconds" );
+      if (slower( r.renderSeconds, base.renderSeconds, tolerance ))
+	worse.add( "renderSeconds" );
+      if (r.mraysPerSecond() * (1+tolerance) < base.mraysPerSecond() && fabs( r.renderSeconds - base.renderSeconds ) > BENCH_MIN_SECONDS)
+	worse.add( "mraysPerSecond" );
+      if (r.peakRSS > base.peakRSS * (1+tolerance))
+	worse.add( "peakRSSKB" );
+
+      fprintf( out, ", \"baselineRenderSeconds\": %.6g, \"baselineMraysPerSecond\": %.6g, \"baselinePeakRSSKB\": %ld, \"regressions\": [",
+	       base.renderSeconds, base.mraysPerSecond(), base.peakRSS );
+
+      for (int k=0; k<worse.size(); k++)
+	fprintf( out, "%s\"%s\"", (k > 0 ? ", " : " "), worse[k] );
+
+      fprintf( out, "%s]", (worse.size() > 0 ? " " : "") );
+
+      if (worse.size() > 0) {
+	printf( "REGRESSION %s:", r.world.c_str() );
+	for (int k=0; k<worse.size(); k++)
+	  printf( " %s", worse[k] );
+	printf( " (render %.4f s, baseline %.4f s)\n", r.renderSeconds, base.renderSeconds );
+	numRegressions++;
+      }
+
+    } else if (baselineFilename != NULL) {
+
+      fprintf( out, ", \"baselineMissing\": true" );
+      printf( "NOT IN BASELINE %s\n", r.world.c_str() );
+      numMissing++;
+    }
+
+    fprintf( out, " }%s\n", (i < results.size()-1 ? "," : "") );
+  }
+
+  fprintf( out, "  ],\n  \"regressions\": %d,\n  \"missingFromBaseline\": %d\n}\n", numRegressions, numMissing );
+  fclose( out );
+
+  printf( "wrote %s", outputFilename );
+  if (baselineFilename != NULL) {
+    printf( "; %d of %d worlds regressed against %s", numRegressions, results.size(), baselineFilename );
+    if (numMissing > 0)
+      printf( ", and %d aren't in it", numMissing );
+  }
+  printf( "\n" );
+
+  return (failed || numRegressions > 0 || numMissing > 0 ? 1 : 0);
+}
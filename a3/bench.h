@@ -0,0 +1,43 @@
+/* bench.h
+ *
+ * Benchmark of the ray tracer over a list of worlds.
+ *
+ *   ./rt --bench [-o results.json] [--baseline old.json] [--tolerance #] [--runs #] [-j #] world ...
+ *
+ * Each world is rendered headless with fixed settings (BENCH_WIDTH x
+ * BENCH_HEIGHT, BENCH_SAMPLES x BENCH_SAMPLES samples, sampler seed 0,
+ * no mesh cache) in a process of its own, so that its peak memory is
+ * its own.  Each world is run several times and the fastest run is
+ * kept.  The results are written as JSON, one world per line.
+ *
+ * With a baseline (a file written earlier by --bench), each world is
+ * compared with its baseline entry, and a regression is flagged if it
+ * got slower, or used more memory, by more than the tolerance
+ * fraction (default BENCH_TOLERANCE).  runBenchmark() then returns 1,
+ * so that 'make bench' fails.  It also fails if a world isn't in the
+ * baseline, and refuses to compare at all if the baseline was run
+ * with other settings (size, samples, threads, runs, BVH kernel).
+ */
+
+
+#ifndef BENCH_H
+#define BENCH_H
+
+
+#define BENCH_WIDTH     480
+#define BENCH_HEIGHT    320
+#define BENCH_SAMPLES   2
+#define BENCH_RUNS      3
+#define BENCH_TOLERANCE 0.10
+#define BENCH_MIN_SECONDS 0.005	// smaller differences in time are noise, never regressions
+
+
+int  runBenchmark( int argc, char **argv );
+
+// In the process rendering one world, after rendering: append the
+// measurements to 'filename' for runBenchmark() to collect
+
+bool writeBenchRecord( const char *filename, double loadSeconds, double buildSeconds, double renderSeconds, long long rays );
+
+
+#endif
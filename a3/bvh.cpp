@@ -3,12 +3,98 @@
 
 #include "bvh.h"
 #include "triangle.h"
+#include "perfCounters.h"
+
+#include <chrono>
+#include <cstring>
+#include <new>
 
 
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
 
 
+BVHBuilder BVH::builder      = KMEANS_BUILDER;
+int        BVH::sahNumBins   = 16;
+int        BVH::sahLeafSize  = 4;
+float      BVH::sahCostRatio = 1.0;
+unsigned int BVH::buildSeed  = 0;
+
+float BVH::totalBuildTime = 0;
+
+
+// Subtrees with at least this many triangles are built as separate
+// threadPool tasks.  Smaller ones aren't worth a task.
+
+#define PARALLEL_BUILD_MIN 4096
+
+
+void BVH::buildTree()
+
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  if (triangles.size() == 0)
+    root = NULL;
+  else {
+
+    // The builders allocate from a region of the arenas for each thread
+
+    int numThreads = (threadPool != NULL ? threadPool->size() : 0);
+
+    nodeArena.setup( numThreads );
+    scratchArena.setup( numThreads );
+
+    // Create a list of all triangle indices.  The builders partition
+    // it in place, and each leaf points to its part.
+
+    int *triangleIndices = nodeArena.alloc<int>( triangles.size() );
+    for (int i=0; i<triangles.size(); i++)
+      triangleIndices[i] = i;
+
+    // Build the tree
+
+    if (builder == SAH_BUILDER)
+      root = buildSubtreeSAH( triangleIndices, triangles.size(), 0 );
+    else
+      root = buildSubtree( triangleIndices, triangles.size(), 0, buildSeed );
+
+    scratchArena.clear();
+
+    // Compact it for raytracing
+
+    flattenTree();
+    buildWideTree();
+    buildTriBlocks();
+  }
+
+  buildTime = std::chrono::duration<float>( std::chrono::steady_clock::now() - start ).count();
+  totalBuildTime += buildTime;
+}
+
+
+
+// Use a flattened tree that was built earlier, e.g. one read from a
+// mesh cache.  'triangles' must already be in the tree's order.  The
+// BVH takes ownership of 'flatNodes'.
+
+void BVH::setFlatTree( BVH_flatNode *flatNodes, int n, int stack )
+
+{
+  if (nodes != NULL)
+    delete [] nodes;
+
+  nodes = flatNodes;
+  numNodes = n;
+  stackSize = stack;
+
+  if (numNodes > 0) {
+    buildWideTree();
+    buildTriBlocks();
+  }
+}
+
+
 
 // Build the BVH
 //
@@ -21,40 +107,80 @@
 #define NUM_RANDOM_CANDIDATES     20 // number of candidates for next random seed of K seeds
 #define NUM_CLUSTERING_ITERATIONS  4 // number of times to shift cluster means
 #define LEAF_COUNT_THRESHOLD       2 // max number of triangles in a leaf
+#define CLUSTER_CHUNK           8192 // triangles per task when clustering a large node
+
+
+// Random numbers for the k-means builder.  Each node has its own
+// generator, seeded from its parent's seed and its position among the
+// parent's children, so the tree doesn't depend on the order in which
+// the threads build the nodes.
+
+static inline unsigned int pcgHash( unsigned int v )
+
+{
+  unsigned int state = v * 747796405u + 2891336453u;
+  unsigned int word  = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+  return (word >> 22u) ^ word;
+}
+
+
+static inline int randomIndex( unsigned int &state, int n )
+
+{
+  state = pcgHash( state );
+  return state % n;
+}
+
 
+static inline unsigned int childSeed( unsigned int seed, int child )
 
+{
+  return pcgHash( seed ^ pcgHash( child ) );
+}
+
+
+
+BVH_node * BVH::newNode()
+
+{
+  return new (nodeArena.alloc( sizeof(BVH_node) )) BVH_node();
+}
 
-BVH_node * BVH::makeLeafNode( seq<int> &triangleIndices )
+
+BVH_node * BVH::makeLeafNode( int *triangleIndices, int numTriangles )
 
 {
-  BVH_node *n = new BVH_node();
+  BVH_node *n = newNode();
   
   n->isLeaf    = true;
-  n->triangles = new seq<int>( triangleIndices ); // copy constructor
-  n->bbox      = trianglesBBox( triangleIndices );
+  n->count     = numTriangles;
+  n->triangles = triangleIndices; // part of the list being partitioned
+  n->bbox      = trianglesBBox( triangleIndices, numTriangles );
     
   return n;
 }
 
 
-BVH_node * BVH::buildSubtree( seq<int> &triangleIndices, int depth )
+BVH_node * BVH::buildSubtree( int *triangleIndices, int numTriangles, int depth, unsigned int seed )
 
 {
   // Return a leaf node if there are sufficiently few triangles
 
-  if (triangleIndices.size() <= LEAF_COUNT_THRESHOLD)
-    return makeLeafNode( triangleIndices );
+  if (numTriangles <= LEAF_COUNT_THRESHOLD)
+    return makeLeafNode( triangleIndices, numTriangles );
   
   // Find K seed boxes
 
-  int numSeeds = MIN( K, triangleIndices.size() );
+  int numSeeds = MIN( K, numTriangles );
 
-  BBox *seedBoxes = new BBox[numSeeds];
-  int  *seedIndices =  new int[numSeeds];
+  BBox seedBoxes[K];
+  int  seedIndices[K];
 
   // Get first seed box
 
-  int randIndex = rand() % triangleIndices.size();
+  unsigned int random = seed;
+
+  int randIndex = randomIndex( random, numTriangles );
   seedBoxes[0] = triangleBBox( triangleIndices[randIndex] );
   seedIndices[0] = randIndex;
 
@@ -74,7 +200,7 @@ BVH_node * BVH::buildSubtree( seq<int> &triangleIndices, int depth )
       int randIndex;
       bool alreadyExists;
       do {
-	randIndex = rand() % triangleIndices.size();
+	randIndex = randomIndex( random, numTriangles );
 	alreadyExists = false;
 	for (int k=0; k<i; k++)
 	  if (randIndex == seedIndices[k]) {
@@ -106,94 +232,106 @@ BVH_node * BVH::buildSubtree( seq<int> &triangleIndices, int depth )
     }
   }
 
-  // Iteratively cluster around each seed
+  // Iteratively cluster around each seed.
+  //
+  // The triangles are assigned to seeds in chunks of CLUSTER_CHUNK,
+  // which are done in parallel, each summing its own clusters.  The
+  // chunk sums are then added in chunk order, so the means don't
+  // depend on the number of threads.
+
+  int numChunks = (numTriangles + CLUSTER_CHUNK - 1) / CLUSTER_CHUNK;
+
+  ArenaMark scratch = scratchArena.mark();
 
-  seq<int> *clusterTriangles;
+  int  *clusterOf  = scratchArena.alloc<int>( numTriangles ); // seed of each triangle
+  vec3 *chunkMin   = scratchArena.alloc<vec3>( numChunks * numSeeds );
+  vec3 *chunkMax   = scratchArena.alloc<vec3>( numChunks * numSeeds );
+  int  *chunkCount = scratchArena.alloc<int>( numChunks * numSeeds );
 
   for (int iteration=0; iteration<NUM_CLUSTERING_ITERATIONS; iteration++) {
 
-    if (iteration > 0)
-      delete [] clusterTriangles; // only keep the clusters from the last iteration
+    if (numChunks > 1 && threadPool != NULL) {
 
-    clusterTriangles = new seq<int>[numSeeds];
+      TaskGroup group;
 
-    // For each cluster, find the mean bbox (from equation 2 of
-    // Meister and Bittner's paper)
+      for (int c=0; c<numChunks; c++)
+	threadPool->submit( group, [this,triangleIndices,c,numTriangles,&seedBoxes,numSeeds,clusterOf,chunkMin,chunkMax,chunkCount] {
+	  clusterChunk( triangleIndices, c*CLUSTER_CHUNK, MIN( numTriangles, (c+1)*CLUSTER_CHUNK ), seedBoxes, numSeeds, clusterOf,
+			chunkMin + c*numSeeds, chunkMax + c*numSeeds, chunkCount + c*numSeeds );
+	} );
 
-    vec3 *clusterMin =  new vec3[numSeeds];
-    vec3 *clusterMax =  new vec3[numSeeds];
-    int  *clusterCount =  new int[numSeeds];
+      threadPool->wait( group );
 
-    for (int i=0; i<numSeeds; i++) {
-      clusterMin[i] = vec3(0,0,0);
-      clusterMax[i] = vec3(0,0,0);
-      clusterCount[i] = 0;
-    }
+    } else
 
-    for (int i=0; i<triangleIndices.size(); i++) { // all triangles
+      for (int c=0; c<numChunks; c++)
+	clusterChunk( triangleIndices, c*CLUSTER_CHUNK, MIN( numTriangles, (c+1)*CLUSTER_CHUNK ), seedBoxes, numSeeds, clusterOf,
+		      chunkMin + c*numSeeds, chunkMax + c*numSeeds, chunkCount + c*numSeeds );
 
-      BBox bbox = triangleBBox( triangleIndices[i] );
+    // Update the clusters with the mean bbox of the cluster (from
+    // equation 2 of Meister and Bittner's paper)
 
-      // Find this triangle's closest seed
+    for (int i=0; i<numSeeds; i++) {
 
-      float minDist = MAXFLOAT;
-      int   minSeed = 0; // set value only to prevent compiler warning only
-      
-      for (int j=0; j<numSeeds; j++) {
-		float dist = boxBoxDistance( seedBoxes[j], bbox );
-		if (dist < minDist) {
-		minDist = dist;
-		minSeed = j;
-		}
+      vec3 clusterMin(0,0,0), clusterMax(0,0,0);
+      int  clusterCount = 0;
+
+      for (int c=0; c<numChunks; c++) {
+	clusterMin = clusterMin + chunkMin[ c*numSeeds + i ];
+	clusterMax = clusterMax + chunkMax[ c*numSeeds + i ];
+	clusterCount += chunkCount[ c*numSeeds + i ];
       }
 
-      // Update the cluster min/max sums
+      if (clusterCount > 0) {
+	seedBoxes[i].min = (1/(float)clusterCount) * clusterMin;
+	seedBoxes[i].max = (1/(float)clusterCount) * clusterMax;
+      }
+    }
+  }
 
-      clusterMin[minSeed] = clusterMin[minSeed] + bbox.min;
-      clusterMax[minSeed] = clusterMax[minSeed] + bbox.max;
-      clusterCount[minSeed] += 1;
+  // Sort the triangles by their clusters from the last iteration, in
+  // place, keeping their order within each cluster
 
-      // Add the triangle to its cluster
+  int clusterSize[K], clusterStart[K];
 
-      clusterTriangles[minSeed].add( triangleIndices[i] );
-    }
+  for (int i=0; i<numSeeds; i++)
+    clusterSize[i] = 0;
 
-    // Update the clusters with the mean bbox of the cluster
+  for (int i=0; i<numTriangles; i++)
+    clusterSize[ clusterOf[i] ]++;
 
-    for (int i=0; i<numSeeds; i++)
-      if (clusterCount[i] > 0) {
-		seedBoxes[i].min = (1/(float)clusterCount[i]) * clusterMin[i];
-		seedBoxes[i].max = (1/(float)clusterCount[i]) * clusterMax[i];
-      }
+  clusterStart[0] = 0;
+  for (int i=1; i<numSeeds; i++)
+    clusterStart[i] = clusterStart[i-1] + clusterSize[i-1];
 
-	delete[] clusterMin;
-	delete[] clusterMax;
-	delete[] clusterCount;
-  }
+  int *sorted = scratchArena.alloc<int>( numTriangles );
+
+  for (int i=0; i<numTriangles; i++)
+    sorted[ clusterStart[ clusterOf[i] ]++ ] = triangleIndices[i];
+
+  memcpy( triangleIndices, sorted, numTriangles * sizeof(int) );
+
+  scratchArena.release( scratch ); // before the children reuse it
 
   // Now build the node
 
-  BVH_node *n = new BVH_node();
+  BVH_node *n = newNode();
   
   n->isLeaf = false;
 
   // (recursively build the subtrees)
 
-  n->children  = new seq<BVH_node*>();
-
-  for (int i=0; i<numSeeds; i++)
-    if (clusterTriangles[i].size() > 0)
-      n->children->add( buildSubtree( clusterTriangles[i], depth+1 ) );
+  buildChildren( n, triangleIndices, clusterSize, numSeeds, depth, seed );
 
   // (find the bbox around all the subtrees)
 
-  if (n->children->size() > 0) {
+  if (n->count > 0) {
 
-    n->bbox = (*n->children)[0]->bbox;
+    n->bbox = n->children[0]->bbox;
 
-    for (int i=1; i<n->children->size(); i++) {
+    for (int i=1; i<n->count; i++) {
 
-      BBox bbox = (*n->children)[i]->bbox;
+      BBox bbox = n->children[i]->bbox;
 
       n->bbox.min.x = MIN( n->bbox.min.x, bbox.min.x );
       n->bbox.min.y = MIN( n->bbox.min.y, bbox.min.y );
@@ -207,14 +345,402 @@ BVH_node * BVH::buildSubtree( seq<int> &triangleIndices, int depth )
 
   // Done
 
-  delete[] seedBoxes;
-  delete[] seedIndices;
-    
   return n;
 }
 
 
 
+// Assign triangles [start,end) of 'triangleIndices' to their closest
+// seeds in clusterOf[], and sum the min and max corners and count of
+// the triangles assigned to each seed.
+
+void BVH::clusterChunk( int *triangleIndices, int start, int end, BBox *seedBoxes, int numSeeds,
+			int *clusterOf, vec3 *sumMin, vec3 *sumMax, int *count )
+
+{
+  for (int i=0; i<numSeeds; i++) {
+    sumMin[i] = vec3(0,0,0);
+    sumMax[i] = vec3(0,0,0);
+    count[i] = 0;
+  }
+
+  for (int i=start; i<end; i++) {
+
+    BBox bbox = triangleBBox( triangleIndices[i] );
+
+    // Find this triangle's closest seed
+
+    float minDist = MAXFLOAT;
+    int   minSeed = 0; // set value only to prevent compiler warning only
+
+    for (int j=0; j<numSeeds; j++) {
+      float dist = boxBoxDistance( seedBoxes[j], bbox );
+      if (dist < minDist) {
+	minDist = dist;
+	minSeed = j;
+      }
+    }
+
+    // Update the cluster min/max sums
+
+    sumMin[minSeed] = sumMin[minSeed] + bbox.min;
+    sumMax[minSeed] = sumMax[minSeed] + bbox.max;
+    count[minSeed] += 1;
+
+    clusterOf[i] = minSeed;
+  }
+}
+
+
+
+// Build a subtree for each non-empty part of a node's triangles and
+// make them the node's children, in order.  The parts are consecutive
+// in 'triangleIndices', with sizes partSizes[].  Parts with at least
+// PARALLEL_BUILD_MIN triangles are built as threadPool tasks, which
+// may in turn build their children in parallel.
+
+void BVH::buildChildren( BVH_node *node, int *triangleIndices, int *partSizes, int numParts, int depth, unsigned int seed )
+
+{
+  node->count = 0;
+  for (int i=0; i<numParts; i++)
+    if (partSizes[i] > 0)
+      node->count++;
+
+  node->children = nodeArena.alloc<BVH_node*>( node->count );
+
+  TaskGroup group;
+  bool      anyTasks = false;
+
+  int *part = triangleIndices;
+  int  child = 0;
+
+  for (int i=0; i<numParts; i++) {
+
+    if (partSizes[i] == 0)
+      continue;
+
+    int           size = partSizes[i];
+    BVH_node    **slot = &node->children[child++];
+    unsigned int  s    = childSeed( seed, i );
+
+    Task build = [this,part,size,slot,depth,s] {
+      *slot = (builder == SAH_BUILDER ? buildSubtreeSAH( part, size, depth+1 ) : buildSubtree( part, size, depth+1, s ));
+    };
+
+    if (size >= PARALLEL_BUILD_MIN && threadPool != NULL) {
+      threadPool->submit( group, build );
+      anyTasks = true;
+    } else
+      build();
+
+    part += size;
+  }
+
+  if (anyTasks)
+    threadPool->wait( group );
+}
+
+
+
+// Build the BVH with a binned Surface Area Heuristic (Wald, "On fast
+// Construction of SAH-based Bounding Volume Hierarchies", 2007).
+//
+// Triangle centroids are dropped into 'sahNumBins' bins along each
+// axis.  Each plane between bins is a candidate split, with cost
+//
+//   sahCostRatio + (area(L) * count(L) + area(R) * count(R)) / area(node)
+//
+// in units of one triangle test, where a traversal step tests the two
+// child boxes of a binary node.  The cheapest split is used, unless
+// the node is small enough to be a leaf and a leaf is cheaper.
+//
+// Upon call, there is guaranteed to be at least one triangle.
+
+
+#define SAH_MAX_BINS 256
+
+
+BVH_node * BVH::buildSubtreeSAH( int *triangleIndices, int n, int depth )
+
+{
+  if (n == 1)
+    return makeLeafNode( triangleIndices, n );
+
+  // Find the triangle boxes, the node box, and the box around the
+  // triangle centroids
+
+  ArenaMark scratch = scratchArena.mark();
+
+  BBox *triBoxes = scratchArena.alloc<BBox>( n );
+
+  BBox nodeBox, centroidBox;
+  nodeBox.makeEmpty();
+  centroidBox.makeEmpty();
+
+  for (int i=0; i<n; i++) {
+    triBoxes[i] = triangleBBox( triangleIndices[i] );
+    nodeBox.include( triBoxes[i] );
+    centroidBox.include( triBoxes[i].centre() );
+  }
+
+  // Find the best split
+
+  int numBins = MAX( 2, MIN( sahNumBins, SAH_MAX_BINS ) );
+
+  float bestCost  = MAXFLOAT;
+  int   bestAxis  = -1;
+  int   bestSplit = 0;		// first bin on the right side
+
+  BBox  binBox[SAH_MAX_BINS];
+  int   binCount[SAH_MAX_BINS];
+  float rightArea[SAH_MAX_BINS];
+  int   rightCount[SAH_MAX_BINS];
+
+  float nodeArea = nodeBox.area();
+
+  for (int axis=0; axis<3; axis++) {
+
+    float cmin = centroidBox.min[axis];
+    float extent = centroidBox.max[axis] - cmin;
+
+    if (extent <= 0)
+      continue;			// all centroids in the same plane
+
+    float binScale = numBins / extent;
+
+    for (int b=0; b<numBins; b++) {
+      binBox[b].makeEmpty();
+      binCount[b] = 0;
+    }
+
+    for (int i=0; i<n; i++) {
+      int b = (int) ((triBoxes[i].centre()[axis] - cmin) * binScale);
+      if (b >= numBins)
+	b = numBins-1;
+      binBox[b].include( triBoxes[i] );
+      binCount[b]++;
+    }
+
+    // Sweep from the right to get the area and count right of each plane
+
+    BBox box;
+    box.makeEmpty();
+    int count = 0;
+
+    for (int b=numBins-1; b>0; b--) {
+      box.include( binBox[b] );
+      count += binCount[b];
+      rightArea[b]  = box.area();
+      rightCount[b] = count;
+    }
+
+    // Sweep from the left and evaluate each plane
+
+    box.makeEmpty();
+    count = 0;
+
+    for (int b=1; b<numBins; b++) {
+      box.include( binBox[b-1] );
+      count += binCount[b-1];
+      if (count == 0 || rightCount[b] == 0)
+	continue;
+      float cost = sahCostRatio + (box.area() * count + rightArea[b] * rightCount[b]) / nodeArea;
+      if (cost < bestCost) {
+	bestCost  = cost;
+	bestAxis  = axis;
+	bestSplit = b;
+      }
+    }
+  }
+
+  // Make a leaf if that's cheaper, or if there's no split and the
+  // triangles fit
+
+  if (n <= sahLeafSize && (bestAxis < 0 || n <= bestCost)) {
+    scratchArena.release( scratch );
+    return makeLeafNode( triangleIndices, n );
+  }
+
+  // Partition the triangles in place, keeping their order on each
+  // side.  If all centroids coincide, just split the list in half.
+
+  int partSizes[2];
+
+  if (bestAxis < 0) {
+    partSizes[0] = n/2;
+  } else {
+    float cmin = centroidBox.min[bestAxis];
+    float binScale = numBins / (centroidBox.max[bestAxis] - cmin);
+    int  *right = scratchArena.alloc<int>( n );
+    int   numLeft = 0, numRight = 0;
+    for (int i=0; i<n; i++) {
+      int b = (int) ((triBoxes[i].centre()[bestAxis] - cmin) * binScale);
+      if (b >= numBins)
+	b = numBins-1;
+      if (b < bestSplit)
+	triangleIndices[ numLeft++ ] = triangleIndices[i];
+      else
+	right[ numRight++ ] = triangleIndices[i];
+    }
+    memcpy( triangleIndices + numLeft, right, numRight * sizeof(int) );
+    partSizes[0] = numLeft;
+  }
+
+  partSizes[1] = n - partSizes[0];
+
+  scratchArena.release( scratch ); // before the children reuse it
+
+  // Build the node
+
+  BVH_node *node = newNode();
+
+  node->isLeaf   = false;
+  node->bbox     = nodeBox;
+
+  buildChildren( node, triangleIndices, partSizes, 2, depth, 0 );
+
+  return node;
+}
+
+
+
+// SAH cost of the tree, in units of one triangle test, for the
+// current 'sahCostRatio'.  This is the expected cost of tracing a
+// random ray that hits the root box, so trees from different builders
+// can be compared.  A node with k children costs k/2 traversal steps,
+// as it needs k box tests.
+
+float BVH::sahCost()
+
+{
+  if (nodes == NULL)
+    return 0;
+
+  float rootArea = nodes[0].bbox.area();
+  if (rootArea <= 0)
+    rootArea = 1;
+
+  return subtreeCost( 0 ) / rootArea;
+}
+
+
+float BVH::subtreeCost( int nodeIndex )
+
+{
+  BVH_flatNode &n = nodes[nodeIndex];
+
+  if (n.isLeaf)
+    return n.bbox.area() * n.count;
+
+  float cost = n.bbox.area() * sahCostRatio * 0.5 * n.count;
+
+  for (int i=0; i<(int) n.count; i++)
+    cost += subtreeCost( n.offset+i );
+
+  return cost;
+}
+
+
+
+// Report the builder, tree size, SAH cost and build time
+
+void BVH::printStats( ostream &out )
+
+{
+  float cost = sahCost();
+
+  out << builderName() << " BVH: "
+      << triangles.size() << " triangles, "
+      << numNodes << " nodes, SAH cost " << cost
+      << (fromCache ? ", read from cache in " : ", built in ") << buildTime << " s" << endl;
+}
+
+
+
+// Copy the pointer tree into the 'nodes' array, then free it.
+//
+// The children of each node are put in consecutive slots, followed by
+// the subtree of the first child, then that of the second child, and
+// so on.  The triangles are reordered so that those of each leaf are
+// consecutive.
+
+void BVH::flattenTree()
+
+{
+  int maxDepth = 0, maxChildren = 1;
+
+  numNodes = countNodes( root, 0, maxDepth, maxChildren );
+  nodes = new BVH_flatNode[ numNodes ];
+
+  // A node's children are pushed together, so the stack holds at most
+  // (maxChildren-1) nodes for each level above the current one.
+
+  stackSize = maxDepth * (maxChildren-1) + 1;
+
+  seq<BVH_triangle> orderedTriangles( triangles.size() );
+
+  int nextSlot = 1;
+  flattenSubtree( root, 0, nextSlot, orderedTriangles );
+
+  triangles = orderedTriangles;
+
+  freeTree();
+}
+
+
+int BVH::countNodes( BVH_node *n, int depth, int &maxDepth, int &maxChildren )
+
+{
+  if (depth > maxDepth)
+    maxDepth = depth;
+
+  if (n->isLeaf)
+    return 1;
+
+  if (n->count > maxChildren)
+    maxChildren = n->count;
+
+  int count = 1;
+  for (int i=0; i<n->count; i++)
+    count += countNodes( n->children[i], depth+1, maxDepth, maxChildren );
+
+  return count;
+}
+
+
+void BVH::flattenSubtree( BVH_node *n, int slot, int &nextSlot, seq<BVH_triangle> &orderedTriangles )
+
+{
+  BVH_flatNode &flat = nodes[slot];
+
+  flat.bbox = n->bbox;
+
+  if (n->isLeaf) {
+
+    flat.isLeaf = 1;
+    flat.count  = n->count;
+    flat.offset = orderedTriangles.size();
+
+    for (int i=0; i<n->count; i++)
+      orderedTriangles.add( triangles[ n->triangles[i] ] );
+
+  } else {
+
+    int firstChild = nextSlot;
+    nextSlot += n->count;
+
+    flat.isLeaf = 0;
+    flat.count  = n->count;
+    flat.offset = firstChild;
+
+    for (int i=0; i<n->count; i++)
+      flattenSubtree( n->children[i], firstChild+i, nextSlot, orderedTriangles );
+  }
+}
+
+
+
 // Distance between two bounding boxes (stored in nodes) from Meister
 // and Bittner "Parallel BVH Construction ..." paper.
 
@@ -250,12 +776,12 @@ BBox BVH::triangleBBox( int triIndex )
 
 // Find the bounding box of a SET of triangles
 
-BBox BVH::trianglesBBox( seq<int> &triangleIndices )
+BBox BVH::trianglesBBox( int *triangleIndices, int numTriangles )
 
 {
   BBox bbox = triangleBBox( triangleIndices[0] );
 
-  for (int i=1; i<triangleIndices.size(); i++) {
+  for (int i=1; i<numTriangles; i++) {
 
     BBox triBox = triangleBBox( triangleIndices[i] );
 
@@ -276,13 +802,17 @@ BBox BVH::trianglesBBox( seq<int> &triangleIndices )
 //
 // Box is [vmin,vmax].  Ray parameters are restricted to [tmin,tmax].
 // Return true iff ray intersects box (even if starting from the inside).
+// 'invDir' is 1/rayDir, computed once per ray.
+//
+// The test is inclusive, as are the packet and wide box tests, so a
+// flat box (e.g. around an axis-aligned quad) is hit.
 
-bool BVH::rayBoxInt( vec3 &rayStart, vec3 &rayDir, float tmin, float tmax, BBox &bbox )
+bool BVH::rayBoxInt( vec3 &rayStart, vec3 &invDir, float tmin, float tmax, BBox &bbox )
 
 {
   for (int i=0; i<3; ++i) {
 
-    float invD = 1.0f / rayDir[i]; // handles division by zero correctly (i.e. IEEE Inf)
+    float invD = invDir[i];
 
     float t0 = (bbox.min[i] - rayStart[i]) * invD;
     float t1 = (bbox.max[i] - rayStart[i]) * invD;
@@ -294,7 +824,7 @@ bool BVH::rayBoxInt( vec3 &rayStart, vec3 &rayDir, float tmin, float tmax, BBox
     tmin = (t0 > tmin) ? t0 : tmin; // farthest min distance
     tmax = (t1 < tmax) ? t1 : tmax; // closest max distance
 
-    if (tmax <= tmin) // crossing outside an edge (or corner)
+    if (tmax < tmin) // crossing outside an edge (or corner)
        return false;
   }
 
@@ -303,134 +833,113 @@ bool BVH::rayBoxInt( vec3 &rayStart, vec3 &rayDir, float tmin, float tmax, BBox
 
 
 
-// Compute plane/ray intersection.
+// Find the closest ray/triangle intersection by walking the tree
+// with a stack of node indices.
 //
 // 'sourceTriangleIndex' is passed in as the triangleIndex of the
 // originating triangle.  Do not check for intersection with this
 // triangle.
 
 
-bool BVH::rayIntBVH( BVH_node*n, vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam, vec3 & intPoint, vec3 & intNormal, vec3 & intTexCoords, float & intParam, Material * &intMaterial, int &intTriangleIndex )
+bool BVH::rayIntBVH( vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam, vec3 & intPoint, vec3 & intNormal, vec3 & intTexCoords, float & intParam, Material * &intMaterial, int &intTriangleIndex )
 
 {
-  bool hit = false;
+  bool  hit = false;
+  int   hitTriangle;
+  float hitAlpha, hitBeta;
 
-  if (n->isLeaf) { // A leaf, so check all the triangles
+  vec3 invDir( 1.0f / rayDir.x, 1.0f / rayDir.y, 1.0f / rayDir.z ); // handles division by zero correctly (i.e. IEEE Inf)
 
-    for (int i=0; i<n->triangles->size(); i++) {
-      int triangleIndex = (*n->triangles)[i];
-      if (triangleIndex != sourceTriangleIndex) { // this isn't the triangle from which the ray started
+  int  localStack[ BVH_STACK_SIZE ];
+  int *stack = (stackSize <= BVH_STACK_SIZE ? localStack : new int[ stackSize ]);
+  int  top = 0;
 
-	float param, alpha, beta, gamma;
-	vec3 point, normal, texcoords;
+  stack[top++] = 0;		// root
 
-	if (triangleInt( rayStart, rayDir, triangleIndex, maxParam, param, point, normal, texcoords, alpha, beta, gamma )) { // returns param, point, alpha, beta, gamma
+  int nodesVisited = 0, triangleTests = 0;
 
-	  // found a new closest point
+  while (top > 0) {
 
-	  intParam  = param;
-	  intPoint  = point;
-	  intNormal = normal;
-	  intTexCoords = texcoords;
-	  intTriangleIndex = triangleIndex;
-	  intMaterial = materials[ triangles[ (*n->triangles)[i] ].materialID ]; 
+    BVH_flatNode &n = nodes[ stack[--top] ];
 
-	  maxParam = param;
-	  hit = true;
-	}
-      }
-    }
+    nodesVisited++;
 
-    // Note that bump mapping is not implemented yet, but should be
-    // done here to return the bump-mapped normal.
+    // Skip a node that is beyond the closest intersection so far
 
-  } else { // Not a leaf, so recurse into children
+    if (!rayBoxInt( rayStart, invDir, 0, maxParam, n.bbox ))
+      continue;
 
-    for (int i=0; i<n->children->size(); i++) {
-      BVH_node *thisNode = (*n->children)[i];
-      if (rayBoxInt( rayStart, rayDir, 0, maxParam, thisNode->bbox )) {
-	if (rayIntBVH( thisNode, rayStart, rayDir, sourceTriangleIndex, maxParam, intPoint, intNormal, intTexCoords, intParam, intMaterial, intTriangleIndex )) {
-	  maxParam = intParam;
-	  hit = true;
-	}
-      }
-    }
-  }
+    if (n.isLeaf) { // A leaf, so check all the triangles
 
-  return hit;
-}
-  
+      triangleTests += n.count;
 
+      if (leafInt( n.offset, n.count, rayStart, rayDir, sourceTriangleIndex, maxParam, hitTriangle, hitAlpha, hitBeta ))
+	hit = true;
 
-// Adapted from triangle.cpp for use by BVH
+    } else // Not a leaf, so push the children (last first, so the first is visited first)
 
-bool BVH::triangleInt( vec3 &rayStart, vec3 &rayDir, int triangleIndex, float maxParam, float &param, vec3 &point, vec3 &normal, vec3 &texCoord, float &alpha, float &beta, float &gamma )
+      for (int i=n.count-1; i>=0; i--)
+	stack[top++] = n.offset + i;
+  }
 
-{
-  BVH_triangle &tri = triangles[triangleIndex];
+  if (stack != localStack)
+    delete [] stack;
 
-  vec3 &v0 = (*vertices)[ tri.v0 ];
-  vec3 &v1 = (*vertices)[ tri.v1 ];
-  vec3 &v2 = (*vertices)[ tri.v2 ];
+  perfCounters.addTraversal( nodesVisited, nodesVisited, triangleTests );
 
-  vec3 faceNormal = (*facetnorms)[ tri.faceID ];
+  // Interpolate the attributes of the closest hit only
 
-  // Compute ray/plane intersection
+  if (hit) {
+    intParam = maxParam;
+    intTriangleIndex = hitTriangle;
+    finishInt( rayStart, rayDir, maxParam, hitTriangle, hitAlpha, hitBeta, intPoint, intNormal, intTexCoords, intMaterial );
+  }
 
-  float dn = rayDir * faceNormal;
+  return hit;
+}
 
-  if (fabs(dn) < 0.0001) // 'fabs' allows intersection from behind the plane.
-    return false; // ray is parallel to plane.
 
-  float t = (faceNormal*(v0-rayStart)) / dn;
-  if (t < 0)
-    return false; // plane is behind starting point
 
-  if (t >= maxParam)
-    return false; // a closer intersection (at 'maxParam') has already been detected in other code
-  
-  vec3 thisPoint = rayStart + t * rayDir;
+// Is the ray blocked within [0,maxParam]?  As rayIntBVH(), but
+// returns at the first triangle hit.
 
-  // Compute barycentric coords
+bool BVH::occludedBVH( vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam, int &occluderIndex )
 
-  float denom = ((v1-v0) ^ (v2-v0)) * faceNormal; // should cache this cross product.
+{
+  bool  hit = false;
+  float alpha, beta;
 
-  float thisBeta  = (((v1-v0) ^ (thisPoint - v0)) * faceNormal) / denom; // for v2
-  float thisAlpha = (((thisPoint-v0) ^ (v2 - v0)) * faceNormal) / denom; // for v1
-  float thisGamma = 1 - thisAlpha - thisBeta; // for v0
+  vec3 invDir( 1.0f / rayDir.x, 1.0f / rayDir.y, 1.0f / rayDir.z );
 
-  if (thisAlpha < 0 || thisBeta < 0 || thisGamma < 0)
-    return false; // outside of triangle
+  int  localStack[ BVH_STACK_SIZE ];
+  int *stack = (stackSize <= BVH_STACK_SIZE ? localStack : new int[ stackSize ]);
+  int  top = 0;
 
-  // Return intersection info
+  stack[top++] = 0;		// root
 
-  param  = t;
-  point  = thisPoint;
-  alpha  = thisAlpha;
-  beta   = thisBeta;
-  gamma  = thisGamma;
+  int nodesVisited = 0, triangleTests = 0;
 
-  if (!obj->hasVertexNormals)
-    
-    normal = faceNormal; // use face normal
+  while (top > 0 && !hit) {
 
-  else {
+    BVH_flatNode &n = nodes[ stack[--top] ];
+
+    nodesVisited++;
 
-    vec3 &n0 = (*normals)[ tri.n0 ]; // interpolate vertex normals
-    vec3 &n1 = (*normals)[ tri.n1 ];
-    vec3 &n2 = (*normals)[ tri.n2 ];
+    if (!rayBoxInt( rayStart, invDir, 0, maxParam, n.bbox ))
+      continue;
 
-    normal = (gamma*n0 + alpha*n1 + beta*n2).normalize();
+    if (n.isLeaf) {
+      triangleTests += n.count;
+      hit = leafInt( n.offset, n.count, rayStart, rayDir, sourceTriangleIndex, maxParam, occluderIndex, alpha, beta );
+    } else
+      for (int i=n.count-1; i>=0; i--)
+	stack[top++] = n.offset + i;
   }
 
-  if (obj->hasVertexTexCoords) {
-    
-    vec3 &t0 = (*texcoords)[ tri.t0 ]; // interpolate vertex texcoords
-    vec3 &t1 = (*texcoords)[ tri.t1 ];
-    vec3 &t2 = (*texcoords)[ tri.t2 ];
+  if (stack != localStack)
+    delete [] stack;
 
-    texCoord = gamma*t0 + alpha*t1 + beta*t2;
-  }
+  perfCounters.addTraversal( nodesVisited, nodesVisited, triangleTests );
 
-  return true;
+  return hit;
 }
@@ -10,10 +10,14 @@
 #include "seq.h"
 #include "material.h"
 #include "bbox.h"
+#include "arena.h"
 #include "main.h"
 #include "wavefront.h"
 
 
+class RayPacket;
+
+
 class BVH_triangle {
 
 public:
@@ -40,41 +44,162 @@ public:
 
 
 
+// Node of the pointer tree made while building.  Nodes, child lists,
+// and triangle index lists are all in BVH::nodeArena.
+
 class BVH_node {
 
 public:
 
   BBox bbox;		           // node's bounding box
   bool isLeaf;                     // true iff this is a leaf in the BVH
+  int  count;			   // number of children or triangles
   union {
-    seq<BVH_node*> *children;	   // present only for non-leaves
-    seq<int>       *triangles;     // present only for leaves and contains INDICES of leaf triangles
+    BVH_node **children;	   // present only for non-leaves
+    int       *triangles;          // present only for leaves and contains INDICES of leaf triangles
   };
 };
 
 
 
+// Node of the flattened tree used for raytracing.  All nodes are in
+// one array.  The children of a node are contiguous in that array,
+// and the triangles of a leaf are contiguous in BVH::triangles.  Each
+// node is 32 bytes, so two fit in a cache line.
+
+class alignas(32) BVH_flatNode {
+
+public:
+
+  BBox bbox;			   // node's bounding box
+  int  offset;			   // index of first child in BVH::nodes, or of first triangle in BVH::triangles
+  unsigned int count  : 31;	   // number of children or triangles
+  unsigned int isLeaf : 1;
+};
+
+
+#define BVH_STACK_SIZE 256	   // traversal stack entries on the C++ stack
+
+
+
+// Node of the wide BVH used for SIMD traversal.  The bounds of up to
+// BVH_WIDTH children are stored as structure-of-arrays so that they
+// can all be tested against a ray at once.  Unused lanes have a count
+// of -1, and the box tests leave them out of the mask of lanes hit.
+// (The slab test alone would not: their boxes are inverted, which it
+// treats as enclosing everything.)
+
+#define BVH_WIDTH 8
+
+class alignas(64) BVH_wideNode {
+
+public:
+
+  float minX[BVH_WIDTH], minY[BVH_WIDTH], minZ[BVH_WIDTH];
+  float maxX[BVH_WIDTH], maxY[BVH_WIDTH], maxZ[BVH_WIDTH];
+  int   child[BVH_WIDTH];	   // index in BVH::wideNodes, or first triangle of a leaf
+  int   count[BVH_WIDTH];	   // triangles in a leaf, 0 for an inner node, -1 for an unused lane
+};
+
+
+// Test a ray against all boxes of a wide node.  Returns a bit mask of
+// the lanes hit within [0,maxParam] and the entry distance of each.
+
+typedef int (*WideBoxTest)( BVH_wideNode &node, float org[3], float invDir[3], float maxParam, float tNear[BVH_WIDTH] );
+
+
+// Precomputed intersection data for BVH_TRI_WIDTH consecutive
+// triangles of BVH::triangles: the first vertex and the two edges from
+// it, as structure-of-arrays so that a block can be tested with SSE.
+
+#define BVH_TRI_WIDTH 4
+
+class alignas(16) BVH_triBlock {
+
+public:
+
+  float v0x[BVH_TRI_WIDTH], v0y[BVH_TRI_WIDTH], v0z[BVH_TRI_WIDTH];
+  float e1x[BVH_TRI_WIDTH], e1y[BVH_TRI_WIDTH], e1z[BVH_TRI_WIDTH];
+  float e2x[BVH_TRI_WIDTH], e2y[BVH_TRI_WIDTH], e2z[BVH_TRI_WIDTH];
+};
+
+
+// Methods of building the tree
+
+enum BVHBuilder { KMEANS_BUILDER, SAH_BUILDER };
+
+
+// Traversal kernels
+
+enum BVHKernel { SCALAR_KERNEL, WIDE_KERNEL, SSE_KERNEL, AVX_KERNEL };
+
+
 class BVH {
 
-  bool rayBoxInt( vec3 &rayStart, vec3 &rayDir, float tmin, float tmax, BBox &bbox );
+  bool rayBoxInt( vec3 &rayStart, vec3 &invDir, float tmin, float tmax, BBox &bbox );
+
+  Arena nodeArena;		   // pointer tree, freed all at once by freeTree()
+  Arena scratchArena;		   // per-node temporaries of the builders
 
-  void freeTree( BVH_node *n ) {
-    if (!n->isLeaf)
-      for (int i=0; i<n->children->size(); i++)
-	freeTree( (*n->children)[i] );
-    delete n;
+  void freeTree() {
+    nodeArena.clear();
+    root = NULL;
   }
 
-  BVH_node *buildSubtree( seq<int> &triangleIndices, int depth );
-  BVH_node *makeLeafNode( seq<int> &triangleIndices );
+  void flattenTree();
+  int  countNodes( BVH_node *n, int depth, int &maxDepth, int &maxChildren );
+  void flattenSubtree( BVH_node *n, int slot, int &nextSlot, seq<BVH_triangle> &orderedTriangles );
+
+  BVH_node *buildSubtree( int *triangleIndices, int numTriangles, int depth, unsigned int seed );
+  BVH_node *buildSubtreeSAH( int *triangleIndices, int numTriangles, int depth );
+  void      buildChildren( BVH_node *node, int *triangleIndices, int *partSizes, int numParts, int depth, unsigned int seed );
+  void      clusterChunk( int *triangleIndices, int start, int end, BBox *seedBoxes, int numSeeds,
+			  int *clusterOf, vec3 *sumMin, vec3 *sumMax, int *count );
+  BVH_node *newNode();
+  BVH_node *makeLeafNode( int *triangleIndices, int numTriangles );
+
+  float subtreeCost( int nodeIndex );
+
+  void buildWideTree();
+  int  buildWideNode( int flatIndex, int depth, int &maxDepth );
+
+  static WideBoxTest wideBoxTest;  // box test for 'kernel'
+
+  void buildTriBlocks();
+
+  bool leafInt( int first, int count, vec3 &rayStart, vec3 &rayDir, int sourceTriangleIndex, float &maxParam, int &intTriangleIndex, float &intAlpha, float &intBeta );
+  void packetLeafInt( RayPacket &packet, int first, int count, BBox &box, int hitTriangle[], float hitAlpha[], float hitBeta[] );
+  void packetFinishInt( RayPacket &packet, int objIndex, int hitTriangle[], float hitAlpha[], float hitBeta[] );
+
+  void finishInt( vec3 &rayStart, vec3 &rayDir, float param, int triangleIndex, float alpha, float beta, vec3 &point, vec3 &normal, vec3 &texCoord, Material * &mat );
 
   BBox triangleBBox( int triIndex );
-  BBox trianglesBBox( seq<int> &triangleIndices );
+  BBox trianglesBBox( int *triangleIndices, int numTriangles );
 
   float boxBoxDistance( BBox &b1, BBox &b2 );
 
 public:
 
+  // Builder options (from command line)
+
+  static BVHBuilder builder;
+  static int        sahNumBins;	   // number of centroid bins per axis
+  static int        sahLeafSize;   // max triangles in a leaf
+  static float      sahCostRatio;  // cost of a traversal step / cost of a triangle test
+  static unsigned int buildSeed;   // seed of the k-means builder's random choices
+
+  static float totalBuildTime;     // seconds taken by all buildTree() calls
+
+  static const char *builderName() { return (builder == SAH_BUILDER ? "SAH" : "k-means"); }
+
+  // Traversal kernel (chosen from the CPU features, or from the command line)
+
+  static BVHKernel kernel;
+
+  static BVHKernel bestKernel();
+  static bool      setKernel( BVHKernel k );
+  static const char *kernelName( BVHKernel k );
+
   wfModel   *obj;
   seq<vec3> *vertices;
   seq<vec3> *texcoords;
@@ -83,37 +208,77 @@ public:
   seq<Material*> materials;
   seq<BVH_triangle> triangles;
 
-  BVH_node *root;
+  BVH_node *root;		   // pointer tree (only while building)
+
+  BVH_flatNode *nodes;		   // flattened tree; nodes[0] is the root
+  int numNodes;
+  int stackSize;		   // traversal stack entries needed
+
+  BVH_wideNode *wideNodes;	   // wide tree for SIMD traversal; wideNodes[0] is the root
+  int numWideNodes;
+  int wideStackSize;
+
+  BVH_triBlock *triBlocks;	   // triangles packed for intersection, in 'triangles' order
+  int numTriBlocks;
+
+  float buildTime;		   // seconds taken by buildTree(), or to read from the cache
+  bool  fromCache;		   // tree was read from a mesh cache, not built
 
   BVH() {
     root = NULL;
+    nodes = NULL;
+    numNodes = 0;
+    stackSize = 0;
+    wideNodes = NULL;
+    numWideNodes = 0;
+    wideStackSize = 0;
+    triBlocks = NULL;
+    numTriBlocks = 0;
+    buildTime = 0;
+    fromCache = false;
   }
 
   ~BVH() {
-    if (root != NULL)
-      freeTree( root );
+    if (nodes != NULL)
+      delete [] nodes;
+    if (wideNodes != NULL)
+      delete [] wideNodes;
+    if (triBlocks != NULL)
+      delete [] triBlocks;
     // Note that vertices, texcoords, and materials are stored
     // elsewhere and should not be deleted here.
   }
 
-  void buildTree() {
-    // cout << "Building with " << vertices->size() << " vertices, " << texcoords->size() << " texcoords, " << materials.size() << " materials, " << triangles.size() << " triangles." << endl;
-    if (triangles.size() == 0)
-      root = NULL;
-    else {
-      // Create a sequence of all triangle indices
-      seq<int> triangleIndices( triangles.size() );
-      for (int i=0; i<triangles.size(); i++)
-	triangleIndices.add( i );
-      // Build the tree
-      root = buildSubtree( triangleIndices, 0 );
-    }
-  };
+  void buildTree();
+  void setFlatTree( BVH_flatNode *flatNodes, int n, int stack ); // use an already-built tree
+
+  float sahCost();
+  void  printStats( ostream &out );
   
   bool rayInt( vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam, vec3 &intPoint, vec3 &intNormal, vec3 &intTexCoords, float &intParam, Material * &mat, int &intTriangleIndex ) {
-    if (root == NULL)
+    if (nodes == NULL)
       return false;
-    return rayIntBVH( root, rayStart, rayDir, sourceTriangleIndex, maxParam, intPoint, intNormal, intTexCoords, intParam, mat, intTriangleIndex );
+    if (kernel != SCALAR_KERNEL)
+      return rayIntWide( rayStart, rayDir, sourceTriangleIndex, maxParam, intPoint, intNormal, intTexCoords, intParam, mat, intTriangleIndex );
+    return rayIntBVH( rayStart, rayDir, sourceTriangleIndex, maxParam, intPoint, intNormal, intTexCoords, intParam, mat, intTriangleIndex );
+  }
+
+  // Is the ray blocked by any triangle within [0,maxParam]?  Stops at
+  // the first hit found.  The triangle hit is returned in
+  // 'occluderIndex'.
+
+  bool occluded( vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam, int &occluderIndex ) {
+    if (nodes == NULL)
+      return false;
+    if (kernel != SCALAR_KERNEL)
+      return occludedWide( rayStart, rayDir, sourceTriangleIndex, maxParam, occluderIndex );
+    return occludedBVH( rayStart, rayDir, sourceTriangleIndex, maxParam, occluderIndex );
+  }
+
+  bool triangleOccludes( int triangleIndex, vec3 &rayStart, vec3 &rayDir, float maxParam ) {
+    int   tri;
+    float alpha, beta;
+    return leafInt( triangleIndex, 1, rayStart, rayDir, -1, maxParam, tri, alpha, beta );
   }
 
   void renderGL( mat4 &WCS_to_CCS ) {
@@ -129,9 +294,15 @@ public:
       return materials[ triangles[triangleIndex].materialID ]->texture->texel( texCoords.x, texCoords.y, alpha );
   }
 
-  bool rayIntBVH( BVH_node *n, vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam, vec3 & intPoint, vec3 & intNormal, vec3 &intTexCoords, float & intParam, Material * &mat, int &intTriangleIndex );
+  bool rayIntBVH( vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam, vec3 & intPoint, vec3 & intNormal, vec3 &intTexCoords, float & intParam, Material * &mat, int &intTriangleIndex );
+
+  void packetInt( RayPacket &packet, int objIndex );
+  void packetIntWide( RayPacket &packet, int objIndex );
+
+  bool rayIntWide( vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam, vec3 & intPoint, vec3 & intNormal, vec3 &intTexCoords, float & intParam, Material * &mat, int &intTriangleIndex );
 
-  bool triangleInt( vec3 &rayStart, vec3 &rayDir, int triangleIndex, float maxParam, float &param, vec3 &point, vec3 &normal, vec3 &texcoords, float &alpha, float &beta, float &gamma );
+  bool occludedBVH( vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam, int &occluderIndex );
+  bool occludedWide( vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam, int &occluderIndex );
 
 };
 
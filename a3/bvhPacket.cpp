@@ -0,0 +1,291 @@
+// bvhPacket.cpp
+//
+// Traversal of a BVH by a packet of coherent rays
+
+
+#include "bvh.h"
+#include "packet.h"
+#include "perfCounters.h"
+
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(_M_IX86)
+  #define BVH_X86
+  #include <immintrin.h>
+#endif
+
+
+
+// Find the closest intersection of each ray in the packet with this
+// BVH.  Rays that hit a triangle closer than their current closest
+// intersection are updated, with 'objIndex' as their object.
+//
+// Each node is tested once for the whole packet with interval
+// arithmetic.  Only at the leaves are the rays tested individually.
+
+void BVH::packetInt( RayPacket &packet, int objIndex )
+
+{
+  if (nodes == NULL)
+    return;
+
+  int  localStack[ BVH_STACK_SIZE ];
+  int *stack = (stackSize <= BVH_STACK_SIZE ? localStack : new int[ stackSize ]);
+  int  top = 0;
+
+  stack[top++] = 0;		// root
+
+  int   hitTriangle[ MAX_PACKET_RAYS ];
+  float hitAlpha[ MAX_PACKET_RAYS ], hitBeta[ MAX_PACKET_RAYS ];
+
+  for (int r=0; r<packet.numRays; r++)
+    hitTriangle[r] = -1;
+
+  float packetT = packet.maxT();
+
+  int nodesVisited = 0;
+
+  while (top > 0) {
+
+    BVH_flatNode &n = nodes[ stack[--top] ];
+
+    nodesVisited++;
+
+    if (!packet.mayHitBox( n.bbox, packetT ))
+      continue;
+
+    if (!n.isLeaf) {
+
+      for (int i=n.count-1; i>=0; i--)
+	stack[top++] = n.offset + i;
+
+      continue;
+    }
+
+    packetLeafInt( packet, n.offset, n.count, n.bbox, hitTriangle, hitAlpha, hitBeta );
+
+    packetT = packet.maxT();
+  }
+
+  if (stack != localStack)
+    delete [] stack;
+
+  perfCounters.addTraversal( nodesVisited, nodesVisited, 0 ); // packetLeafInt() counts the rest
+
+  packetFinishInt( packet, objIndex, hitTriangle, hitAlpha, hitBeta );
+}
+
+
+
+// Check a leaf for each ray in the packet that hits its box.  Closer
+// hits update the ray's distance in the packet, and are recorded in
+// hitTriangle[], hitAlpha[], and hitBeta[] for packetFinishInt().
+
+void BVH::packetLeafInt( RayPacket &packet, int first, int count, BBox &box, int hitTriangle[], float hitAlpha[], float hitBeta[] )
+
+{
+  int raysIn = 0;
+
+  for (int r=0; r<packet.numRays; r++)
+    if (rayBoxInt( packet.org, packet.invDir[r], 0, packet.t[r], box )) {
+      leafInt( first, count, packet.org, packet.dir[r], -1, packet.t[r], hitTriangle[r], hitAlpha[r], hitBeta[r] );
+      raysIn++;
+    }
+
+  perfCounters.addTraversal( 0, packet.numRays, raysIn * count );
+}
+
+
+
+// Fill in the intersections of the rays whose closest hit is in this
+// BVH.
+
+void BVH::packetFinishInt( RayPacket &packet, int objIndex, int hitTriangle[], float hitAlpha[], float hitBeta[] )
+
+{
+  for (int r=0; r<packet.numRays; r++)
+    if (hitTriangle[r] >= 0) {
+      packet.hit[r] = true;
+      packet.objIndex[r] = objIndex;
+      packet.objPartIndex[r] = hitTriangle[r];
+      finishInt( packet.org, packet.dir[r], packet.t[r], hitTriangle[r], hitAlpha[r], hitBeta[r],
+		 packet.P[r], packet.N[r], packet.T[r], packet.mat[r] );
+    }
+}
+
+
+
+// Could any ray in the packet hit each of the boxes of a wide node
+// within [0,tmax]?  This is RayPacket::mayHitBox() for all lanes at
+// once.  Returns a bit mask of the lanes, and a lower bound on the
+// entry distance of each.  Unused lanes (count -1) are masked out, as
+// in the single-ray box tests.
+
+static int packetBoxTest( BVH_wideNode &n, RayPacket &packet, float tmax, float tNear[BVH_WIDTH] )
+
+{
+  // Near and far planes on each axis, by the sign of the directions
+
+  float *nearX = (packet.invMin.x < 0 ? n.maxX : n.minX), *farX = (packet.invMin.x < 0 ? n.minX : n.maxX);
+  float *nearY = (packet.invMin.y < 0 ? n.maxY : n.minY), *farY = (packet.invMin.y < 0 ? n.minY : n.maxY);
+  float *nearZ = (packet.invMin.z < 0 ? n.maxZ : n.minZ), *farZ = (packet.invMin.z < 0 ? n.minZ : n.maxZ);
+
+#ifdef BVH_X86
+
+  __m128 ox = _mm_set1_ps( packet.org.x ), ix0 = _mm_set1_ps( packet.invMin.x ), ix1 = _mm_set1_ps( packet.invMax.x );
+  __m128 oy = _mm_set1_ps( packet.org.y ), iy0 = _mm_set1_ps( packet.invMin.y ), iy1 = _mm_set1_ps( packet.invMax.y );
+  __m128 oz = _mm_set1_ps( packet.org.z ), iz0 = _mm_set1_ps( packet.invMin.z ), iz1 = _mm_set1_ps( packet.invMax.z );
+
+  __m128 zero = _mm_setzero_ps();
+  __m128 tMax = _mm_set1_ps( tmax );
+
+  int mask = 0;
+
+  for (int h=0; h<BVH_WIDTH; h+=4) {
+
+    __m128 dx0 = _mm_sub_ps( _mm_load_ps( nearX+h ), ox ), dx1 = _mm_sub_ps( _mm_load_ps( farX+h ), ox );
+    __m128 dy0 = _mm_sub_ps( _mm_load_ps( nearY+h ), oy ), dy1 = _mm_sub_ps( _mm_load_ps( farY+h ), oy );
+    __m128 dz0 = _mm_sub_ps( _mm_load_ps( nearZ+h ), oz ), dz1 = _mm_sub_ps( _mm_load_ps( farZ+h ), oz );
+
+    __m128 entryX = _mm_min_ps( _mm_mul_ps( dx0, ix0 ), _mm_mul_ps( dx0, ix1 ) );
+    __m128 entryY = _mm_min_ps( _mm_mul_ps( dy0, iy0 ), _mm_mul_ps( dy0, iy1 ) );
+    __m128 entryZ = _mm_min_ps( _mm_mul_ps( dz0, iz0 ), _mm_mul_ps( dz0, iz1 ) );
+
+    __m128 exitX  = _mm_max_ps( _mm_mul_ps( dx1, ix0 ), _mm_mul_ps( dx1, ix1 ) );
+    __m128 exitY  = _mm_max_ps( _mm_mul_ps( dy1, iy0 ), _mm_mul_ps( dy1, iy1 ) );
+    __m128 exitZ  = _mm_max_ps( _mm_mul_ps( dz1, iz0 ), _mm_mul_ps( dz1, iz1 ) );
+
+    __m128 tmin = _mm_max_ps( _mm_max_ps( entryX, entryY ), _mm_max_ps( entryZ, zero ) );
+    __m128 tfar = _mm_min_ps( _mm_min_ps( exitX, exitY ), _mm_min_ps( exitZ, tMax ) );
+
+    _mm_storeu_ps( tNear+h, tmin );
+
+    int unused = _mm_movemask_ps( _mm_castsi128_ps( _mm_load_si128( (__m128i *) (n.count+h) ) ) );
+
+    mask |= (_mm_movemask_ps( _mm_cmple_ps( tmin, tfar ) ) & ~unused) << h;
+  }
+
+  return mask;
+
+#else
+
+  int mask = 0;
+
+  for (int i=0; i<BVH_WIDTH; i++) {
+
+    float d[3][2] = { { nearX[i] - packet.org.x, farX[i] - packet.org.x },
+		      { nearY[i] - packet.org.y, farY[i] - packet.org.y },
+		      { nearZ[i] - packet.org.z, farZ[i] - packet.org.z } };
+
+    float tmin = 0, tfar = tmax;
+
+    for (int k=0; k<3; k++) {
+      float e0 = d[k][0] * packet.invMin[k], e1 = d[k][0] * packet.invMax[k];
+      float x0 = d[k][1] * packet.invMin[k], x1 = d[k][1] * packet.invMax[k];
+      float entry = (e0 < e1 ? e0 : e1);
+      float exit  = (x0 > x1 ? x0 : x1);
+      if (entry > tmin) tmin = entry;
+      if (exit  < tfar) tfar = exit;
+    }
+
+    if (tmin <= tfar && n.count[i] >= 0) {
+      mask |= (1 << i);
+      tNear[i] = tmin;
+    }
+  }
+
+  return mask;
+
+#endif
+}
+
+
+
+// As packetInt(), but on the wide tree.  The lanes that the packet
+// may hit are pushed farthest first, as in rayIntWide().
+
+void BVH::packetIntWide( RayPacket &packet, int objIndex )
+
+{
+  if (wideNodes == NULL)
+    return;
+
+  int    localRefs[ BVH_STACK_SIZE ];
+  float  localDists[ BVH_STACK_SIZE ];
+
+  bool   onHeap = (wideStackSize > BVH_STACK_SIZE);
+  int   *stackRef  = (onHeap ? new int[ wideStackSize ]   : localRefs);
+  float *stackDist = (onHeap ? new float[ wideStackSize ] : localDists);
+  int    top = 0;
+
+  int   hitTriangle[ MAX_PACKET_RAYS ];
+  float hitAlpha[ MAX_PACKET_RAYS ], hitBeta[ MAX_PACKET_RAYS ];
+
+  for (int r=0; r<packet.numRays; r++)
+    hitTriangle[r] = -1;
+
+  float packetT = packet.maxT();
+
+  int nodeIndex = 0;
+  int nodesVisited = 0;
+
+  while (nodeIndex >= 0) {
+
+    float tNear[ BVH_WIDTH ];
+    int mask = packetBoxTest( wideNodes[nodeIndex], packet, packetT, tNear );
+
+    nodesVisited++;
+
+    int lanes[ BVH_WIDTH ];
+    int numHit = 0;
+
+    for (int i=0; i<BVH_WIDTH; i++)
+      if (mask & (1 << i)) {
+	int j = numHit++;
+	while (j > 0 && tNear[ lanes[j-1] ] < tNear[i]) {
+	  lanes[j] = lanes[j-1];
+	  j--;
+	}
+	lanes[j] = i;
+      }
+
+    for (int i=0; i<numHit; i++) {
+      stackRef[top]  = nodeIndex * BVH_WIDTH + lanes[i];
+      stackDist[top] = tNear[ lanes[i] ];
+      top++;
+    }
+
+    nodeIndex = -1;
+
+    while (top > 0) {
+
+      top--;
+
+      if (stackDist[top] > packetT)
+	continue;
+
+      BVH_wideNode &p = wideNodes[ stackRef[top] / BVH_WIDTH ];
+      int lane = stackRef[top] % BVH_WIDTH;
+
+      if (p.count[lane] == 0) {
+	nodeIndex = p.child[lane];
+	break;
+      }
+
+      BBox box( vec3( p.minX[lane], p.minY[lane], p.minZ[lane] ),
+		vec3( p.maxX[lane], p.maxY[lane], p.maxZ[lane] ) );
+
+      packetLeafInt( packet, p.child[lane], p.count[lane], box, hitTriangle, hitAlpha, hitBeta );
+
+      packetT = packet.maxT();
+    }
+  }
+
+  if (onHeap) {
+    delete [] stackRef;
+    delete [] stackDist;
+  }
+
+  perfCounters.addTraversal( nodesVisited, nodesVisited * BVH_WIDTH, 0 ); // packetLeafInt() counts the rest
+
+  packetFinishInt( packet, objIndex, hitTriangle, hitAlpha, hitBeta );
+}
@@ -0,0 +1,270 @@
+// bvhTriangles.cpp
+//
+// Ray/triangle intersection in the leaves of a BVH
+//
+// The triangles are packed, in BVH::triangles order, into blocks of
+// BVH_TRI_WIDTH holding the first vertex and the two edges from it.
+// A leaf's triangles are contiguous, so a leaf covers a run of lanes
+// in consecutive blocks and is tested without touching the vertex
+// list.  The test is Moller-Trumbore, which needs only the vertex and
+// edges.  It gives the distance and barycentric coordinates; the
+// normal and texture coordinates are interpolated once, for the
+// closest hit, by finishInt().
+
+
+#include "bvh.h"
+
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(_M_IX86)
+  #define BVH_X86
+  #include <immintrin.h>
+#endif
+
+
+
+// Pack the triangles into blocks.  Unused lanes of the last block
+// are zero, i.e. degenerate, so no ray hits them.
+
+void BVH::buildTriBlocks()
+
+{
+  if (triBlocks != NULL)
+    delete [] triBlocks;
+
+  numTriBlocks = (triangles.size() + BVH_TRI_WIDTH - 1) / BVH_TRI_WIDTH;
+  triBlocks = new BVH_triBlock[ numTriBlocks ];
+
+  memset( triBlocks, 0, numTriBlocks * sizeof(BVH_triBlock) );
+
+  for (int i=0; i<triangles.size(); i++) {
+
+    BVH_triangle &tri = triangles[i];
+    BVH_triBlock &b = triBlocks[ i / BVH_TRI_WIDTH ];
+    int lane = i % BVH_TRI_WIDTH;
+
+    vec3 &v0 = (*vertices)[ tri.v0 ];
+    vec3 e1 = (*vertices)[ tri.v1 ] - v0;
+    vec3 e2 = (*vertices)[ tri.v2 ] - v0;
+
+    b.v0x[lane] = v0.x; b.v0y[lane] = v0.y; b.v0z[lane] = v0.z;
+    b.e1x[lane] = e1.x; b.e1y[lane] = e1.y; b.e1z[lane] = e1.z;
+    b.e2x[lane] = e2.x; b.e2y[lane] = e2.y; b.e2z[lane] = e2.z;
+  }
+}
+
+
+
+// Moller-Trumbore test of one lane of a block.  On a hit in
+// [0,maxParam), returns the distance and the barycentric coordinates
+// of v1 (alpha) and v2 (beta).
+
+static inline bool triLaneInt( BVH_triBlock &b, int lane, vec3 &o, vec3 &d, float maxParam, float &t, float &alpha, float &beta )
+
+{
+  vec3 e1( b.e1x[lane], b.e1y[lane], b.e1z[lane] );
+  vec3 e2( b.e2x[lane], b.e2y[lane], b.e2z[lane] );
+
+  vec3 pvec = d ^ e2;
+  float det = e1 * pvec;
+
+  if (det == 0)
+    return false;		// ray is parallel to plane, or the triangle is degenerate
+
+  float invDet = 1.0f / det;
+
+  vec3 tvec = o - vec3( b.v0x[lane], b.v0y[lane], b.v0z[lane] );
+
+  float u = (tvec * pvec) * invDet;
+  if (u < 0 || u > 1)
+    return false;
+
+  vec3 qvec = tvec ^ e1;
+
+  float v = (d * qvec) * invDet;
+  if (v < 0 || u + v > 1)
+    return false;
+
+  float thisT = (e2 * qvec) * invDet;
+  if (thisT < 0 || thisT >= maxParam)
+    return false;
+
+  t = thisT;
+  alpha = u;
+  beta = v;
+
+  return true;
+}
+
+
+#ifdef BVH_X86
+
+// The same test on all four lanes of a block with SSE.  'laneMask'
+// selects the lanes to test.  Returns the lanes hit.
+
+static inline int triBlockIntSSE( BVH_triBlock &b, int laneMask, vec3 &o, vec3 &d, float maxParam, float t[4], float alpha[4], float beta[4] )
+
+{
+  __m128 dx = _mm_set1_ps( d.x ), dy = _mm_set1_ps( d.y ), dz = _mm_set1_ps( d.z );
+
+  __m128 e1x = _mm_load_ps( b.e1x ), e1y = _mm_load_ps( b.e1y ), e1z = _mm_load_ps( b.e1z );
+  __m128 e2x = _mm_load_ps( b.e2x ), e2y = _mm_load_ps( b.e2y ), e2z = _mm_load_ps( b.e2z );
+
+  // pvec = d ^ e2, det = e1 * pvec
+
+  __m128 px = _mm_sub_ps( _mm_mul_ps( dy, e2z ), _mm_mul_ps( dz, e2y ) );
+  __m128 py = _mm_sub_ps( _mm_mul_ps( dz, e2x ), _mm_mul_ps( dx, e2z ) );
+  __m128 pz = _mm_sub_ps( _mm_mul_ps( dx, e2y ), _mm_mul_ps( dy, e2x ) );
+
+  __m128 det = _mm_add_ps( _mm_add_ps( _mm_mul_ps( e1x, px ), _mm_mul_ps( e1y, py ) ), _mm_mul_ps( e1z, pz ) );
+  __m128 invDet = _mm_div_ps( _mm_set1_ps( 1.0f ), det );
+
+  // tvec = o - v0, u = (tvec * pvec) / det
+
+  __m128 tx = _mm_sub_ps( _mm_set1_ps( o.x ), _mm_load_ps( b.v0x ) );
+  __m128 ty = _mm_sub_ps( _mm_set1_ps( o.y ), _mm_load_ps( b.v0y ) );
+  __m128 tz = _mm_sub_ps( _mm_set1_ps( o.z ), _mm_load_ps( b.v0z ) );
+
+  __m128 u = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( tx, px ), _mm_mul_ps( ty, py ) ), _mm_mul_ps( tz, pz ) ), invDet );
+
+  // qvec = tvec ^ e1, v = (d * qvec) / det, t = (e2 * qvec) / det
+
+  __m128 qx = _mm_sub_ps( _mm_mul_ps( ty, e1z ), _mm_mul_ps( tz, e1y ) );
+  __m128 qy = _mm_sub_ps( _mm_mul_ps( tz, e1x ), _mm_mul_ps( tx, e1z ) );
+  __m128 qz = _mm_sub_ps( _mm_mul_ps( tx, e1y ), _mm_mul_ps( ty, e1x ) );
+
+  __m128 v  = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( dx, qx ), _mm_mul_ps( dy, qy ) ), _mm_mul_ps( dz, qz ) ), invDet );
+  __m128 tt = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( e2x, qx ), _mm_mul_ps( e2y, qy ) ), _mm_mul_ps( e2z, qz ) ), invDet );
+
+  // Inside the triangle and within [0,maxParam).  Comparisons with
+  // NaN (from a zero det) are false, so degenerate lanes miss.
+
+  __m128 zero = _mm_setzero_ps();
+  __m128 one  = _mm_set1_ps( 1.0f );
+
+  __m128 ok = _mm_and_ps( _mm_cmpge_ps( u, zero ), _mm_cmpge_ps( v, zero ) );
+  ok = _mm_and_ps( ok, _mm_cmple_ps( _mm_add_ps( u, v ), one ) );
+  ok = _mm_and_ps( ok, _mm_cmpge_ps( tt, zero ) );
+  ok = _mm_and_ps( ok, _mm_cmplt_ps( tt, _mm_set1_ps( maxParam ) ) );
+  ok = _mm_and_ps( ok, _mm_cmpneq_ps( det, zero ) );
+
+  int mask = _mm_movemask_ps( ok ) & laneMask;
+
+  if (mask) {
+    _mm_storeu_ps( t, tt );
+    _mm_storeu_ps( alpha, u );
+    _mm_storeu_ps( beta, v );
+  }
+
+  return mask;
+}
+
+#endif
+
+
+
+// Check the triangles [first,first+count) of a leaf.  If a hit closer
+// than 'maxParam' is found, reduce 'maxParam' to it and return its
+// triangle and barycentric coordinates.
+
+bool BVH::leafInt( int first, int count, vec3 &rayStart, vec3 &rayDir, int sourceTriangleIndex, float &maxParam, int &intTriangleIndex, float &intAlpha, float &intBeta )
+
+{
+  bool hit = false;
+
+  int end = first + count;
+
+  for (int blockStart = first - first % BVH_TRI_WIDTH; blockStart < end; blockStart += BVH_TRI_WIDTH) {
+
+    BVH_triBlock &b = triBlocks[ blockStart / BVH_TRI_WIDTH ];
+
+    // Lanes of this block that belong to the leaf, excluding the
+    // triangle from which the ray started
+
+    int laneMask = 0;
+    for (int lane=0; lane<BVH_TRI_WIDTH; lane++) {
+      int i = blockStart + lane;
+      if (i >= first && i < end && i != sourceTriangleIndex)
+	laneMask |= (1 << lane);
+    }
+
+#ifdef BVH_X86
+
+    if (kernel == SSE_KERNEL || kernel == AVX_KERNEL) {
+
+      float t[4], alpha[4], beta[4];
+
+      int mask = triBlockIntSSE( b, laneMask, rayStart, rayDir, maxParam, t, alpha, beta );
+
+      for (int lane=0; mask != 0; lane++, mask >>= 1)
+	if ((mask & 1) && t[lane] < maxParam) {
+	  maxParam = t[lane];
+	  intAlpha = alpha[lane];
+	  intBeta  = beta[lane];
+	  intTriangleIndex = blockStart + lane;
+	  hit = true;
+	}
+
+      continue;
+    }
+
+#endif
+
+    for (int lane=0; lane<BVH_TRI_WIDTH; lane++)
+      if (laneMask & (1 << lane)) {
+
+	float t, alpha, beta;
+
+	if (triLaneInt( b, lane, rayStart, rayDir, maxParam, t, alpha, beta )) {
+	  maxParam = t;
+	  intAlpha = alpha;
+	  intBeta  = beta;
+	  intTriangleIndex = blockStart + lane;
+	  hit = true;
+	}
+      }
+  }
+
+  return hit;
+}
+
+
+
+// Fill in the intersection point, normal, texture coordinates, and
+// material of the closest hit found by leafInt().
+
+void BVH::finishInt( vec3 &rayStart, vec3 &rayDir, float param, int triangleIndex, float alpha, float beta, vec3 &point, vec3 &normal, vec3 &texCoord, Material * &mat )
+
+{
+  BVH_triangle &tri = triangles[triangleIndex];
+
+  float gamma = 1 - alpha - beta; // for v0
+
+  point = rayStart + param * rayDir;
+
+  if (!obj->hasVertexNormals)
+
+    normal = (*facetnorms)[ tri.faceID ]; // use face normal
+
+  else {
+
+    vec3 &n0 = (*normals)[ tri.n0 ]; // interpolate vertex normals
+    vec3 &n1 = (*normals)[ tri.n1 ];
+    vec3 &n2 = (*normals)[ tri.n2 ];
+
+    normal = (gamma*n0 + alpha*n1 + beta*n2).normalize();
+  }
+
+  if (obj->hasVertexTexCoords) {
+
+    vec3 &t0 = (*texcoords)[ tri.t0 ]; // interpolate vertex texcoords
+    vec3 &t1 = (*texcoords)[ tri.t1 ];
+    vec3 &t2 = (*texcoords)[ tri.t2 ];
+
+    texCoord = gamma*t0 + alpha*t1 + beta*t2;
+  }
+
+  mat = materials[ tri.materialID ];
+
+  // Note that bump mapping is not implemented yet, but should be
+  // done here to return the bump-mapped normal.
+}
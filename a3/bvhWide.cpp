@@ -0,0 +1,488 @@
+// bvhWide.cpp
+//
+// Wide BVH: each node holds the boxes of up to BVH_WIDTH children in
+// structure-of-arrays form, so that a ray can be tested against all of
+// them with a few SSE or AVX instructions.
+//
+// The wide tree is built from the flattened tree by pulling
+// grandchildren up into their parent until BVH_WIDTH children are
+// reached.  The k-means builder already makes nodes with up to 8
+// children; the SAH builder makes binary nodes, which are collapsed.
+
+
+#include "bvh.h"
+#include "perfCounters.h"
+
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(_M_IX86)
+  #define BVH_X86
+  #include <immintrin.h>
+  #ifdef _MSC_VER
+    #include <intrin.h>
+    #define TARGET_AVX
+  #else
+    #define TARGET_AVX __attribute__((target("avx")))
+  #endif
+#endif
+
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+
+
+// Box tests for one wide node.  Each returns a bit mask of the lanes
+// whose boxes the ray enters within [0,maxParam], and the entry
+// distances in tNear[].  Unused lanes (count -1) are masked out; the
+// SIMD tests take their sign bits from the counts.
+
+
+static int boxTestScalar( BVH_wideNode &n, float org[3], float invDir[3], float maxParam, float tNear[BVH_WIDTH] )
+
+{
+  int mask = 0;
+
+  for (int i=0; i<BVH_WIDTH; i++) {
+
+    float tx0 = (n.minX[i] - org[0]) * invDir[0], tx1 = (n.maxX[i] - org[0]) * invDir[0];
+    float ty0 = (n.minY[i] - org[1]) * invDir[1], ty1 = (n.maxY[i] - org[1]) * invDir[1];
+    float tz0 = (n.minZ[i] - org[2]) * invDir[2], tz1 = (n.maxZ[i] - org[2]) * invDir[2];
+
+    float tmin = MAX( MAX( MIN(tx0,tx1), MIN(ty0,ty1) ), MAX( MIN(tz0,tz1), 0 ) );
+    float tmax = MIN( MIN( MAX(tx0,tx1), MAX(ty0,ty1) ), MIN( MAX(tz0,tz1), maxParam ) );
+
+    if (tmin <= tmax && n.count[i] >= 0) {
+      mask |= (1 << i);
+      tNear[i] = tmin;
+    }
+  }
+
+  return mask;
+}
+
+
+#ifdef BVH_X86
+
+
+// Two groups of four lanes with SSE (always available on x86-64)
+
+static int boxTestSSE( BVH_wideNode &n, float org[3], float invDir[3], float maxParam, float tNear[BVH_WIDTH] )
+
+{
+  __m128 ox = _mm_set1_ps( org[0] ), ix = _mm_set1_ps( invDir[0] );
+  __m128 oy = _mm_set1_ps( org[1] ), iy = _mm_set1_ps( invDir[1] );
+  __m128 oz = _mm_set1_ps( org[2] ), iz = _mm_set1_ps( invDir[2] );
+
+  __m128 zero = _mm_setzero_ps();
+  __m128 tMax = _mm_set1_ps( maxParam );
+
+  int mask = 0;
+
+  for (int h=0; h<BVH_WIDTH; h+=4) {
+
+    __m128 tx0 = _mm_mul_ps( _mm_sub_ps( _mm_load_ps( n.minX+h ), ox ), ix );
+    __m128 tx1 = _mm_mul_ps( _mm_sub_ps( _mm_load_ps( n.maxX+h ), ox ), ix );
+    __m128 ty0 = _mm_mul_ps( _mm_sub_ps( _mm_load_ps( n.minY+h ), oy ), iy );
+    __m128 ty1 = _mm_mul_ps( _mm_sub_ps( _mm_load_ps( n.maxY+h ), oy ), iy );
+    __m128 tz0 = _mm_mul_ps( _mm_sub_ps( _mm_load_ps( n.minZ+h ), oz ), iz );
+    __m128 tz1 = _mm_mul_ps( _mm_sub_ps( _mm_load_ps( n.maxZ+h ), oz ), iz );
+
+    __m128 tmin = _mm_max_ps( _mm_max_ps( _mm_min_ps( tx0, tx1 ), _mm_min_ps( ty0, ty1 ) ),
+			      _mm_max_ps( _mm_min_ps( tz0, tz1 ), zero ) );
+    __m128 tmax = _mm_min_ps( _mm_min_ps( _mm_max_ps( tx0, tx1 ), _mm_max_ps( ty0, ty1 ) ),
+			      _mm_min_ps( _mm_max_ps( tz0, tz1 ), tMax ) );
+
+    _mm_storeu_ps( tNear+h, tmin );
+
+    int unused = _mm_movemask_ps( _mm_castsi128_ps( _mm_load_si128( (__m128i *) (n.count+h) ) ) );
+
+    mask |= (_mm_movemask_ps( _mm_cmple_ps( tmin, tmax ) ) & ~unused) << h;
+  }
+
+  return mask;
+}
+
+
+// All eight lanes at once with AVX
+
+TARGET_AVX static int boxTestAVX( BVH_wideNode &n, float org[3], float invDir[3], float maxParam, float tNear[BVH_WIDTH] )
+
+{
+  __m256 ox = _mm256_set1_ps( org[0] ), ix = _mm256_set1_ps( invDir[0] );
+  __m256 oy = _mm256_set1_ps( org[1] ), iy = _mm256_set1_ps( invDir[1] );
+  __m256 oz = _mm256_set1_ps( org[2] ), iz = _mm256_set1_ps( invDir[2] );
+
+  __m256 tx0 = _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( n.minX ), ox ), ix );
+  __m256 tx1 = _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( n.maxX ), ox ), ix );
+  __m256 ty0 = _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( n.minY ), oy ), iy );
+  __m256 ty1 = _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( n.maxY ), oy ), iy );
+  __m256 tz0 = _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( n.minZ ), oz ), iz );
+  __m256 tz1 = _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( n.maxZ ), oz ), iz );
+
+  __m256 tmin = _mm256_max_ps( _mm256_max_ps( _mm256_min_ps( tx0, tx1 ), _mm256_min_ps( ty0, ty1 ) ),
+			       _mm256_max_ps( _mm256_min_ps( tz0, tz1 ), _mm256_setzero_ps() ) );
+  __m256 tmax = _mm256_min_ps( _mm256_min_ps( _mm256_max_ps( tx0, tx1 ), _mm256_max_ps( ty0, ty1 ) ),
+			       _mm256_min_ps( _mm256_max_ps( tz0, tz1 ), _mm256_set1_ps( maxParam ) ) );
+
+  _mm256_storeu_ps( tNear, tmin );
+
+  int unused = _mm256_movemask_ps( _mm256_castsi256_ps( _mm256_load_si256( (__m256i *) n.count ) ) );
+
+  return _mm256_movemask_ps( _mm256_cmp_ps( tmin, tmax, _CMP_LE_OQ ) ) & ~unused;
+}
+
+
+// Does the CPU (and OS) support AVX?
+
+static bool cpuHasAVX()
+
+{
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid( info, 1 );
+  bool osxsave = (info[2] & (1 << 27)) != 0;
+  bool avx     = (info[2] & (1 << 28)) != 0;
+  return osxsave && avx && (_xgetbv(0) & 6) == 6;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports( "avx" );
+#endif
+}
+
+
+#endif
+
+
+
+// The traversal kernel is chosen when the program starts, and may be
+// changed with --bvh-kernel.
+
+BVHKernel   BVH::kernel      = SCALAR_KERNEL;
+WideBoxTest BVH::wideBoxTest = boxTestScalar;
+
+static bool kernelChosen = BVH::setKernel( BVH::bestKernel() );
+
+
+BVHKernel BVH::bestKernel()
+
+{
+#ifdef BVH_X86
+  if (cpuHasAVX())
+    return AVX_KERNEL;
+  return SSE_KERNEL;
+#else
+  return WIDE_KERNEL;
+#endif
+}
+
+
+// Select a kernel.  Return false (and keep the current kernel) if
+// this CPU can't run it.
+
+bool BVH::setKernel( BVHKernel k )
+
+{
+  switch (k) {
+
+  case SCALAR_KERNEL:
+  case WIDE_KERNEL:
+    wideBoxTest = boxTestScalar;
+    break;
+
+#ifdef BVH_X86
+  case SSE_KERNEL:
+    wideBoxTest = boxTestSSE;
+    break;
+
+  case AVX_KERNEL:
+    if (!cpuHasAVX())
+      return false;
+    wideBoxTest = boxTestAVX;
+    break;
+#endif
+
+  default:
+    return false;
+  }
+
+  kernel = k;
+  return true;
+}
+
+
+const char *BVH::kernelName( BVHKernel k )
+
+{
+  switch (k) {
+  case SCALAR_KERNEL: return "scalar";
+  case WIDE_KERNEL:   return "wide";
+  case SSE_KERNEL:    return "sse";
+  case AVX_KERNEL:    return "avx";
+  }
+  return "unknown";
+}
+
+
+
+// Build the wide tree from the flattened tree
+
+void BVH::buildWideTree()
+
+{
+  if (nodes == NULL)
+    return;
+
+  // Each wide node uses up at least one flat node
+
+  wideNodes = new BVH_wideNode[ numNodes ];
+  numWideNodes = 0;
+
+  int maxDepth = 0;
+  buildWideNode( 0, 0, maxDepth );
+
+  // Each node visited pushes at most BVH_WIDTH entries and pops one
+
+  wideStackSize = (maxDepth+1) * BVH_WIDTH;
+}
+
+
+// Make a wide node for the children of flat node 'flatIndex' (or for
+// the node itself, if it's a leaf).  Return the wide node's index.
+
+int BVH::buildWideNode( int flatIndex, int depth, int &maxDepth )
+
+{
+  if (depth > maxDepth)
+    maxDepth = depth;
+
+  int index = numWideNodes++;
+
+  // Collect the flat nodes that become the lanes
+
+  int lanes[ BVH_WIDTH ];
+  int numLanes = 0;
+
+  BVH_flatNode &f = nodes[flatIndex];
+
+  if (f.isLeaf)
+    lanes[numLanes++] = flatIndex;
+  else {
+    if (f.count > BVH_WIDTH) {
+      cerr << "BVH node has " << f.count << " children, but wide nodes hold only " << BVH_WIDTH << endl;
+      exit(1);
+    }
+    for (int i=0; i<(int) f.count; i++)
+      lanes[numLanes++] = f.offset + i;
+  }
+
+  // Replace inner lanes with their children, largest box first, while
+  // they fit
+
+  while (true) {
+
+    int   best = -1;
+    float bestArea = -1;
+
+    for (int i=0; i<numLanes; i++) {
+      BVH_flatNode &c = nodes[ lanes[i] ];
+      if (!c.isLeaf && numLanes-1+(int)c.count <= BVH_WIDTH && c.bbox.area() > bestArea) {
+	best = i;
+	bestArea = c.bbox.area();
+      }
+    }
+
+    if (best < 0)
+      break;
+
+    BVH_flatNode &c = nodes[ lanes[best] ];
+
+    lanes[best] = c.offset;
+    for (int j=1; j<(int) c.count; j++)
+      lanes[numLanes++] = c.offset + j;
+  }
+
+  // Fill in the lanes, recursing into inner nodes
+
+  for (int i=0; i<BVH_WIDTH; i++) {
+
+    BVH_wideNode &w = wideNodes[index];
+
+    if (i >= numLanes) {	// unused lane: masked out by its count
+      w.minX[i] = w.minY[i] = w.minZ[i] =  FLT_MAX;
+      w.maxX[i] = w.maxY[i] = w.maxZ[i] = -FLT_MAX;
+      w.child[i] = 0;
+      w.count[i] = -1;
+      continue;
+    }
+
+    BVH_flatNode &c = nodes[ lanes[i] ];
+
+    w.minX[i] = c.bbox.min.x;  w.maxX[i] = c.bbox.max.x;
+    w.minY[i] = c.bbox.min.y;  w.maxY[i] = c.bbox.max.y;
+    w.minZ[i] = c.bbox.min.z;  w.maxZ[i] = c.bbox.max.z;
+
+    if (c.isLeaf) {
+      w.child[i] = c.offset;
+      w.count[i] = c.count;
+    } else {
+      int child = buildWideNode( lanes[i], depth+1, maxDepth );
+      w.child[i] = child;
+      w.count[i] = 0;
+    }
+  }
+
+  return index;
+}
+
+
+
+// Find the closest ray/triangle intersection in the wide tree.
+//
+// The children of a node that the ray hits are pushed farthest first,
+// so the nearest is visited next.  Each stack entry is a lane (node *
+// BVH_WIDTH + lane) with the distance at which the ray enters its box;
+// entries beyond the closest intersection so far are skipped.
+
+bool BVH::rayIntWide( vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam, vec3 & intPoint, vec3 & intNormal, vec3 & intTexCoords, float & intParam, Material * &intMaterial, int &intTriangleIndex )
+
+{
+  bool  hit = false;
+  int   hitTriangle;
+  float hitAlpha, hitBeta;
+
+  float org[3]    = { rayStart.x, rayStart.y, rayStart.z };
+  float invDir[3] = { 1.0f / rayDir.x, 1.0f / rayDir.y, 1.0f / rayDir.z }; // IEEE Inf for zero components
+
+  int    localRefs[ BVH_STACK_SIZE ];
+  float  localDists[ BVH_STACK_SIZE ];
+
+  bool   onHeap = (wideStackSize > BVH_STACK_SIZE);
+  int   *stackRef  = (onHeap ? new int[ wideStackSize ]   : localRefs);
+  float *stackDist = (onHeap ? new float[ wideStackSize ] : localDists);
+  int    top = 0;
+
+  int nodeIndex = 0;
+  int nodesVisited = 0, triangleTests = 0;
+
+  while (nodeIndex >= 0) {
+
+    // Test all boxes of this node
+
+    float tNear[ BVH_WIDTH ];
+    int mask = wideBoxTest( wideNodes[nodeIndex], org, invDir, maxParam, tNear );
+
+    nodesVisited++;
+
+    // Sort the lanes hit by distance, farthest first, and push them
+
+    int   lanes[ BVH_WIDTH ];
+    int   numHit = 0;
+
+    for (int i=0; i<BVH_WIDTH; i++)
+      if (mask & (1 << i)) {
+	int j = numHit++;
+	while (j > 0 && tNear[ lanes[j-1] ] < tNear[i]) {
+	  lanes[j] = lanes[j-1];
+	  j--;
+	}
+	lanes[j] = i;
+      }
+
+    for (int i=0; i<numHit; i++) {
+      stackRef[top]  = nodeIndex * BVH_WIDTH + lanes[i];
+      stackDist[top] = tNear[ lanes[i] ];
+      top++;
+    }
+
+    // Pop until an inner node is found, checking leaves on the way
+
+    nodeIndex = -1;
+
+    while (top > 0) {
+
+      top--;
+
+      if (stackDist[top] > maxParam)
+	continue;		// beyond the closest intersection so far
+
+      BVH_wideNode &p = wideNodes[ stackRef[top] / BVH_WIDTH ];
+      int lane = stackRef[top] % BVH_WIDTH;
+
+      if (p.count[lane] == 0) {
+	nodeIndex = p.child[lane];
+	break;
+      }
+
+      triangleTests += p.count[lane];
+
+      if (leafInt( p.child[lane], p.count[lane], rayStart, rayDir, sourceTriangleIndex, maxParam, hitTriangle, hitAlpha, hitBeta ))
+	hit = true;
+    }
+  }
+
+  if (onHeap) {
+    delete [] stackRef;
+    delete [] stackDist;
+  }
+
+  perfCounters.addTraversal( nodesVisited, nodesVisited * BVH_WIDTH, triangleTests );
+
+  if (hit) {
+    intParam = maxParam;
+    intTriangleIndex = hitTriangle;
+    finishInt( rayStart, rayDir, maxParam, hitTriangle, hitAlpha, hitBeta, intPoint, intNormal, intTexCoords, intMaterial );
+  }
+
+  return hit;
+}
+
+
+
+// Is the ray blocked within [0,maxParam]?  As rayIntWide(), but
+// returns at the first triangle hit, so the children need not be
+// sorted.
+
+bool BVH::occludedWide( vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam, int &occluderIndex )
+
+{
+  bool  hit = false;
+  float alpha, beta;
+
+  float org[3]    = { rayStart.x, rayStart.y, rayStart.z };
+  float invDir[3] = { 1.0f / rayDir.x, 1.0f / rayDir.y, 1.0f / rayDir.z };
+
+  int  localStack[ BVH_STACK_SIZE ];
+  int *stack = (wideStackSize > BVH_STACK_SIZE ? new int[ wideStackSize ] : localStack);
+  int  top = 0;
+
+  stack[top++] = 0;		// root node
+
+  int nodesVisited = 0, triangleTests = 0;
+
+  while (top > 0 && !hit) {
+
+    BVH_wideNode &n = wideNodes[ stack[--top] ];
+
+    float tNear[ BVH_WIDTH ];
+    int mask = wideBoxTest( n, org, invDir, maxParam, tNear );
+
+    nodesVisited++;
+
+    for (int lane=0; mask != 0 && !hit; lane++, mask >>= 1)
+      if (mask & 1) {
+	if (n.count[lane] == 0)
+	  stack[top++] = n.child[lane];
+	else {
+	  triangleTests += n.count[lane];
+	  hit = leafInt( n.child[lane], n.count[lane], rayStart, rayDir, sourceTriangleIndex, maxParam, occluderIndex, alpha, beta );
+	}
+      }
+  }
+
+  if (stack != localStack)
+    delete [] stack;
+
+  perfCounters.addTraversal( nodesVisited, nodesVisited * BVH_WIDTH, triangleTests );
+
+  return hit;
+}
@@ -0,0 +1,493 @@
+// converge.cpp
+//
+// Image quality against render time.  See converge.h.
+
+
+#include "headers.h"
+
+#include <string>
+#include "converge.h"
+#include "sampler.h"
+
+
+#define MAX_PSNR 100		// dB, for identical images
+
+#define SSIM_WINDOW 8		// SSIM is averaged over windows of this size ...
+#define SSIM_STEP   4		// ... this far apart
+#define SSIM_C1     (0.01*0.01)	// constants of Wang et al. for a range of [0,1]
+#define SSIM_C2     (0.03*0.03)
+
+// Plot size and margins, in SVG units
+
+#define PLOT_WIDTH  640
+#define PLOT_HEIGHT 400
+#define PLOT_LEFT   60
+#define PLOT_RIGHT  60
+#define PLOT_TOP    40
+#define PLOT_BOTTOM 50
+
+
+// Read the next number or keyword of a PPM or PFM header, skipping
+// comments
+
+static bool readHeaderToken( FILE *in, char *token, int size )
+
+{
+  int c = fgetc( in );
+
+  while (c == '#' || isspace( c )) {
+    if (c == '#')
+      while (c != '\n' && c != EOF)
+	c = fgetc( in );
+    c = fgetc( in );
+  }
+
+  int n = 0;
+  while (c != EOF && !isspace( c ) && n < size-1) {
+    token[n++] = c;
+    c = fgetc( in );
+  }
+  token[n] = '\0';
+
+  return (n > 0);		// the single whitespace after the token is consumed
+}
+
+
+// Read an 8-bit PPM (P6) or a colour PFM (PF) image.  'pixels' is
+// allocated and filled with rows bottom-to-top, as in rtImage.
+
+bool readImage( const char *filename, int &width, int &height, vec3 *&pixels )
+
+{
+  FILE *in = fopen( filename, "rb" );
+  if (in == NULL) {
+    cerr << "Could not open " << filename << endl;
+    return false;
+  }
+
+  char magic[10], w[20], h[20], scale[40];
+
+  if (!readHeaderToken( in, magic, sizeof(magic) ) || !readHeaderToken( in, w, sizeof(w) ) ||
+      !readHeaderToken( in, h, sizeof(h) ) || !readHeaderToken( in, scale, sizeof(scale) ) ||
+      (strcmp( magic, "P6" ) != 0 && strcmp( magic, "PF" ) != 0)) {
+    cerr << filename << " is not a P6 PPM or a PF PFM image." << endl;
+    fclose( in );
+    return false;
+  }
+
+  width  = atoi( w );
+  height = atoi( h );
+
+  if (width <= 0 || height <= 0) {
+    cerr << filename << " has a bad size." << endl;
+    fclose( in );
+    return false;
+  }
+
+  pixels = new vec3[ width * height ];
+
+  bool ok = true;
+
+  if (strcmp( magic, "PF" ) == 0) {
+
+    // Rows go bottom-to-top.  A positive scale means big-endian
+    // floats.
+
+    bool swap = (atof( scale ) > 0);
+    float *row = new float[ 3*width ];
+
+    for (int y=0; y<height && ok; y++) {
+      ok = (fread( row, sizeof(float), 3*width, in ) == (size_t) (3*width));
+      for (int i=0; i<3*width && swap; i++) {
+	unsigned char *b = (unsigned char *) &row[i];
+	unsigned char t;
+	t = b[0]; b[0] = b[3]; b[3] = t;
+	t = b[1]; b[1] = b[2]; b[2] = t;
+      }
+      for (int x=0; x<width; x++)
+	pixels[ x + y * width ] = vec3( row[3*x], row[3*x+1], row[3*x+2] );
+    }
+
+    delete [] row;
+
+  } else {
+
+    // Rows go top-to-bottom
+
+    if (atoi( scale ) != 255) {
+      cerr << filename << " is not an 8-bit PPM image." << endl;
+      fclose( in );
+      delete [] pixels;
+      return false;
+    }
+
+    unsigned char *row = new unsigned char[ 3*width ];
+
+    for (int y=height-1; y>=0 && ok; y--) {
+      ok = (fread( row, 1, 3*width, in ) == (size_t) (3*width));
+      for (int x=0; x<width; x++)
+	pixels[ x + y * width ] = (1/255.0) * vec3( row[3*x], row[3*x+1], row[3*x+2] );
+    }
+
+    delete [] row;
+  }
+
+  fclose( in );
+
+  if (!ok) {
+    cerr << filename << " is too short." << endl;
+    delete [] pixels;
+    return false;
+  }
+
+  return true;
+}
+
+
+// Colours are compared as they are displayed, i.e. clamped to [0,1]
+
+static inline float clamp01( float v )
+
+{
+  return (v < 0 ? 0 : (v > 1 ? 1 : v));
+}
+
+
+float imagePSNR( vec3 *a, vec3 *b, int width, int height )
+
+{
+  double sumSq = 0;
+
+  for (int i=0; i<width*height; i++) {
+    float dr = clamp01( a[i].x ) - clamp01( b[i].x );
+    float dg = clamp01( a[i].y ) - clamp01( b[i].y );
+    float db = clamp01( a[i].z ) - clamp01( b[i].z );
+    sumSq += dr*dr + dg*dg + db*db;
+  }
+
+  double mse = sumSq / (3.0 * width * height);
+
+  if (mse <= 0)
+    return MAX_PSNR;
+
+  float psnr = -10 * log10( mse );
+
+  return (psnr < MAX_PSNR ? psnr : MAX_PSNR);
+}
+
+
+// Mean SSIM of the luminance, over SSIM_WINDOW x SSIM_WINDOW windows
+
+float imageSSIM( vec3 *a, vec3 *b, int width, int height )
+
+{
+  int n = width * height;
+
+  float *la = new float[n];
+  float *lb = new float[n];
+
+  for (int i=0; i<n; i++) {
+    la[i] = (clamp01( a[i].x ) + clamp01( a[i].y ) + clamp01( a[i].z )) / 3.0;
+    lb[i] = (clamp01( b[i].x ) + clamp01( b[i].y ) + clamp01( b[i].z )) / 3.0;
+  }
+
+  int window = (SSIM_WINDOW < width && SSIM_WINDOW < height ? SSIM_WINDOW : (width < height ? width : height));
+
+  double sum = 0;
+  int numWindows = 0;
+
+  for (int y0=0; y0+window<=height; y0+=SSIM_STEP)
+    for (int x0=0; x0+window<=width; x0+=SSIM_STEP) {
+
+      double sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+
+      for (int y=y0; y<y0+window; y++)
+	for (int x=x0; x<x0+window; x++) {
+	  float va = la[ x + y * width ];
+	  float vb = lb[ x + y * width ];
+	  sa  += va;
+	  sb  += vb;
+	  saa += va*va;
+	  sbb += vb*vb;
+	  sab += va*vb;
+	}
+
+      double k = window * window;
+      double ma = sa / k, mb = sb / k;
+      double varA = saa / k - ma*ma;
+      double varB = sbb / k - mb*mb;
+      double cov  = sab / k - ma*mb;
+
+      sum += ((2*ma*mb + SSIM_C1) * (2*cov + SSIM_C2)) / ((ma*ma + mb*mb + SSIM_C1) * (varA + varB + SSIM_C2));
+      numWindows++;
+    }
+
+  delete [] la;
+  delete [] lb;
+
+  return (numWindows > 0 ? sum / numWindows : 1);
+}
+
+
+// Copy the scene's RT image
+
+static vec3 *copyImage( Scene *scene, int width, int height )
+
+{
+  vec4 *image = scene->image();
+  vec3 *copy = new vec3[ width * height ];
+
+  for (int i=0; i<width*height; i++)
+    copy[i] = vec3( image[i].x, image[i].y, image[i].z );
+
+  return copy;
+}
+
+
+
+// Plot PSNR (left axis) and SSIM (right axis) of each step against
+// log time, with the target PSNR and the time it was reached (if
+// 'targetSeconds' >= 0)
+
+static bool writePlot( const char *filename, int n, double *seconds, float *psnr, float *ssim, float targetPSNR, double targetSeconds )
+
+{
+  FILE *out = fopen( filename, "w" );
+  if (out == NULL) {
+    cerr << "Could not open " << filename << " for writing." << endl;
+    return false;
+  }
+
+  // Ranges: whole decades of time, 5 dB steps of PSNR, and SSIM up to 1
+
+  double minT = seconds[0], maxT = seconds[0];
+  float  minP = targetPSNR, maxP = targetPSNR;
+  float  minS = 1;
+
+  for (int i=0; i<n; i++) {
+    if (seconds[i] < minT) minT = seconds[i];
+    if (seconds[i] > maxT) maxT = seconds[i];
+    if (psnr[i] < minP) minP = psnr[i];
+    if (psnr[i] > maxP) maxP = psnr[i];
+    if (ssim[i] < minS) minS = ssim[i];
+  }
+
+  int t0 = (int) floor( log10( minT > 0 ? minT : 1e-6 ) );
+  int t1 = (int) ceil( log10( maxT > 0 ? maxT : 1e-6 ) );
+  if (t1 <= t0)
+    t1 = t0+1;
+
+  float p0 = 5 * floor( minP / 5 );
+  float p1 = 5 * ceil( maxP / 5 );
+  if (p1 <= p0)
+    p1 = p0+5;
+
+  float s0 = floor( minS * 10 ) / 10;
+  if (s0 > 0.9)
+    s0 = 0.9;
+
+  float left   = PLOT_LEFT;
+  float right  = PLOT_WIDTH - PLOT_RIGHT;
+  float top    = PLOT_TOP;
+  float bottom = PLOT_HEIGHT - PLOT_BOTTOM;
+
+#define PX(t) (left + (log10( (t) > 0 ? (t) : 1e-6 ) - t0) / (t1 - t0) * (right - left))
+#define PY(p) (bottom - ((p) - p0) / (p1 - p0) * (bottom - top))
+#define SY(s) (bottom - ((s) - s0) / (1 - s0) * (bottom - top))
+
+  fprintf( out, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" font-family=\"sans-serif\" font-size=\"12\">\n",
+	   PLOT_WIDTH, PLOT_HEIGHT );
+  fprintf( out, "<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n" );
+  fprintf( out, "<rect x=\"%g\" y=\"%g\" width=\"%g\" height=\"%g\" fill=\"none\" stroke=\"black\"/>\n", left, top, right-left, bottom-top );
+
+  // Axes
+
+  for (int t=t0; t<=t1; t++) {
+    float x = PX( pow( 10.0, t ) );
+    fprintf( out, "<line x1=\"%g\" y1=\"%g\" x2=\"%g\" y2=\"%g\" stroke=\"#ddd\"/>\n", x, top, x, bottom );
+    fprintf( out, "<text x=\"%g\" y=\"%g\" text-anchor=\"middle\">%g s</text>\n", x, bottom+16, pow( 10.0, t ) );
+  }
+
+  for (float p=p0; p<=p1; p+=5) {
+    float y = PY( p );
+    fprintf( out, "<line x1=\"%g\" y1=\"%g\" x2=\"%g\" y2=\"%g\" stroke=\"#ddd\"/>\n", left, y, right, y );
+    fprintf( out, "<text x=\"%g\" y=\"%g\" text-anchor=\"end\" fill=\"#1f5fbf\">%g</text>\n", left-6, y+4, p );
+  }
+
+  for (int i=0; i<=5; i++) {
+    float s = s0 + i * (1 - s0) / 5;
+    fprintf( out, "<text x=\"%g\" y=\"%g\" fill=\"#d9701a\">%.2f</text>\n", right+6, SY( s )+4, s );
+  }
+
+  fprintf( out, "<text x=\"%g\" y=\"%g\" text-anchor=\"middle\">render time</text>\n", (left+right)/2, (float) PLOT_HEIGHT-10 );
+  fprintf( out, "<text x=\"%g\" y=\"%g\" fill=\"#1f5fbf\">PSNR (dB)</text>\n", left, top-10 );
+  fprintf( out, "<text x=\"%g\" y=\"%g\" text-anchor=\"end\" fill=\"#d9701a\">SSIM</text>\n", right, top-10 );
+
+  // Target
+
+  float y = PY( targetPSNR );
+  fprintf( out, "<line x1=\"%g\" y1=\"%g\" x2=\"%g\" y2=\"%g\" stroke=\"#c00\" stroke-dasharray=\"6,4\"/>\n", left, y, right, y );
+
+  if (targetSeconds >= 0) {
+    float x = PX( targetSeconds );
+    fprintf( out, "<line x1=\"%g\" y1=\"%g\" x2=\"%g\" y2=\"%g\" stroke=\"#c00\" stroke-dasharray=\"6,4\"/>\n", x, top, x, bottom );
+    fprintf( out, "<text x=\"%g\" y=\"%g\" fill=\"#c00\">%g dB at %.3g s</text>\n", x+4, y-6, targetPSNR, targetSeconds );
+  } else
+    fprintf( out, "<text x=\"%g\" y=\"%g\" fill=\"#c00\">%g dB not reached</text>\n", left+4, y-6, targetPSNR );
+
+  // Curves
+
+  fprintf( out, "<polyline fill=\"none\" stroke=\"#1f5fbf\" stroke-width=\"2\" points=\"" );
+  for (int i=0; i<n; i++)
+    fprintf( out, "%g,%g ", PX( seconds[i] ), PY( psnr[i] ) );
+  fprintf( out, "\"/>\n" );
+
+  fprintf( out, "<polyline fill=\"none\" stroke=\"#d9701a\" stroke-width=\"2\" stroke-dasharray=\"4,3\" points=\"" );
+  for (int i=0; i<n; i++)
+    fprintf( out, "%g,%g ", PX( seconds[i] ), SY( ssim[i] ) );
+  fprintf( out, "\"/>\n" );
+
+  for (int i=0; i<n; i++)
+    fprintf( out, "<circle cx=\"%g\" cy=\"%g\" r=\"3\" fill=\"#1f5fbf\"/>\n", PX( seconds[i] ), PY( psnr[i] ) );
+
+#undef PX
+#undef PY
+#undef SY
+
+  fprintf( out, "</svg>\n" );
+  fclose( out );
+
+  return true;
+}
+
+
+
+int measureConvergence( Scene *scene, int width, int height, const char *basename, const char *referenceFilename, float targetPSNR )
+
+{
+  // Get the reference
+
+  vec3 *reference;
+
+  if (referenceFilename != NULL) {
+
+    int refWidth, refHeight;
+
+    if (!readImage( referenceFilename, refWidth, refHeight, reference ))
+      return 1;
+
+    if (refWidth != width || refHeight != height) {
+      cerr << referenceFilename << " is " << refWidth << "x" << refHeight << ", not " << width << "x" << height
+	   << ".  Use --width and --height to match it." << endl;
+      return 1;
+    }
+
+  } else {
+
+    bool         adaptive = scene->adaptive;
+    int          samples  = scene->numPixelSamples;
+    unsigned int seed     = Sampler::seed;
+
+    scene->adaptive = false;
+    scene->numPixelSamples = CONVERGE_REFERENCE_SAMPLES;
+    Sampler::seed = seed + 1;
+
+    scene->renderHeadless( width, height );
+
+    scene->adaptive = adaptive;
+    scene->numPixelSamples = samples;
+    Sampler::seed = seed;
+
+    reference = copyImage( scene, width, height );
+
+    string refName = string( basename ) + "-reference.pfm";
+
+    if (!scene->writeImage( refName.c_str() ))
+      return 1;
+
+    printf( "reference: %dx%d samples in %.3f s, wrote %s\n",
+	    CONVERGE_REFERENCE_SAMPLES, CONVERGE_REFERENCE_SAMPLES, scene->renderSeconds(), refName.c_str() );
+  }
+
+  // Render with more samples at each step
+
+  double seconds[ CONVERGE_STEPS ];
+  float  spp[ CONVERGE_STEPS ];
+  float  psnr[ CONVERGE_STEPS ];
+  float  ssim[ CONVERGE_STEPS ];
+
+  int   samples   = scene->numPixelSamples;
+  float threshold = scene->adaptiveThreshold;
+
+  printf( "%4s %10s %9s %9s %7s\n", "step", "seconds", "spp", "PSNR dB", "SSIM" );
+
+  for (int s=0; s<CONVERGE_STEPS; s++) {
+
+    if (scene->adaptive)
+      scene->adaptiveThreshold = CONVERGE_FIRST_THRESHOLD / (float) (1 << s);
+    else
+      scene->numPixelSamples = s+1;
+
+    scene->renderHeadless( width, height );
+
+    seconds[s] = scene->renderSeconds();
+    spp[s]     = (scene->adaptive ? scene->samplesTraced / (float) (width * height) : (s+1)*(s+1));
+
+    vec3 *image = copyImage( scene, width, height );
+
+    psnr[s] = imagePSNR( image, reference, width, height );
+    ssim[s] = imageSSIM( image, reference, width, height );
+
+    delete [] image;
+
+    printf( "%4d %10.4f %9.2f %9.2f %7.4f\n", s, seconds[s], spp[s], psnr[s], ssim[s] );
+    fflush( stdout );
+  }
+
+  scene->numPixelSamples = samples;
+  scene->adaptiveThreshold = threshold;
+
+  delete [] reference;
+
+  // Time to reach the target, interpolated between steps
+
+  double targetSeconds = -1;
+
+  for (int s=0; s<CONVERGE_STEPS; s++)
+    if (psnr[s] >= targetPSNR) {
+      if (s == 0)
+	targetSeconds = seconds[0];
+      else
+	targetSeconds = seconds[s-1] + (seconds[s] - seconds[s-1]) * (targetPSNR - psnr[s-1]) / (psnr[s] - psnr[s-1]);
+      break;
+    }
+
+  // Write the steps and their plot
+
+  string csvName = string( basename ) + ".csv";
+  string svgName = string( basename ) + ".svg";
+
+  FILE *out = fopen( csvName.c_str(), "w" );
+  if (out == NULL) {
+    cerr << "Could not open " << csvName << " for writing." << endl;
+    return 1;
+  }
+
+  fprintf( out, "step,seconds,samplesPerPixel,psnr,ssim\n" );
+  for (int s=0; s<CONVERGE_STEPS; s++)
+    fprintf( out, "%d,%.6g,%.6g,%.6g,%.6g\n", s, seconds[s], spp[s], psnr[s], ssim[s] );
+
+  fclose( out );
+
+  if (!writePlot( svgName.c_str(), CONVERGE_STEPS, seconds, psnr, ssim, targetPSNR, targetSeconds ))
+    return 1;
+
+  if (targetSeconds >= 0)
+    printf( "time to %g dB: %.4f s\n", targetPSNR, targetSeconds );
+  else
+    printf( "time to %g dB: not reached (best %.2f dB)\n", targetPSNR, psnr[ CONVERGE_STEPS-1 ] );
+
+  printf( "wrote %s and %s\n", csvName.c_str(), svgName.c_str() );
+
+  return 0;
+}
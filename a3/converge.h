@@ -0,0 +1,47 @@
+/* converge.h
+ *
+ * Image quality against render time.
+ *
+ *   ./rt --converge name [--reference ref.pfm] [--target-psnr #] [--width #] [--height #] [options] world
+ *
+ * The world is rendered headless CONVERGE_STEPS times, each time with
+ * more samples: n x n samples per pixel for n = 1, 2, ..., or, with
+ * --adaptive, a threshold halved at each step from
+ * CONVERGE_FIRST_THRESHOLD.  Each image is compared with a reference
+ * by PSNR and SSIM, and its render time is recorded.  The other
+ * options (sampler, integrator, cutoff, ...) apply to every step, so
+ * that two sets of options can be compared by quality per second.
+ *
+ * The reference is a PPM or PFM image of the same size.  Without one,
+ * a reference of CONVERGE_REFERENCE_SAMPLES x CONVERGE_REFERENCE_SAMPLES
+ * samples per pixel is rendered first (with another sampler seed, so
+ * that its samples aren't those of the steps) and written to
+ * name-reference.pfm, for --reference in later runs.
+ *
+ * This writes name.csv (one line per step), and name.svg, a plot of
+ * PSNR and SSIM against log time, and reports the time to reach the
+ * target PSNR.
+ */
+
+
+#ifndef CONVERGE_H
+#define CONVERGE_H
+
+
+#include "scene.h"
+
+
+#define CONVERGE_STEPS             8
+#define CONVERGE_FIRST_THRESHOLD   0.1	// adaptive threshold of the first step
+#define CONVERGE_REFERENCE_SAMPLES 16
+#define CONVERGE_TARGET_PSNR       35	// dB
+
+
+int measureConvergence( Scene *scene, int width, int height, const char *basename, const char *referenceFilename, float targetPSNR );
+
+bool  readImage( const char *filename, int &width, int &height, vec3 *&pixels );
+float imagePSNR( vec3 *a, vec3 *b, int width, int height );
+float imageSSIM( vec3 *a, vec3 *b, int width, int height );
+
+
+#endif
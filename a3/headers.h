@@ -37,7 +37,8 @@ using namespace std;
 #include <cmath>
 
 #include "linalg.h"
+#include "sampler.h"
 
-#define randIn01() (rand() / (float) RAND_MAX)   // random number in [0,1]
+#define randIn01() (Sampler::next())   // random number in [0,1) for the current sample
 
 #endif
@@ -16,24 +16,51 @@
 #include <cstdlib>
 #include <ctype.h>
 #include <fstream>
+#include <chrono>
 #include "rtWindow.h"
 #include "scene.h"
 #include "material.h"
 #include "seq.h"
 #include "gpuProgram.h"
 #include "font.h"
+#include "threadPool.h"
+#include "wavefront.h"
+#include "bvh.h"
+#include "wavefrontobj.h"
+#include "perfCounters.h"
+#include "bench.h"
+#include "converge.h"
 
 
 
 Scene      *scene;
 RTwindow   *win;
 GPUProgram *gpuProg;
+ThreadPool *threadPool;
 
 char *filename[2] = { NULL, NULL }; // from command line
+int numThreads = 0;                 // from command line (0 = one per core)
+
+// Headless rendering (from command line)
+
+bool  headless     = false;
+int   imageWidth   = 480;
+int   imageHeight  = 320;
+char *outputFilename = "out.ppm";
+char *benchRecordFilename = NULL; // measurements for --bench
+
+// Convergence measurement (from command line)
+
+char *convergeOutput    = NULL;	// base name of the results
+char *referenceFilename = NULL;	// reference image (or NULL to render one)
+float targetPSNR        = CONVERGE_TARGET_PSNR;
 
 
 void skipComments( istream &in );
 void parseOptions( int argc, char **argv );
+void readScene();
+int  renderHeadless();
+int  renderConvergence();
 
 
 // Main program
@@ -47,6 +74,32 @@ int main( int argc, char **argv )
     exit(1);
   }
 
+  // Benchmark: this runs the program again for each world
+
+  if (strcmp( argv[1], "--bench" ) == 0)
+    return runBenchmark( argc, argv );
+
+  // Set up the scene
+
+  scene = new Scene();		// must exist before parseOptions() is called
+  parseOptions( argc, argv );
+
+  // Set up the raytracing threads
+
+  threadPool = new ThreadPool( numThreads > 0 ? numThreads : ThreadPool::defaultNumThreads() );
+
+  wfModel::numReadThreads = threadPool->size(); // also for parsing large OBJ files
+
+  perfCounters.setup( threadPool->size() );
+
+  // Without a window, just render to a file
+
+  if (convergeOutput != NULL)
+    return renderConvergence();
+
+  if (headless)
+    return renderHeadless();
+
   // Set up GLFW
 
   if (!glfwInit())
@@ -56,11 +109,6 @@ int main( int argc, char **argv )
   glfwWindowHint( GLFW_CONTEXT_VERSION_MAJOR, 3 );
   glfwWindowHint( GLFW_CONTEXT_VERSION_MINOR, 0 );
 
-  // Set up the scene
-
-  scene = new Scene();		// must exist before parseOptions() is called
-  parseOptions( argc, argv );
-
   // win = new RTwindow( 20, 50, 1200, 800, filename[0], scene ); // production
   win = new RTwindow( 20, 50, 480, 320, filename[0], scene ); // debugging
   scene->setWindow( win );
@@ -79,28 +127,16 @@ int main( int argc, char **argv )
 
   // Read the scene file
 
-  {
-    ifstream in( filename[0] );
-
-    if (!in) {
-      cerr << "Error opening " << filename[0] << ".  Check that it exists and that the permissions are set to allow you to read it." << endl;
-      exit(1);
-    }
-
-    char *basename = strdup(filename[0]);
-    char *p = strrchr( basename, '/' );
-    if (p != NULL)
-      *p = '\0';
+  readScene();
 
-    scene->read( basename, in );
-  }
+  // Start the viewpoint at the scene's eye
 
-  // Output the scene if a second filename is present on the command line
+  Eye *eye = scene->getEye();
 
-  if (filename[1] != NULL) {
-    ofstream out( filename[1] );
-    scene->write( out );
-  }
+  win->eye    = eye->position;
+  win->lookAt = eye->lookAt;
+  win->upDir  = eye->upDir;
+  win->fovy   = eye->fovy;
 
   // Main loop
 
@@ -108,7 +144,10 @@ int main( int argc, char **argv )
 
   while (!glfwWindowShouldClose( win->window )) {
 
-    glfwPollEvents();
+    // Raytracing is done by the threadPool, so there's no need to
+    // spin here.  Wake up for events or to show RT progress.
+
+    glfwWaitEventsTimeout( 0.02 );
 
     if (win->redisplay) {
       win->display();
@@ -130,6 +169,9 @@ int main( int argc, char **argv )
 
   // Clean up
 
+  scene->cancelRT();
+  delete threadPool;
+
   glfwDestroyWindow( win->window );
   glfwTerminate();
 
@@ -138,6 +180,116 @@ int main( int argc, char **argv )
 
 
 
+// Read the scene file named on the command line.  Output the scene
+// if a second filename is present on the command line.
+
+void readScene()
+
+{
+  ifstream in( filename[0] );
+
+  if (!in) {
+    cerr << "Error opening " << filename[0] << ".  Check that it exists and that the permissions are set to allow you to read it." << endl;
+    exit(1);
+  }
+
+  char *basename = strdup(filename[0]);
+  char *p = strrchr( basename, '/' );
+  if (p != NULL)
+    *p = '\0';
+  else
+    strcpy( basename, "." );
+
+  scene->worldFile = filename[0];
+  scene->read( basename, in );
+
+  if (filename[1] != NULL) {
+    ofstream out( filename[1] );
+    scene->write( out );
+  }
+}
+
+
+
+// Render without a window or OpenGL context and write the image to
+// 'outputFilename'.  This is used with --headless.
+
+int renderHeadless()
+
+{
+  // Nothing may touch OpenGL
+
+  Texture::useOpenGL = false;
+  wfModel::useOpenGL = false;
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+  readScene();
+
+  chrono::steady_clock::time_point loaded = chrono::steady_clock::now();
+
+  scene->renderHeadless( imageWidth, imageHeight );
+
+  chrono::steady_clock::time_point rendered = chrono::steady_clock::now();
+
+  if (!scene->writeImage( outputFilename ))
+    return 1;
+
+  if (scene->checkpointFile != NULL)
+    remove( scene->checkpointFile ); // the image is safe now
+
+  if (scene->perfOutput != NULL && !scene->writePerfStats( scene->perfOutput ))
+    return 1;
+
+  if (benchRecordFilename != NULL &&
+      !writeBenchRecord( benchRecordFilename, chrono::duration<double>( loaded - start ).count(), BVH::totalBuildTime,
+			 scene->renderSeconds(), perfCounters.totalRays() ))
+    return 1;
+
+  cout << filename[0] << ": " << imageWidth << "x" << imageHeight << ", ";
+
+  if (scene->adaptive)
+    cout << scene->samplesTraced / (double) (imageWidth * imageHeight) << " samples/pixel (adaptive "
+	 << scene->minSamples << "-" << scene->maxSamples << ", threshold " << scene->adaptiveThreshold << "), ";
+  else
+    cout << scene->numPixelSamples << "x" << scene->numPixelSamples << " samples, ";
+
+  cout << threadPool->size() << " threads, " << BVH::kernelName( BVH::kernel ) << " BVH kernel" << endl
+       << "  load   " << chrono::duration<double>( loaded - start ).count() << " s" << endl
+       << "  render " << chrono::duration<double>( rendered - loaded ).count() << " s" << endl
+       << "  rays   " << perfCounters.totalRays() << " (" << perfCounters.totalRays() / scene->renderSeconds() / 1e6 << " Mrays/s)" << endl
+       << "  wrote " << outputFilename << endl;
+
+  if (scene->perfOutput != NULL)
+    cout << "  wrote " << scene->perfOutput << ".ppm and " << scene->perfOutput << ".json" << endl;
+
+  delete threadPool;
+
+  return 0;
+}
+
+
+
+// Render at increasing sample counts without a window and measure
+// each image against a reference.  This is used with --converge.
+
+int renderConvergence()
+
+{
+  Texture::useOpenGL = false;
+  wfModel::useOpenGL = false;
+
+  readScene();
+
+  int status = measureConvergence( scene, imageWidth, imageHeight, convergeOutput, referenceFilename, targetPSNR );
+
+  delete threadPool;
+
+  return status;
+}
+
+
+
 // Parse the command-line options
 
 void parseOptions( int argc, char **argv )
@@ -155,6 +307,185 @@ void parseOptions( int argc, char **argv )
       else
 	filename[ next_fn++ ] = argv[0];
 
+    } else if (argv[0][1] == '-') { // --long options
+
+      if (strcmp( argv[0], "--headless" ) == 0)
+	headless = true;
+
+      else if (strcmp( argv[0], "--width" ) == 0 && argc > 1) {
+	argc--; argv++;
+	if (atoi( *argv ) < 2) // the primary rays are spaced by 1/(width-1)
+	  cerr << "Bad image width " << *argv << " (use 2 or more); using " << imageWidth << endl;
+	else
+	  imageWidth = atoi( *argv );
+      }
+
+      else if (strcmp( argv[0], "--height" ) == 0 && argc > 1) {
+	argc--; argv++;
+	if (atoi( *argv ) < 2)
+	  cerr << "Bad image height " << *argv << " (use 2 or more); using " << imageHeight << endl;
+	else
+	  imageHeight = atoi( *argv );
+      }
+
+      else if (strcmp( argv[0], "--samples" ) == 0 && argc > 1) {
+	argc--; argv++;
+	scene->numPixelSamples = atoi( *argv );
+	if (scene->numPixelSamples < 1)
+	  scene->numPixelSamples = 1;
+      }
+
+      else if (strcmp( argv[0], "--jitter" ) == 0)
+	scene->jitter = true;
+
+      else if (strcmp( argv[0], "--no-packets" ) == 0)
+	scene->usePackets = false;
+
+      else if (strcmp( argv[0], "--adaptive" ) == 0)
+	scene->adaptive = true;
+
+      else if (strcmp( argv[0], "--min-samples" ) == 0 && argc > 1) {
+	argc--; argv++;
+	scene->minSamples = atoi( *argv );
+	if (scene->minSamples < 2)
+	  scene->minSamples = 2; // needed for a variance
+      }
+
+      else if (strcmp( argv[0], "--max-samples" ) == 0 && argc > 1) {
+	argc--; argv++;
+	scene->maxSamples = atoi( *argv );
+      }
+
+      else if (strcmp( argv[0], "--threshold" ) == 0 && argc > 1) {
+	argc--; argv++;
+	scene->adaptiveThreshold = atof( *argv );
+      }
+
+      else if (strcmp( argv[0], "--cutoff" ) == 0 && argc > 1) {
+	argc--; argv++;
+	scene->rayCutoff = atof( *argv );
+      }
+
+      else if (strcmp( argv[0], "--integrator" ) == 0 && argc > 1) {
+	argc--; argv++;
+	if (strcmp( *argv, "whitted" ) == 0)
+	  scene->integrator = WHITTED_INTEGRATOR;
+	else if (strcmp( *argv, "path" ) == 0)
+	  scene->integrator = PATH_INTEGRATOR;
+	else
+	  cerr << "Unrecognized integrator " << *argv << " (use 'whitted' or 'path')" << endl;
+      }
+
+      else if (strcmp( argv[0], "--sampler" ) == 0 && argc > 1) {
+	argc--; argv++;
+	int t;
+	for (t=PCG_SAMPLER; t<=BLUE_NOISE_SAMPLER; t++)
+	  if (strcmp( *argv, Sampler::typeName( (SamplerType) t ) ) == 0)
+	    break;
+	if (t > BLUE_NOISE_SAMPLER)
+	  cerr << "Unrecognized sampler " << *argv << " (use 'pcg', 'halton', 'sobol' or 'bluenoise')" << endl;
+	else
+	  Sampler::setType( (SamplerType) t );
+      }
+
+      else if (strcmp( argv[0], "--seed" ) == 0 && argc > 1) {
+	argc--; argv++;
+	Sampler::seed = strtoul( *argv, NULL, 10 );
+      }
+
+      else if (strcmp( argv[0], "--shadow-rays" ) == 0 && argc > 1) {
+	argc--; argv++;
+	scene->emitterShadowRays = atoi( *argv );
+      }
+
+      else if (strcmp( argv[0], "--bvh" ) == 0 && argc > 1) {
+	argc--; argv++;
+	if (strcmp( *argv, "sah" ) == 0)
+	  BVH::builder = SAH_BUILDER;
+	else if (strcmp( *argv, "kmeans" ) == 0)
+	  BVH::builder = KMEANS_BUILDER;
+	else
+	  cerr << "Unrecognized BVH builder " << *argv << " (use 'sah' or 'kmeans')" << endl;
+      }
+
+      else if (strcmp( argv[0], "--sah-bins" ) == 0 && argc > 1) {
+	argc--; argv++;
+	BVH::sahNumBins = atoi( *argv );
+      }
+
+      else if (strcmp( argv[0], "--sah-leaf" ) == 0 && argc > 1) {
+	argc--; argv++;
+	BVH::sahLeafSize = atoi( *argv );
+	if (BVH::sahLeafSize < 1)
+	  BVH::sahLeafSize = 1;
+      }
+
+      else if (strcmp( argv[0], "--sah-cost" ) == 0 && argc > 1) {
+	argc--; argv++;
+	BVH::sahCostRatio = atof( *argv );
+      }
+
+      else if (strcmp( argv[0], "--bvh-seed" ) == 0 && argc > 1) {
+	argc--; argv++;
+	BVH::buildSeed = strtoul( *argv, NULL, 10 );
+      }
+
+      else if (strcmp( argv[0], "--no-mesh-cache" ) == 0)
+	WavefrontObj::useCache = false;
+
+      else if (strcmp( argv[0], "--perf" ) == 0 && argc > 1) {
+	argc--; argv++;
+	scene->perfOutput = *argv;
+      }
+
+      else if (strcmp( argv[0], "--bench-record" ) == 0 && argc > 1) {
+	argc--; argv++;
+	benchRecordFilename = *argv;
+      }
+
+      else if (strcmp( argv[0], "--checkpoint" ) == 0 && argc > 1) {
+	argc--; argv++;
+	scene->checkpointFile = *argv;
+      }
+
+      else if (strcmp( argv[0], "--checkpoint-interval" ) == 0 && argc > 1) {
+	argc--; argv++;
+	scene->checkpointInterval = atof( *argv );
+      }
+
+      else if (strcmp( argv[0], "--resume" ) == 0)
+	scene->resume = true;
+
+      else if (strcmp( argv[0], "--converge" ) == 0 && argc > 1) {
+	argc--; argv++;
+	convergeOutput = *argv;
+      }
+
+      else if (strcmp( argv[0], "--reference" ) == 0 && argc > 1) {
+	argc--; argv++;
+	referenceFilename = *argv;
+      }
+
+      else if (strcmp( argv[0], "--target-psnr" ) == 0 && argc > 1) {
+	argc--; argv++;
+	targetPSNR = atof( *argv );
+      }
+
+      else if (strcmp( argv[0], "--bvh-kernel" ) == 0 && argc > 1) {
+	argc--; argv++;
+	int k;
+	for (k=SCALAR_KERNEL; k<=AVX_KERNEL; k++)
+	  if (strcmp( *argv, BVH::kernelName( (BVHKernel) k ) ) == 0)
+	    break;
+	if (k > AVX_KERNEL)
+	  cerr << "Unrecognized BVH kernel " << *argv << " (use 'scalar', 'wide', 'sse' or 'avx')" << endl;
+	else if (!BVH::setKernel( (BVHKernel) k ))
+	  cerr << "This CPU can't run the " << *argv << " BVH kernel; using " << BVH::kernelName( BVH::kernel ) << endl;
+      }
+
+      else
+	cerr << "Unrecognized option " << argv[0] << endl;
+
     } else switch( argv[0][1] ) {
 
     case 'd':			// max depth for ray tracing
@@ -175,10 +506,52 @@ void parseOptions( int argc, char **argv )
       Texture::useMipMaps = !Texture::useMipMaps;
       break;
 
+    case 'j':			// number of raytracing threads
+      argc--; argv++;
+      numThreads = atoi( *argv );
+      break;
+
+    case 'o':			// output image for --headless
+      argc--; argv++;
+      outputFilename = *argv;
+      break;
+
     default:
       cerr << "Unrecognized option -" << argv[0][1] << ".  Options are:" << endl;
       cerr << "  -d #   set max depth\n" << endl;
       cerr << "  -t     toggle texture transparency\n" << endl;
+      cerr << "  -j #   set number of raytracing threads\n" << endl;
+      cerr << "  -o file          output image (.ppm or .pfm) for --headless\n" << endl;
+      cerr << "  --headless       render to a file without a window\n" << endl;
+      cerr << "  --width #        image width for --headless\n" << endl;
+      cerr << "  --height #       image height for --headless\n" << endl;
+      cerr << "  --samples #      use # x # samples per pixel\n" << endl;
+      cerr << "  --jitter         jitter the pixel samples\n" << endl;
+      cerr << "  --adaptive       sample each pixel until its error is below a threshold\n" << endl;
+      cerr << "  --min-samples #  adaptive: samples per pixel in each pass (default 8)\n" << endl;
+      cerr << "  --max-samples #  adaptive: max samples per pixel (default 64)\n" << endl;
+      cerr << "  --threshold #    adaptive: target std error of a pixel's luminance (default 0.01)\n" << endl;
+      cerr << "  --no-packets     trace primary rays one at a time\n" << endl;
+      cerr << "  --cutoff #       prune secondary rays below this weight by Russian roulette (default 0.01, 0 = off)\n" << endl;
+      cerr << "  --integrator i   whitted (ray tree) or path (one path per sample) (default whitted)\n" << endl;
+      cerr << "  --sampler s      random numbers: pcg, halton, sobol or bluenoise (default pcg)\n" << endl;
+      cerr << "  --seed #         sampler seed (default 0)\n" << endl;
+      cerr << "  --shadow-rays #  shadow rays to emitting triangles per shading point (default 50)\n" << endl;
+      cerr << "  --bvh sah|kmeans BVH builder (default kmeans)\n" << endl;
+      cerr << "  --sah-bins #     centroid bins per axis for the SAH builder\n" << endl;
+      cerr << "  --sah-leaf #     max triangles in an SAH leaf\n" << endl;
+      cerr << "  --sah-cost #     SAH traversal/intersection cost ratio\n" << endl;
+      cerr << "  --bvh-seed #     seed of the k-means builder (default 0)\n" << endl;
+      cerr << "  --bvh-kernel k   BVH traversal: scalar, wide, sse or avx (default: best for this CPU)\n" << endl;
+      cerr << "  --no-mesh-cache  always read OBJ files and build their BVHs; don't read or write caches\n" << endl;
+      cerr << "  --perf name      after each RT image, write a heatmap of time per pixel to name.ppm and counts of rays and BVH tests to name.json\n" << endl;
+      cerr << "  --checkpoint file  headless: save the finished tiles to file every 60 seconds (deleted when the image is written)\n" << endl;
+      cerr << "  --checkpoint-interval #  seconds between checkpoints\n" << endl;
+      cerr << "  --resume         headless: start from the tiles in the --checkpoint file\n" << endl;
+      cerr << "  --bench world ... (as the first option) render each world with fixed settings and report times; see bench.h\n" << endl;
+      cerr << "  --converge name  render headless with more samples at each step and write PSNR and SSIM against time to name.csv and name.svg; see converge.h\n" << endl;
+      cerr << "  --reference file PPM or PFM reference image for --converge (default: render one)\n" << endl;
+      cerr << "  --target-psnr #  PSNR for --converge to report the time to reach (default 35)\n" << endl;
       break;
     }
   }
@@ -187,6 +560,14 @@ void parseOptions( int argc, char **argv )
     cerr << "No input filename provided on command line" << endl;
     abort();
   }
+
+  // Adaptive sampling needs at least the first batch in each pixel
+
+  if (scene->maxSamples < scene->minSamples) {
+    cerr << "--max-samples " << scene->maxSamples << " is below --min-samples " << scene->minSamples
+	 << "; using " << scene->minSamples << endl;
+    scene->maxSamples = scene->minSamples;
+  }
 }
 
 
@@ -10,6 +10,7 @@
 #include "scene.h"
 #include "rtWindow.h"
 #include "gpuProgram.h"
+#include "threadPool.h"
 
 
 void skipComments( istream &in );
@@ -17,5 +18,6 @@ extern int lineNum;
 extern Scene *scene;
 extern RTwindow *win;
 extern GPUProgram *gpuProg;
+extern ThreadPool *threadPool;
 
 #endif
@@ -0,0 +1,116 @@
+/* mappedFile.h
+ *
+ * A whole file in memory, read-only.  It is mapped where possible
+ * (so pages are read as they are touched and aren't copied), and
+ * otherwise read into a buffer.  The data is not NUL-terminated.
+ */
+
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+
+#ifndef _WIN32
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+
+class MappedFile {
+
+ public:
+
+  char  *data;
+  size_t size;
+  bool   mapped;
+
+  MappedFile() {
+    data = NULL;
+    size = 0;
+    mapped = false;
+  }
+
+  ~MappedFile() {
+    if (data == NULL)
+      return;
+#ifndef _WIN32
+    if (mapped) {
+      munmap( data, size );
+      return;
+    }
+#endif
+    delete [] data;
+  }
+
+  bool open( const char *filename ) {
+
+#ifndef _WIN32
+
+    int fd = ::open( filename, O_RDONLY );
+    if (fd < 0)
+      return false;
+
+    struct stat st;
+    if (fstat( fd, &st ) == 0 && st.st_size > 0) {
+      void *p = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+      if (p != MAP_FAILED) {
+	data = (char *) p;
+	size = st.st_size;
+	mapped = true;
+#ifdef MADV_SEQUENTIAL
+	madvise( p, size, MADV_SEQUENTIAL );
+#endif
+      }
+    }
+
+    close( fd );
+
+    if (mapped)
+      return true;
+#endif
+
+    FILE *f = fopen( filename, "rb" );
+    if (f == NULL)
+      return false;
+
+    fseek( f, 0, SEEK_END );
+    size = ftell( f );
+    fseek( f, 0, SEEK_SET );
+
+    data = new char[ size > 0 ? size : 1 ];
+    bool ok = (fread( data, 1, size, f ) == size);
+
+    fclose( f );
+
+    return ok;
+  }
+
+  // 64-bit FNV-1a over the file, eight bytes at a time
+
+  unsigned long long hash() {
+
+    unsigned long long h = 0xcbf29ce484222325ULL;
+
+    size_t i = 0;
+
+    for (; i+8 <= size; i += 8) {
+      unsigned long long word;
+      memcpy( &word, data+i, 8 );
+      h = (h ^ word) * 0x100000001b3ULL;
+    }
+
+    for (; i<size; i++)
+      h = (h ^ (unsigned char) data[i]) * 0x100000001b3ULL;
+
+    return h ^ size;
+  }
+};
+
+
+#endif
@@ -8,6 +8,7 @@
 #include "linalg.h"
 #include "material.h"
 #include "gpuProgram.h"
+#include "bbox.h"
 
 
 class Object {
@@ -21,6 +22,28 @@ class Object {
   virtual bool rayInt( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam,
 		       vec3 &intPoint, vec3 &intNorm, vec3 &intTexCoords, float &intParam, Material * &mat, int &intPartIndex ) = 0;
 
+  // Does this object block the ray within [0,maxParam]?  This stops
+  // at the first hit and computes nothing about it, so it is cheaper
+  // than rayInt() for shadow rays.  The part hit is returned in
+  // 'occluderPart' (-1 for objects without parts).
+
+  virtual bool occluded( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam, int &occluderPart ) {
+    vec3 P, N, T;
+    float t;
+    Material *m;
+    occluderPart = -1;
+    return rayInt( rayStart, rayDir, objPartIndex, maxParam, P, N, T, t, m, occluderPart );
+  }
+
+  // Does part 'partIndex' (as returned by occluded()) block the ray?
+
+  virtual bool partOccludes( int partIndex, vec3 rayStart, vec3 rayDir, float maxParam ) {
+    int part;
+    return occluded( rayStart, rayDir, -1, maxParam, part );
+  }
+
+  virtual BBox bbox() = 0;	// world-space bounds (empty if nothing can be hit)
+
   virtual vec3 textureColour( vec3 &p, int objPartIndex, float &alpha, vec3 &texCoords ) {
     alpha = 1;
     return vec3(1,1,1);
@@ -0,0 +1,512 @@
+/* objectBVH.cpp
+ */
+
+
+#include "headers.h"
+#include "objectBVH.h"
+#include "wavefrontobj.h"
+#include "packet.h"
+#include "perfCounters.h"
+
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+
+#define OBJECT_LEAF_SIZE      2	// max objects in a leaf
+#define OBJECT_NUM_BINS      16	// centroid bins per axis for the SAH
+#define OBJECT_STACK_SIZE    64	// traversal stack entries on the C++ stack
+
+
+
+// Does a ray enter a box within [0,maxParam]?  Single rays and each
+// ray of a packet use this same test, so that they agree at the
+// box's boundary.
+
+static inline bool rayHitsBox( BBox &box, vec3 &rayStart, vec3 &invDir, float maxParam )
+
+{
+  float tmin = 0, tmax = maxParam;
+
+  for (int i=0; i<3; i++) {
+    float t0 = (box.min[i] - rayStart[i]) * invDir[i];
+    float t1 = (box.max[i] - rayStart[i]) * invDir[i];
+    if (invDir[i] < 0.0f) {
+      float temp = t1; t1 = t0; t0 = temp;
+    }
+    tmin = MAX( t0, tmin );
+    tmax = MIN( t1, tmax );
+  }
+
+  return (tmin <= tmax);
+}
+
+
+
+ObjectBVH::~ObjectBVH()
+
+{
+  if (nodes != NULL)
+    delete [] nodes;
+}
+
+
+
+// Build the tree over all objects with a finite bounding box
+
+void ObjectBVH::build( seq<Object*> &objects )
+
+{
+  if (nodes != NULL)
+    delete [] nodes;
+
+  nodes = NULL;
+  numNodes = 0;
+  stackSize = 0;
+  entries.clear();
+  entryOf.clear();
+
+  for (int i=0; i<objects.size(); i++) {
+
+    ObjectBVH_entry e;
+
+    e.obj      = objects[i];
+    e.objIndex = i;
+    e.bbox     = objects[i]->bbox();
+
+    if (e.bbox.min.x > e.bbox.max.x)
+      continue;			// empty object
+
+    // Only Wavefront objects can be hit by a ray leaving them.
+
+    WavefrontObj *wfo = dynamic_cast<WavefrontObj*>( objects[i] );
+
+    e.bvh          = (wfo != NULL ? &wfo->bvh : NULL);
+    e.canHitItself = (wfo != NULL);
+
+    entries.add( e );
+  }
+
+  if (entries.size() == 0)
+    return;
+
+  // A binary tree with n leaves has 2n-1 nodes
+
+  nodes = new BVH_flatNode[ 2*entries.size()-1 ];
+  numNodes = 1;
+
+  buildNode( 0, 0, entries.size(), 0 );
+
+  for (int i=0; i<objects.size(); i++)
+    entryOf.add( -1 );
+
+  for (int i=0; i<entries.size(); i++)
+    entryOf[ entries[i].objIndex ] = i;
+}
+
+
+
+// Build the node in 'slot' around entries [start,end), splitting
+// with a binned SAH as in BVH::buildSubtreeSAH().  The entries are
+// reordered so that those of each leaf are contiguous.
+
+void ObjectBVH::buildNode( int slot, int start, int end, int depth )
+
+{
+  int n = end - start;
+
+  if (depth+1 > stackSize)
+    stackSize = depth+1;
+
+  BBox nodeBox, centroidBox;
+  nodeBox.makeEmpty();
+  centroidBox.makeEmpty();
+
+  for (int i=start; i<end; i++) {
+    nodeBox.include( entries[i].bbox );
+    centroidBox.include( entries[i].bbox.centre() );
+  }
+
+  nodes[slot].bbox = nodeBox;
+
+  if (n <= OBJECT_LEAF_SIZE) {
+    nodes[slot].isLeaf = 1;
+    nodes[slot].count  = n;
+    nodes[slot].offset = start;
+    return;
+  }
+
+  // Find the best split plane
+
+  float bestCost  = MAXFLOAT;
+  int   bestAxis  = -1;
+  int   bestSplit = 0;
+
+  for (int axis=0; axis<3; axis++) {
+
+    float cmin = centroidBox.min[axis];
+    float extent = centroidBox.max[axis] - cmin;
+
+    if (extent <= 0)
+      continue;
+
+    BBox binBox[OBJECT_NUM_BINS];
+    int  binCount[OBJECT_NUM_BINS];
+
+    for (int b=0; b<OBJECT_NUM_BINS; b++) {
+      binBox[b].makeEmpty();
+      binCount[b] = 0;
+    }
+
+    for (int i=start; i<end; i++) {
+      int b = (int) ((entries[i].bbox.centre()[axis] - cmin) * (OBJECT_NUM_BINS / extent));
+      b = MIN( b, OBJECT_NUM_BINS-1 );
+      binBox[b].include( entries[i].bbox );
+      binCount[b]++;
+    }
+
+    for (int split=1; split<OBJECT_NUM_BINS; split++) {
+
+      BBox left, right;
+      left.makeEmpty();
+      right.makeEmpty();
+      int numLeft = 0, numRight = 0;
+
+      for (int b=0; b<split; b++) {
+	left.include( binBox[b] );
+	numLeft += binCount[b];
+      }
+
+      for (int b=split; b<OBJECT_NUM_BINS; b++) {
+	right.include( binBox[b] );
+	numRight += binCount[b];
+      }
+
+      if (numLeft == 0 || numRight == 0)
+	continue;
+
+      float cost = left.area() * numLeft + right.area() * numRight;
+
+      if (cost < bestCost) {
+	bestCost  = cost;
+	bestAxis  = axis;
+	bestSplit = split;
+      }
+    }
+  }
+
+  // Partition the entries in place.  If all centroids coincide, split
+  // the range in half.
+
+  int mid;
+
+  if (bestAxis < 0)
+    mid = start + n/2;
+  else {
+    float cmin = centroidBox.min[bestAxis];
+    float extent = centroidBox.max[bestAxis] - cmin;
+    mid = start;
+    for (int i=start; i<end; i++) {
+      int b = (int) ((entries[i].bbox.centre()[bestAxis] - cmin) * (OBJECT_NUM_BINS / extent));
+      b = MIN( b, OBJECT_NUM_BINS-1 );
+      if (b < bestSplit) {
+	ObjectBVH_entry temp = entries[i];
+	entries[i] = entries[mid];
+	entries[mid] = temp;
+	mid++;
+      }
+    }
+  }
+
+  // Build the two children in adjacent slots
+
+  int firstChild = numNodes;
+  numNodes += 2;
+
+  nodes[slot].isLeaf = 0;
+  nodes[slot].count  = 2;
+  nodes[slot].offset = firstChild;
+
+  buildNode( firstChild,   start, mid, depth+1 );
+  buildNode( firstChild+1, mid,   end, depth+1 );
+}
+
+
+
+// Find the closest intersection with any object.
+//
+// Objects that cannot be hit by a ray leaving them (spheres and
+// triangles) are skipped if they are the originating object
+// 'thisObjIndex'.
+
+bool ObjectBVH::rayInt( vec3 rayStart, vec3 rayDir, int thisObjIndex, int thisObjPartIndex, float maxParam,
+			vec3 &P, vec3 &N, vec3 &T, float &param, int &objIndex, int &objPartIndex, Material *&mat )
+
+{
+  if (nodes == NULL)
+    return false;
+
+  bool hit = false;
+
+  vec3 invDir( 1.0f / rayDir.x, 1.0f / rayDir.y, 1.0f / rayDir.z ); // IEEE Inf for zero components
+
+  int  localStack[ OBJECT_STACK_SIZE ];
+  int *stack = (stackSize <= OBJECT_STACK_SIZE ? localStack : new int[ stackSize ]);
+  int  top = 0;
+
+  stack[top++] = 0;
+
+  int nodesVisited = 0, objectTests = 0;
+
+  while (top > 0) {
+
+    BVH_flatNode &n = nodes[ stack[--top] ];
+
+    nodesVisited++;
+
+    if (!rayHitsBox( n.bbox, rayStart, invDir, maxParam ))
+      continue;
+
+    if (!n.isLeaf) {
+      stack[top++] = n.offset+1;
+      stack[top++] = n.offset;
+      continue;
+    }
+
+    for (int i=n.offset; i<n.offset+(int)n.count; i++) {
+
+      ObjectBVH_entry &e = entries[i];
+
+      if (e.objIndex == thisObjIndex && !e.canHitItself)
+	continue;
+
+      int partIndex = (e.objIndex != thisObjIndex ? -1 : thisObjPartIndex);
+
+      vec3 point, normal, texcoords;
+      float t;
+      Material *intMat;
+      int intPartIndex;
+      bool found;
+
+      if (e.bvh != NULL)
+	found = e.bvh->rayInt( rayStart, rayDir, partIndex, maxParam, point, normal, texcoords, t, intMat, intPartIndex );
+      else {
+	found = e.obj->rayInt( rayStart, rayDir, partIndex, maxParam, point, normal, texcoords, t, intMat, intPartIndex );
+	objectTests++;
+      }
+
+      if (found) {
+
+        P = point;
+        N = normal;
+        T = texcoords;
+        param = t;
+        objIndex = e.objIndex;
+        objPartIndex = intPartIndex;
+        mat = intMat;
+
+        maxParam = t; // In future, don't intersect any farther than this
+        hit = true;
+      }
+    }
+  }
+
+  if (stack != localStack)
+    delete [] stack;
+
+  perfCounters.addTraversal( nodesVisited, nodesVisited, 0 );
+  perfCounters.add( PERF_OBJECT_TESTS, objectTests );
+
+  return hit;
+}
+
+
+
+// Find the closest intersection of each ray in a coherent packet of
+// primary rays (which have no originating object).  Nodes are culled
+// for the whole packet; objects are intersected ray by ray, except
+// that Wavefront objects traverse their own BVH with the packet.
+//
+// The packet's box test is conservative, so at a leaf each ray is
+// tested against the leaf's box as in rayInt() before its objects
+// are.  Otherwise a ray that grazes the box (e.g. at the edge of a
+// flat floor) could hit an object here and miss it in rayInt().  A
+// Wavefront object's BVH tests each ray against its own boxes, which
+// lie inside the leaf's.
+
+void ObjectBVH::packetInt( RayPacket &packet )
+
+{
+  if (nodes == NULL)
+    return;
+
+  int  localStack[ OBJECT_STACK_SIZE ];
+  int *stack = (stackSize <= OBJECT_STACK_SIZE ? localStack : new int[ stackSize ]);
+  int  top = 0;
+
+  stack[top++] = 0;
+
+  float packetT = packet.maxT();
+
+  int nodesVisited = 0, objectTests = 0;
+
+  while (top > 0) {
+
+    BVH_flatNode &n = nodes[ stack[--top] ];
+
+    nodesVisited++;
+
+    if (!packet.mayHitBox( n.bbox, packetT ))
+      continue;
+
+    if (!n.isLeaf) {
+      stack[top++] = n.offset+1;
+      stack[top++] = n.offset;
+      continue;
+    }
+
+    bool rayIn[ MAX_PACKET_RAYS ];
+
+    for (int r=0; r<packet.numRays; r++)
+      rayIn[r] = rayHitsBox( n.bbox, packet.org, packet.invDir[r], packet.t[r] );
+
+    for (int i=n.offset; i<n.offset+(int)n.count; i++) {
+
+      ObjectBVH_entry &e = entries[i];
+
+      if (e.bvh != NULL) {
+	if (BVH::kernel == SCALAR_KERNEL)
+	  e.bvh->packetInt( packet, e.objIndex );
+	else
+	  e.bvh->packetIntWide( packet, e.objIndex );
+	continue;
+      }
+
+      for (int r=0; r<packet.numRays; r++) {
+
+	if (!rayIn[r])
+	  continue;
+
+	objectTests++;
+
+	vec3 point, normal, texcoords;
+	float t;
+	Material *intMat;
+	int intPartIndex;
+
+	if (e.obj->rayInt( packet.org, packet.dir[r], -1, packet.t[r], point, normal, texcoords, t, intMat, intPartIndex )) {
+	  packet.hit[r]          = true;
+	  packet.t[r]            = t;
+	  packet.P[r]            = point;
+	  packet.N[r]            = normal;
+	  packet.T[r]            = texcoords;
+	  packet.objIndex[r]     = e.objIndex;
+	  packet.objPartIndex[r] = intPartIndex;
+	  packet.mat[r]          = intMat;
+	}
+      }
+    }
+
+    packetT = packet.maxT();
+  }
+
+  if (stack != localStack)
+    delete [] stack;
+
+  perfCounters.addTraversal( nodesVisited, nodesVisited, 0 );
+  perfCounters.add( PERF_OBJECT_TESTS, objectTests );
+}
+
+
+
+// Is the ray blocked by any object within [0,maxParam]?  Used for
+// shadow rays, so no intersection point or normal is computed.
+//
+// 'lastOccluder' is the object that blocked the previous query of the
+// caller's (e.g. toward the same light).  It is tested before the
+// tree is traversed, and is updated when something else blocks the
+// ray.
+
+bool ObjectBVH::occluded( vec3 rayStart, vec3 rayDir, int thisObjIndex, int thisObjPartIndex, float maxParam,
+			  ObjectBVH_occluder &lastOccluder )
+
+{
+  if (nodes == NULL)
+    return false;
+
+  // Try the last occluder first
+
+  if (lastOccluder.objIndex >= 0 && lastOccluder.objIndex < entryOf.size() && entryOf[ lastOccluder.objIndex ] >= 0) {
+
+    ObjectBVH_entry &e = entries[ entryOf[ lastOccluder.objIndex ] ];
+
+    bool self = (e.objIndex == thisObjIndex);
+
+    if (!self || (e.canHitItself && lastOccluder.partIndex != thisObjPartIndex)) {
+      perfCounters.add( e.bvh != NULL ? PERF_TRIANGLE_TESTS : PERF_OBJECT_TESTS, 1 );
+      if (e.obj->partOccludes( lastOccluder.partIndex, rayStart, rayDir, maxParam ))
+	return true;
+    }
+  }
+
+  // Traverse the tree, stopping at the first object that blocks the ray
+
+  bool hit = false;
+
+  vec3 invDir( 1.0f / rayDir.x, 1.0f / rayDir.y, 1.0f / rayDir.z ); // IEEE Inf for zero components
+
+  int  localStack[ OBJECT_STACK_SIZE ];
+  int *stack = (stackSize <= OBJECT_STACK_SIZE ? localStack : new int[ stackSize ]);
+  int  top = 0;
+
+  stack[top++] = 0;
+
+  int nodesVisited = 0, objectTests = 0;
+
+  while (top > 0 && !hit) {
+
+    BVH_flatNode &n = nodes[ stack[--top] ];
+
+    nodesVisited++;
+
+    if (!rayHitsBox( n.bbox, rayStart, invDir, maxParam ))
+      continue;
+
+    if (!n.isLeaf) {
+      stack[top++] = n.offset+1;
+      stack[top++] = n.offset;
+      continue;
+    }
+
+    for (int i=n.offset; i<n.offset+(int)n.count && !hit; i++) {
+
+      ObjectBVH_entry &e = entries[i];
+
+      if (e.objIndex == thisObjIndex && !e.canHitItself)
+	continue;
+
+      int partIndex = (e.objIndex != thisObjIndex ? -1 : thisObjPartIndex);
+      int occluderPart;
+
+      if (e.bvh != NULL)
+	hit = e.bvh->occluded( rayStart, rayDir, partIndex, maxParam, occluderPart );
+      else {
+	hit = e.obj->occluded( rayStart, rayDir, partIndex, maxParam, occluderPart );
+	objectTests++;
+      }
+
+      if (hit) {
+	lastOccluder.objIndex  = e.objIndex;
+	lastOccluder.partIndex = occluderPart;
+      }
+    }
+  }
+
+  if (stack != localStack)
+    delete [] stack;
+
+  perfCounters.addTraversal( nodesVisited, nodesVisited, 0 );
+  perfCounters.add( PERF_OBJECT_TESTS, objectTests );
+
+  return hit;
+}
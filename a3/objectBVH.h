@@ -0,0 +1,89 @@
+/* objectBVH.h
+ *
+ * Top-level bounding volume hierarchy over the objects of a scene.
+ *
+ * Each leaf holds a few objects.  A Wavefront object is entered with
+ * its own (bottom-level) BVH, which is called directly, so the type of
+ * each object is resolved when the tree is built rather than for each
+ * ray.
+ */
+
+
+#ifndef OBJECTBVH_H
+#define OBJECTBVH_H
+
+
+#include "seq.h"
+#include "object.h"
+#include "bbox.h"
+
+
+class BVH;
+class BVH_flatNode;
+class RayPacket;
+
+
+class ObjectBVH_entry {
+
+ public:
+
+  Object *obj;
+  BVH    *bvh;			// bottom-level BVH of a Wavefront object, or NULL
+  int     objIndex;		// index in Scene::objects
+  bool    canHitItself;		// false for convex objects
+  BBox    bbox;
+};
+
+
+// The object (and part) that last blocked a shadow ray.  Shadow rays
+// toward the same light from nearby points are usually blocked by the
+// same thing, so it is tested first.
+
+class ObjectBVH_occluder {
+
+ public:
+
+  int objIndex;			// -1 if none
+  int partIndex;
+
+  ObjectBVH_occluder() {
+    objIndex = -1;
+    partIndex = -1;
+  }
+};
+
+
+class ObjectBVH {
+
+  seq<ObjectBVH_entry> entries;	// in leaf order
+  seq<int> entryOf;		// index in 'entries' of each object, or -1
+
+  BVH_flatNode *nodes;		// nodes[0] is the root
+  int numNodes;
+  int stackSize;		// traversal stack entries needed
+
+  void buildNode( int slot, int start, int end, int depth );
+
+ public:
+
+  ObjectBVH() {
+    nodes = NULL;
+    numNodes = 0;
+    stackSize = 0;
+  }
+
+  ~ObjectBVH();
+
+  void build( seq<Object*> &objects );
+
+  bool rayInt( vec3 rayStart, vec3 rayDir, int thisObjIndex, int thisObjPartIndex, float maxParam,
+	       vec3 &P, vec3 &N, vec3 &T, float &param, int &objIndex, int &objPartIndex, Material *&mat );
+
+  void packetInt( RayPacket &packet );
+
+  bool occluded( vec3 rayStart, vec3 rayDir, int thisObjIndex, int thisObjPartIndex, float maxParam,
+		 ObjectBVH_occluder &lastOccluder );
+};
+
+
+#endif
@@ -0,0 +1,136 @@
+/* packet.h
+ *
+ * A packet of rays with a common origin, such as the primary rays
+ * through a block of neighbouring pixels.
+ *
+ * The packet is traversed through the BVHs as a unit.  A node is
+ * culled for the whole packet by testing its box against the interval
+ * of the rays' inverse directions, which is conservative: if the test
+ * fails, no ray in the packet can hit the box.  This only works if all
+ * rays have the same direction signs; setup() reports whether they do.
+ */
+
+
+#ifndef PACKET_H
+#define PACKET_H
+
+
+#include "linalg.h"
+#include "bbox.h"
+#include "material.h"
+
+
+#define MAX_PACKET_RAYS 64
+
+
+class RayPacket {
+
+ public:
+
+  int  numRays;
+  vec3 org;			// common origin of all rays
+  vec3 dir[ MAX_PACKET_RAYS ];
+  vec3 invDir[ MAX_PACKET_RAYS ];
+  vec3 invMin, invMax;		// interval of invDir over the packet
+
+  // Closest intersection of each ray
+
+  bool      hit[ MAX_PACKET_RAYS ];
+  float     t[ MAX_PACKET_RAYS ];	// MAXFLOAT if no hit
+  vec3      P[ MAX_PACKET_RAYS ];
+  vec3      N[ MAX_PACKET_RAYS ];
+  vec3      T[ MAX_PACKET_RAYS ];
+  int       objIndex[ MAX_PACKET_RAYS ];
+  int       objPartIndex[ MAX_PACKET_RAYS ];
+  Material *mat[ MAX_PACKET_RAYS ];
+
+  // Pixel and sample of each ray, to resume its random numbers (see
+  // Sampler) when it is shaded
+
+  int pixelX[ MAX_PACKET_RAYS ];
+  int pixelY[ MAX_PACKET_RAYS ];
+  int sampleIndex[ MAX_PACKET_RAYS ];
+
+  RayPacket() {
+    numRays = 0;
+  }
+
+  // Compute the inverse directions and their interval, and clear the
+  // intersections.  Return false if the rays are not coherent (i.e.
+  // their directions don't all have the same signs), in which case
+  // the packet must not be traversed as a unit.
+
+  bool setup() {
+
+    bool coherent = true;
+
+    for (int i=0; i<numRays; i++) {
+
+      invDir[i] = vec3( 1.0f / dir[i].x, 1.0f / dir[i].y, 1.0f / dir[i].z );
+
+      hit[i] = false;
+      t[i]   = FLT_MAX;
+
+      for (int k=0; k<3; k++)
+	if (dir[i][k] == 0 || (dir[i][k] < 0) != (dir[0][k] < 0))
+	  coherent = false;
+
+      if (i == 0)
+	invMin = invMax = invDir[0];
+      else
+	for (int k=0; k<3; k++) {
+	  if (invDir[i][k] < invMin[k]) invMin[k] = invDir[i][k];
+	  if (invDir[i][k] > invMax[k]) invMax[k] = invDir[i][k];
+	}
+    }
+
+    return coherent;
+  }
+
+  // Farthest closest-intersection of any ray.  Nodes beyond this can
+  // be skipped.
+
+  float maxT() {
+    float m = t[0];
+    for (int i=1; i<numRays; i++)
+      if (t[i] > m)
+	m = t[i];
+    return m;
+  }
+
+  // Could any ray in the packet hit 'box' within [0,tmax]?
+
+  bool mayHitBox( BBox &box, float tmax ) {
+
+    float tNear = 0, tFar = tmax;
+
+    for (int k=0; k<3; k++) {
+
+      float d0 = box.min[k] - org[k];
+      float d1 = box.max[k] - org[k];
+
+      if (invMin[k] < 0) {	// negative directions enter through the max plane
+	float temp = d0; d0 = d1; d1 = temp;
+      }
+
+      // Earliest entry and latest exit over the interval of invDir
+
+      float entry0 = d0 * invMin[k], entry1 = d0 * invMax[k];
+      float exit0  = d1 * invMin[k], exit1  = d1 * invMax[k];
+
+      float entry = (entry0 < entry1 ? entry0 : entry1);
+      float exit  = (exit0  > exit1  ? exit0  : exit1);
+
+      if (entry > tNear) tNear = entry;
+      if (exit  < tFar)  tFar  = exit;
+
+      if (tNear > tFar)
+	return false;
+    }
+
+    return true;
+  }
+};
+
+
+#endif
@@ -0,0 +1,148 @@
+// pathtrace.cpp
+//
+// Path-tracing integrator
+//
+// Instead of branching into reflection, glossy, and refraction rays at
+// each hit as shade() does, a path follows just one of them, chosen at
+// random and weighted so that the expected colour is the same.  The
+// path is traced in a loop whose only state is the current ray and the
+// throughput (the factor by which light arriving on that ray is scaled
+// in the pixel sample), so each sample costs at most maxDepth ray casts
+// plus the shadow rays, and needs no recursion.
+//
+// Averaged over many samples, the image converges to that of the
+// Whitted integrator.
+
+
+#include "scene.h"
+#include "perfCounters.h"
+
+
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+#define INDENT(n) { for (int i=0; i<(n); i++) cout << " "; }
+
+
+extern vec3 backgroundColour;	// in scene.cpp
+
+
+// Trace a path from the first intersection of its primary ray (as
+// found by raytrace() or by a ray packet), and return the colour
+// received on the primary ray.
+
+vec3 Scene::pathShade( vec3 &rayStart, vec3 &rayDir,
+		       bool hit, vec3 &P, vec3 &N, vec3 &texcoords, int objIndex, int objPartIndex, Material *mat )
+
+{
+  vec3 Iout(0,0,0);
+  vec3 throughput(1,1,1);
+
+  // The current ray and its hit
+
+  vec3      dir = rayDir;
+  vec3      hitP = P, hitN = N, hitT = texcoords;
+  int       hitObj = objIndex, hitPart = objPartIndex;
+  Material *hitMat = mat;
+  float     t;
+
+  for (int depth=1; ; depth++) {
+
+    // No intersection: Only a primary ray sees the background
+
+    if (!hit) {
+      if (depth == 1)
+	Iout = backgroundColour;
+      break;
+    }
+
+    Object &obj = *objects[hitObj];
+
+    vec3 E = (-1 * dir).normalize();
+    vec3 R = (2 * (E * hitN)) * hitN - E;
+
+    float alpha;
+    vec3  colour = obj.textureColour( hitP, hitPart, alpha, hitT );
+
+    vec3 kd = vec3( colour.x*hitMat->kd.x, colour.y*hitMat->kd.y, colour.z*hitMat->kd.z );
+
+    if (hitMat->g < 0 || hitMat->g > 1) {
+      cerr << "Material glossiness is outside the range [0,1]" << endl;
+      exit(1);
+    }
+
+    // A transparent surface passes 1-opacity of the light from the
+    // refraction direction, unless there is total internal reflection
+
+    float opacity = alpha * hitMat->alpha;
+    vec3  refractionDir;
+
+    if (opacity < 1.0 && !findRefractionDirection( dir, hitN, refractionDir ))
+      opacity = 1;
+
+    // Emitted, ambient, and direct light at this hit
+
+    vec3 Ilocal = hitMat->Ie + vec3( hitMat->ka.x * Ia.x, hitMat->ka.y * Ia.y, hitMat->ka.z * Ia.z )
+                  + directLight( hitP, hitN, E, kd, hitMat, hitObj, hitPart );
+
+    Iout = Iout + opacity * vec3( throughput.x*Ilocal.x, throughput.y*Ilocal.y, throughput.z*Ilocal.z );
+
+    if (debug) {
+      INDENT(2*depth); cout << "        P " << hitP << endl;
+      INDENT(2*depth); cout << "        N " << hitN << endl;
+      INDENT(2*depth); cout << "throughput " << throughput << endl;
+    }
+
+    if (depth >= maxDepth)
+      break;
+
+    // Choose the next ray: refraction with probability 1-opacity,
+    // otherwise reflection.  Each choice's probability cancels its
+    // blending factor, so the throughput only changes by the
+    // reflectance.
+
+    vec3        nextDir;
+    PerfCounter kind;
+
+    if (opacity < 1.0 && randIn01() >= opacity) {
+
+      nextDir = refractionDir;
+      kind = PERF_REFRACTION_RAYS;
+
+    } else {
+
+      float g = hitMat->g;
+
+      if (g == 0)
+	break;			// no reflection
+
+      nextDir = (g == 1 ? R : glossyDirection( R, g ));
+      kind = (g == 1 ? PERF_REFLECTION_RAYS : PERF_GLOSSY_RAYS);
+
+      vec3 reflectScale = calcIout( hitN, R, E, E, kd, hitMat->ks, hitMat->n, vec3(1,1,1) );
+
+      throughput = vec3( throughput.x*reflectScale.x, throughput.y*reflectScale.y, throughput.z*reflectScale.z );
+    }
+
+    // Prune paths of low throughput by Russian roulette
+
+    float weight = MAX( throughput.x, MAX( throughput.y, throughput.z ) );
+    float scale  = traceWeight( weight );
+
+    if (scale == 0)
+      break;
+
+    throughput = scale * throughput;
+
+    // Follow the ray
+
+    vec3 start = hitP;
+    int  thisObj = hitObj, thisPart = hitPart;
+
+    perfCounters.add( kind, 1 );
+
+    hit = findFirstObjectInt( start, nextDir, thisObj, thisPart, hitP, hitN, hitT, t, hitObj, hitPart, hitMat, -1 );
+    dir = nextDir;
+  }
+
+  return Iout;
+}
@@ -0,0 +1,87 @@
+// perfCounters.cpp
+
+
+#include "perfCounters.h"
+
+
+PerfCounters perfCounters;
+
+
+void PerfCounters::setup( int numThreads )
+
+{
+  if (slots != NULL)
+    delete [] slots;
+
+  numSlots = numThreads + 1;
+  slots = new PerfSlot[ numSlots ];
+}
+
+
+void PerfCounters::clear()
+
+{
+  for (int i=0; i<numSlots; i++)
+    for (int c=0; c<NUM_PERF_COUNTERS; c++)
+      slots[i].count[c] = 0;
+}
+
+
+long long PerfCounters::total( PerfCounter c )
+
+{
+  long long sum = 0;
+
+  for (int i=0; i<numSlots; i++)
+    sum += slots[i].count[c].load( std::memory_order_relaxed );
+
+  return sum;
+}
+
+
+long long PerfCounters::totalRays()
+
+{
+  long long sum = 0;
+
+  for (int c=0; c<NUM_PERF_RAY_COUNTERS; c++)
+    sum += total( (PerfCounter) c );
+
+  return sum;
+}
+
+
+// Rays traced by the thread of slot 'slot' (0 for threads outside
+// the pool, i+1 for worker i)
+
+long long PerfCounters::threadRays( int slot )
+
+{
+  long long sum = 0;
+
+  for (int c=0; c<NUM_PERF_RAY_COUNTERS; c++)
+    sum += slots[slot].count[c].load( std::memory_order_relaxed );
+
+  return sum;
+}
+
+
+// Name of a counter in the JSON summary
+
+const char *PerfCounters::name( PerfCounter c )
+
+{
+  switch (c) {
+  case PERF_PRIMARY_RAYS:    return "primaryRays";
+  case PERF_REFLECTION_RAYS: return "reflectionRays";
+  case PERF_GLOSSY_RAYS:     return "glossyRays";
+  case PERF_REFRACTION_RAYS: return "refractionRays";
+  case PERF_SHADOW_RAYS:     return "shadowRays";
+  case PERF_EMITTER_RAYS:    return "emitterRays";
+  case PERF_NODES_VISITED:   return "nodesVisited";
+  case PERF_BOX_TESTS:       return "boxTests";
+  case PERF_TRIANGLE_TESTS:  return "triangleTests";
+  case PERF_OBJECT_TESTS:    return "objectTests";
+  default:                   return "unknown";
+  }
+}
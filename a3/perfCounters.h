@@ -0,0 +1,110 @@
+/* perfCounters.h
+ *
+ * Counts of the ray tracer's work: rays of each kind, and the BVH
+ * nodes, boxes, and triangles that they were tested against.
+ *
+ * Each threadPool worker (and the one thread outside the pool) counts
+ * into its own slot, as in Arena, so counting takes no lock.  A slot
+ * has just one writer, so add() is a plain load and store.  The counts
+ * are atomic only so that the main thread can read them while they
+ * change, for the rays/second in the status line.
+ *
+ * The traversal code adds its counts once per traversal rather than
+ * once per node, to keep the cost down.
+ */
+
+
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+
+#include <atomic>
+#include "threadPool.h"
+
+
+enum PerfCounter {
+  PERF_PRIMARY_RAYS,
+  PERF_REFLECTION_RAYS,		// single (mirror) reflections
+  PERF_GLOSSY_RAYS,
+  PERF_REFRACTION_RAYS,
+  PERF_SHADOW_RAYS,		// toward point lights
+  PERF_EMITTER_RAYS,		// shadow rays toward emitting triangles
+  PERF_NODES_VISITED,		// in the top-level and the mesh BVHs
+  PERF_BOX_TESTS,		// a packet testing a box counts as one test
+  PERF_TRIANGLE_TESTS,		// in mesh BVHs
+  PERF_OBJECT_TESTS,		// of objects without a BVH (spheres, triangles)
+  NUM_PERF_COUNTERS
+};
+
+#define NUM_PERF_RAY_COUNTERS (PERF_EMITTER_RAYS+1) // the counters before this are of rays
+
+#define PERF_SLOT_PADDING 64	// bytes between slots, so that threads don't share a cache line
+
+
+class PerfSlot {		// counts of one thread
+ public:
+  std::atomic<long long> count[ NUM_PERF_COUNTERS ];
+  char pad[ PERF_SLOT_PADDING ];
+  PerfSlot() {
+    for (int i=0; i<NUM_PERF_COUNTERS; i++)
+      count[i] = 0;
+  }
+};
+
+
+class PerfCounters {
+
+  PerfSlot *slots;		// slots[0] is for threads outside the pool
+  int       numSlots;
+
+  PerfSlot &thisSlot() {
+    int i = ThreadPool::workerIndex() + 1;
+    return slots[ i < numSlots ? i : 0 ];
+  }
+
+  static void increase( std::atomic<long long> &k, long long n ) {
+    k.store( k.load( std::memory_order_relaxed ) + n, std::memory_order_relaxed );
+  }
+
+ public:
+
+  PerfCounters() {
+    slots = NULL;
+    numSlots = 0;
+  }
+
+  ~PerfCounters() {
+    if (slots != NULL)
+      delete [] slots;
+  }
+
+  void setup( int numThreads );	// call once, with the threadPool size; nothing is counted before
+
+  void add( PerfCounter c, long long n ) {
+    if (slots != NULL)
+      increase( thisSlot().count[c], n );
+  }
+
+  void addTraversal( long long nodes, long long boxTests, long long triangleTests ) { // at the end of a BVH traversal
+    if (slots == NULL)
+      return;
+    PerfSlot &s = thisSlot();
+    increase( s.count[ PERF_NODES_VISITED ], nodes );
+    increase( s.count[ PERF_BOX_TESTS ], boxTests );
+    increase( s.count[ PERF_TRIANGLE_TESTS ], triangleTests );
+  }
+
+  void      clear();		// only while no thread is counting
+  long long total( PerfCounter c );
+  long long totalRays();
+  long long threadRays( int slot );
+  int       size() { return numSlots; }
+
+  static const char *name( PerfCounter c );
+};
+
+
+extern PerfCounters perfCounters;
+
+
+#endif
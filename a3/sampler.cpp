@@ -0,0 +1,337 @@
+// sampler.cpp
+//
+// Sampler backends.  See sampler.h.
+
+
+#include "sampler.h"
+
+#include <math.h>
+
+
+#define NUM_HALTON_DIMENSIONS 32 // Halton dimensions; later ones use pcg
+#define BLUE_NOISE_SIZE       64 // width of the (square, tiled) blue-noise texture
+#define BLUE_NOISE_SIGMA      1.5 // std dev, in pixels, of the void-and-cluster filter
+
+#define ONE_MINUS_EPSILON 0.99999994f // largest float below 1
+
+
+SamplerType  Sampler::type = PCG_SAMPLER;
+unsigned int Sampler::seed = 0;
+
+thread_local unsigned int Sampler::pixelKey = 0;
+thread_local unsigned int Sampler::sampleIndex = 0;
+thread_local unsigned int Sampler::dimension = 0;
+
+
+static float blueNoiseTile[ BLUE_NOISE_SIZE * BLUE_NOISE_SIZE ]; // values in [0,1), evenly spread
+static bool  blueNoiseBuilt = false;
+
+
+static const unsigned int primes[ NUM_HALTON_DIMENSIONS ] = {
+  2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+  59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131
+};
+
+
+
+// The PCG output permutation, used as a hash of one 32-bit word
+
+static inline unsigned int pcgHash( unsigned int v )
+
+{
+  unsigned int state = v * 747796405u + 2891336453u;
+  unsigned int word  = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+  return (word >> 22u) ^ word;
+}
+
+
+static inline unsigned int hash4( unsigned int a, unsigned int b, unsigned int c, unsigned int d )
+
+{
+  return pcgHash( a ^ pcgHash( b ^ pcgHash( c ^ pcgHash( d ) ) ) );
+}
+
+
+// The top 24 bits of 'h' as a float in [0,1)
+
+static inline float toUnit( unsigned int h )
+
+{
+  return (h >> 8) * (1.0f / 16777216.0f);
+}
+
+
+static inline float fraction( double v )
+
+{
+  float f = (float) (v - floor(v));
+  return (f < ONE_MINUS_EPSILON ? f : ONE_MINUS_EPSILON);
+}
+
+
+static inline unsigned int reverseBits( unsigned int x )
+
+{
+  x = (x << 16) | (x >> 16);
+  x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+  x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+  x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+  x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+  return x;
+}
+
+
+// Owen scrambling of the bits of a [0,1) fixed-point number, with
+// Laine and Karras's hash.  Each bit is flipped by a function of the
+// bits above it, which keeps the stratification of a Sobol sequence.
+
+static inline unsigned int owenScramble( unsigned int x, unsigned int seed )
+
+{
+  x = reverseBits( x );
+
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+
+  return reverseBits( x );
+}
+
+
+// Second dimension of the Sobol sequence (the first is reverseBits())
+
+static inline unsigned int sobol2( unsigned int i )
+
+{
+  unsigned int r = 0;
+
+  for (unsigned int v = 1u << 31; i != 0; i >>= 1, v ^= v >> 1)
+    if (i & 1)
+      r ^= v;
+
+  return r;
+}
+
+
+
+void Sampler::setType( SamplerType t )
+
+{
+  type = t;
+
+  if (type == BLUE_NOISE_SAMPLER && !blueNoiseBuilt)
+    buildBlueNoise();
+}
+
+
+const char *Sampler::typeName( SamplerType t )
+
+{
+  switch (t) {
+  case PCG_SAMPLER:        return "pcg";
+  case HALTON_SAMPLER:     return "halton";
+  case SOBOL_SAMPLER:      return "sobol";
+  case BLUE_NOISE_SAMPLER: return "bluenoise";
+  }
+  return "unknown";
+}
+
+
+
+float Sampler::pcg( unsigned int dim )
+
+{
+  return toUnit( hash4( seed, pixelKey, sampleIndex, dim ) );
+}
+
+
+
+float Sampler::halton( unsigned int dim )
+
+{
+  if (dim >= NUM_HALTON_DIMENSIONS)
+    return pcg( dim );
+
+  // Radical inverse of the sample index in base primes[dim]
+
+  unsigned int base = primes[dim];
+  double       invBase = 1.0 / base;
+  double       f = invBase;
+  double       r = 0;
+
+  for (unsigned int i = sampleIndex; i > 0; i /= base) {
+    r += (i % base) * f;
+    f *= invBase;
+  }
+
+  // Shift it by a per-pixel amount, so pixels don't share a pattern
+
+  return fraction( r + toUnit( hash4( seed, pixelKey, 0xffffffffu, dim ) ) );
+}
+
+
+
+float Sampler::sobol( unsigned int dim )
+
+{
+  // Each pair of dimensions draws from its own shuffle of the sample
+  // indices, so that pairs aren't correlated.  Shuffling with an Owen
+  // scramble of the index keeps each power-of-two prefix of samples
+  // together.
+
+  unsigned int pairSeed = hash4( seed, pixelKey, 0xfffffffeu, dim >> 1 );
+  unsigned int index    = owenScramble( sampleIndex, pairSeed );
+
+  unsigned int x = ((dim & 1) == 0 ? reverseBits( index ) : sobol2( index ));
+
+  return toUnit( owenScramble( x, hash4( seed, pixelKey, 0xfffffffdu, dim ) ) );
+}
+
+
+
+float Sampler::blueNoise( unsigned int dim )
+
+{
+  // Look up this dimension's shift of the tile
+
+  unsigned int h = hash4( seed, 0xfffffffcu, 0, dim );
+
+  unsigned int x = ((pixelKey & 0xffff) + (h & 0xffff)) % BLUE_NOISE_SIZE;
+  unsigned int y = ((pixelKey >> 16)   + (h >> 16))    % BLUE_NOISE_SIZE;
+
+  // Step through the R2 sequence, whose two dimensions go with the
+  // two dimensions of each pair
+
+  const double alpha = ((dim & 1) == 0 ? 0.7548776662466927 : 0.5698402909980532);
+
+  return fraction( blueNoiseTile[ x + y * BLUE_NOISE_SIZE ] + sampleIndex * alpha );
+}
+
+
+
+// Build the blue-noise tile by Ulichney's void-and-cluster method.
+// Every pixel gets a rank, and pixels of nearby ranks are far apart.
+// The filter is a Gaussian on the torus so that the tile repeats
+// without seams.
+
+static float vcKernel[ BLUE_NOISE_SIZE * BLUE_NOISE_SIZE ];
+static float vcEnergy[ BLUE_NOISE_SIZE * BLUE_NOISE_SIZE ];
+static bool  vcOn[ BLUE_NOISE_SIZE * BLUE_NOISE_SIZE ];
+
+
+// Add (sign = 1) or remove (sign = -1) a point at 'p'
+
+static void vcUpdate( int p, float sign )
+
+{
+  int px = p % BLUE_NOISE_SIZE, py = p / BLUE_NOISE_SIZE;
+
+  for (int qy=0; qy<BLUE_NOISE_SIZE; qy++) {
+    int dy = (qy - py + BLUE_NOISE_SIZE) % BLUE_NOISE_SIZE;
+    for (int qx=0; qx<BLUE_NOISE_SIZE; qx++) {
+      int dx = (qx - px + BLUE_NOISE_SIZE) % BLUE_NOISE_SIZE;
+      vcEnergy[ qx + qy * BLUE_NOISE_SIZE ] += sign * vcKernel[ dx + dy * BLUE_NOISE_SIZE ];
+    }
+  }
+
+  vcOn[p] = (sign > 0);
+}
+
+
+// The point with the most energy (tightest cluster), or the empty
+// pixel with the least (largest void)
+
+static int vcFind( bool cluster )
+
+{
+  int best = -1;
+
+  for (int p=0; p<BLUE_NOISE_SIZE * BLUE_NOISE_SIZE; p++)
+    if (vcOn[p] == cluster &&
+	(best < 0 || (cluster ? vcEnergy[p] > vcEnergy[best] : vcEnergy[p] < vcEnergy[best])))
+      best = p;
+
+  return best;
+}
+
+
+void Sampler::buildBlueNoise()
+
+{
+  const int n = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+
+  for (int dy=0; dy<BLUE_NOISE_SIZE; dy++)
+    for (int dx=0; dx<BLUE_NOISE_SIZE; dx++) {
+      int ex = (dx < BLUE_NOISE_SIZE/2 ? dx : BLUE_NOISE_SIZE - dx);
+      int ey = (dy < BLUE_NOISE_SIZE/2 ? dy : BLUE_NOISE_SIZE - dy);
+      vcKernel[ dx + dy * BLUE_NOISE_SIZE ] = exp( -(ex*ex + ey*ey) / (2 * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA) );
+    }
+
+  // Initial pattern: a tenth of the pixels, at random, then moved
+  // from clusters to voids until it is even
+
+  for (int p=0; p<n; p++) {
+    vcEnergy[p] = 0;
+    vcOn[p] = false;
+  }
+
+  int numInitial = 0;
+
+  for (unsigned int i=0; numInitial < n/10; i++) {
+    int p = pcgHash( i ) % n;
+    if (!vcOn[p]) {
+      vcUpdate( p, 1 );
+      numInitial++;
+    }
+  }
+
+  for (int iter=0; iter<n; iter++) {
+
+    int c = vcFind( true );
+    vcUpdate( c, -1 );
+
+    int v = vcFind( false );
+    vcUpdate( v, 1 );
+
+    if (v == c)
+      break;
+  }
+
+  bool  initialOn[ n ];
+  float initialEnergy[ n ];
+
+  for (int p=0; p<n; p++) {
+    initialOn[p] = vcOn[p];
+    initialEnergy[p] = vcEnergy[p];
+  }
+
+  int rank[ n ];
+
+  // Rank the initial points by removing the tightest cluster each time
+
+  for (int r=numInitial-1; r>=0; r--) {
+    int c = vcFind( true );
+    rank[c] = r;
+    vcUpdate( c, -1 );
+  }
+
+  // Rank the rest by filling the largest void each time
+
+  for (int p=0; p<n; p++) {
+    vcOn[p] = initialOn[p];
+    vcEnergy[p] = initialEnergy[p];
+  }
+
+  for (int r=numInitial; r<n; r++) {
+    int v = vcFind( false );
+    rank[v] = r;
+    vcUpdate( v, 1 );
+  }
+
+  for (int p=0; p<n; p++)
+    blueNoiseTile[p] = (rank[p] + 0.5f) / n;
+
+  blueNoiseBuilt = true;
+}
@@ -0,0 +1,86 @@
+/* sampler.h
+ *
+ * The source of all random numbers in the ray tracer.
+ *
+ * Each number is a function of the pixel, the sample in that pixel,
+ * the dimension (i.e. how many numbers the sample has already drawn),
+ * and the seed.  There is no shared generator state, so threads don't
+ * contend and a render is the same however its tiles are scheduled.
+ *
+ * A thread calls startSample() when it starts a pixel sample, then
+ * randIn01() (i.e. Sampler::next()) for each random decision.  The
+ * first PIXEL_DIMENSIONS numbers place the sample in its pixel.
+ *
+ * Backends:
+ *
+ *   pcg        independent numbers from a counter-based hash (the PCG
+ *              output permutation)
+ *
+ *   halton     Halton sequence over the samples of a pixel, with a
+ *              per-pixel random shift (Cranley-Patterson rotation)
+ *
+ *   sobol      pairs of dimensions are 2D Sobol points, Owen-scrambled
+ *              per pixel, so any number of dimensions is stratified
+ *
+ *   bluenoise  a blue-noise tile gives each pixel's first sample, and
+ *              later samples step through an R2 sequence, so the error
+ *              at low sample counts is high-frequency across pixels
+ *
+ * Halton falls back to pcg beyond its first 32 dimensions.
+ */
+
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+
+#define PIXEL_DIMENSIONS 2	// dimensions used to place a sample in its pixel
+
+
+enum SamplerType { PCG_SAMPLER, HALTON_SAMPLER, SOBOL_SAMPLER, BLUE_NOISE_SAMPLER };
+
+
+class Sampler {
+
+  static thread_local unsigned int pixelKey;	// current sample of *this thread*
+  static thread_local unsigned int sampleIndex;
+  static thread_local unsigned int dimension;
+
+  static float pcg( unsigned int dim );
+  static float halton( unsigned int dim );
+  static float sobol( unsigned int dim );
+  static float blueNoise( unsigned int dim );
+
+  static void buildBlueNoise();
+
+ public:
+
+  static SamplerType  type;
+  static unsigned int seed;
+
+  static void setType( SamplerType t );
+  static const char *typeName( SamplerType t );
+
+  // Start sample 'index' of pixel (x,y) at dimension 'dim'
+
+  static void startSample( int x, int y, int index, int dim = 0 ) {
+    pixelKey = (unsigned int) x | ((unsigned int) y << 16);
+    sampleIndex = index;
+    dimension = dim;
+  }
+
+  // Next number of the current sample, in [0,1)
+
+  static float next() {
+    unsigned int dim = dimension++;
+    switch (type) {
+    case HALTON_SAMPLER:     return halton( dim );
+    case SOBOL_SAMPLER:      return sobol( dim );
+    case BLUE_NOISE_SAMPLER: return blueNoise( dim );
+    default:                 return pcg( dim );
+    }
+  }
+};
+
+
+#endif
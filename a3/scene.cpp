@@ -11,6 +11,11 @@
 #include <cstring>
 #include <string>
 #include <math.h>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "scene.h"
 #include "rtWindow.h"
 #include "sphere.h"
@@ -21,6 +26,8 @@
 #include "main.h"
 #include "material.h"
 #include "arrow.h"
+#include "perfCounters.h"
+#include "mappedFile.h"
 
 
 
@@ -30,14 +37,34 @@
 
 
 #define UPDATE_INTERVAL 0.05  // update the screen with each 5% of RT progress
+#define TILE_SIZE       16    // RT image is traced in TILE_SIZE x TILE_SIZE tiles
+
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
 
 #define INDENT(n) { for (int i=0; i<(n); i++) cout << " "; }
 
 vec3 backgroundColour(1,1,1);
 vec3 blackColour(0,0,0);
 
-#define NUM_SOFT_SHADOW_RAYS 50
+#define MAX_SOLID_ANGLE 6.2831853 // of a hemisphere
+#define ADAPTIVE_CONTRAST 0.05	// adaptive: after the first pass, also refine pixels whose luminance differs this much from a neighbour's
 #define MAX_NUM_LIGHTS 4
+#define LIGHT_EPSILON 0.001	// shadow rays to an emitting triangle stop this fraction short of it
+
+
+thread_local bool Scene::storingRays = false;
+thread_local bool Scene::debug = false;
+thread_local seq<ObjectBVH_occluder> Scene::lastOccluders;
+thread_local seq<float> Scene::emitterCDF;
+
+
+// Seconds on a steady clock, for timing pixels and images
+
+static inline double clockSeconds()
+
+{
+  return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
 
 
 // Find the first object intersected
@@ -49,38 +76,12 @@ bool Scene::findFirstObjectInt( vec3 rayStart, vec3 rayDir, int thisObjIndex, in
   if (storingRays)
     storedRays.add( rayStart );
 
-  bool hit = false;
-
-  float maxParam = MAXFLOAT;
-
-  for (int i=0; i<objects.size(); i++) {
-
-    WavefrontObj* wfo = dynamic_cast<WavefrontObj*>( objects[i] );
+  // Don't check for int with the originating object for non-wavefront
+  // objects (since such objects are convex).  The objectBVH knows
+  // which objects those are.
 
-     // don't check for int with the originating object for non-wavefront objects (since such objects are convex)
-    
-    if (wfo || i != thisObjIndex) {
-      
-      vec3 point, normal, texcoords;
-      float t;
-      Material *intMat;
-      int intPartIndex;
-
-      if (objects[i]->rayInt( rayStart, rayDir, ((i != thisObjIndex) ? -1 : thisObjPartIndex), maxParam, point, normal, texcoords, t, intMat, intPartIndex )) {
-
-        P = point;
-        N = normal;
-        T = texcoords;
-        param = t;
-        objIndex = i;
-        objPartIndex = intPartIndex;
-        mat = intMat;
-
-        maxParam = t; // In future, don't intersect any farther than this
-        hit = true;
-      }
-    }
-  }
+  bool hit = objectBVH.rayInt( rayStart, rayDir, thisObjIndex, thisObjPartIndex, MAXFLOAT,
+			       P, N, T, param, objIndex, objPartIndex, mat );
 
   if (storingRays) {
 
@@ -104,13 +105,48 @@ bool Scene::findFirstObjectInt( vec3 rayStart, vec3 rayDir, int thisObjIndex, in
   return hit;
 }
 
+
+
+// Is there an object on the ray within [0,maxParam]?  This is the
+// shadow ray query: it stops at the first object found and computes
+// nothing about it.
+//
+// 'cacheIndex' selects the entry of lastOccluders[] for the light,
+// whose last occluder is tested first.  'lightIndex' is as for
+// findFirstObjectInt(), which is used instead when the rays are being
+// stored for display.
+
+bool Scene::occluded( vec3 rayStart, vec3 rayDir, int thisObjIndex, int thisObjPartIndex, float maxParam, int cacheIndex, int lightIndex )
+
+{
+  if (storingRays) {
+
+    vec3 P, N, T;
+    float t;
+    int objIndex, objPartIndex;
+    Material *mat;
+
+    return (findFirstObjectInt( rayStart, rayDir, thisObjIndex, thisObjPartIndex, P, N, T, t, objIndex, objPartIndex, mat, lightIndex ) &&
+	    t <= maxParam);
+  }
+
+  while (lastOccluders.size() <= cacheIndex)
+    lastOccluders.add( ObjectBVH_occluder() );
+
+  return objectBVH.occluded( rayStart, rayDir, thisObjIndex, thisObjPartIndex, maxParam, lastOccluders[cacheIndex] );
+}
+
 // Raytrace: This is the main raytracing routine which finds the first
 // object intersected, performs the lighting calculation, and does
 // recursive calls.
 //
+// 'weight' is the factor by which this ray's colour is scaled in the
+// pixel sample (1 for a primary ray).  It is used to prune the ray
+// tree; see traceWeight().
+//
 // This returns the colour received on the ray.
 
-vec3 Scene::raytrace( vec3 &rayStart, vec3 &rayDir, int depth, int thisObjIndex, int thisObjPartIndex )
+vec3 Scene::raytrace( vec3 &rayStart, vec3 &rayDir, int depth, int thisObjIndex, int thisObjPartIndex, float weight )
 
 {
   // Terminate the ray?
@@ -143,6 +179,57 @@ vec3 Scene::raytrace( vec3 &rayStart, vec3 &rayDir, int depth, int thisObjIndex,
   
   bool hit = findFirstObjectInt( rayStart, rayDir, thisObjIndex, thisObjPartIndex, P, N, texcoords, t, objIndex, objPartIndex, mat, -1 );
 
+  // A primary ray starts a path if the path integrator is selected
+
+  if (integrator == PATH_INTEGRATOR && depth == 1)
+    return pathShade( rayStart, rayDir, hit, P, N, texcoords, objIndex, objPartIndex, mat );
+
+  return shade( rayStart, rayDir, depth, thisObjIndex, hit, P, N, texcoords, objIndex, objPartIndex, mat, weight );
+}
+
+
+
+// Decide whether to trace a secondary ray whose colour will be scaled
+// by 'rayWeight' in the pixel sample.
+//
+// Rays with weights of at least 'rayCutoff' are always traced.  Those
+// below are traced by Russian roulette with probability rayWeight /
+// rayCutoff, and their colour is divided by that probability so that
+// the expected colour is unchanged.
+//
+// Returns the factor by which to scale the ray's colour, or 0 if the
+// ray should not be traced.  'rayWeight' is updated to the weight of
+// a surviving ray.
+
+float Scene::traceWeight( float &rayWeight )
+
+{
+  if (rayCutoff <= 0 || rayWeight >= rayCutoff)
+    return 1;
+
+  float p = rayWeight / rayCutoff;
+
+  if (randIn01() >= p)
+    return 0;
+
+  rayWeight = rayCutoff;
+
+  return 1 / p;
+}
+
+
+
+// Shade: Perform the lighting calculation at the point that a ray hit
+// (as found by raytrace() or by a ray packet), and do recursive
+// calls.  'depth' is the depth of this ray, starting at 1, and
+// 'weight' is as for raytrace().
+//
+// This returns the colour received on the ray.
+
+vec3 Scene::shade( vec3 &rayStart, vec3 &rayDir, int depth, int thisObjIndex,
+		   bool hit, vec3 &P, vec3 &N, vec3 &texcoords, int objIndex, int objPartIndex, Material *mat, float weight )
+
+{
   // No intersection: Return background colour
 
   if (!hit)
@@ -174,6 +261,18 @@ vec3 Scene::raytrace( vec3 &rayStart, vec3 &rayDir, int depth, int thisObjIndex,
 
   vec3 Iout = mat->Ie + vec3( mat->ka.x * Ia.x, mat->ka.y * Ia.y, mat->ka.z * Ia.z );
 
+  float opacity = alpha * mat->alpha;
+
+  // Weight of the reflected light in the pixel sample: calcIout()
+  // scales it by at most this much, and it is blended by 'opacity'
+  // if the surface is transparent
+
+  vec3  reflectScale  = calcIout( N, R, E, E, kd, mat->ks, mat->n, vec3(1,1,1) );
+  float reflectWeight = weight * MAX( reflectScale.x, MAX( reflectScale.y, reflectScale.z ) );
+
+  if (opacity < 1.0)
+    reflectWeight *= opacity;
+
   // Compute glossy reflection
 
   if (mat->g < 0 || mat->g > 1) {
@@ -185,9 +284,15 @@ vec3 Scene::raytrace( vec3 &rayStart, vec3 &rayDir, int depth, int thisObjIndex,
 
   if (g == 1 || glossyIterations == 1) {
 
-    vec3 Iin = raytrace( P, R, depth, objIndex, objPartIndex );
+    float rayWeight = reflectWeight;
+    float scale = traceWeight( rayWeight );
 
-    Iout = Iout + calcIout( N, R, E, E, kd, mat->ks, mat->n, Iin );
+    if (scale > 0) {
+      if (depth < maxDepth)
+	perfCounters.add( PERF_REFLECTION_RAYS, 1 );
+      vec3 Iin = scale * raytrace( P, R, depth, objIndex, objPartIndex, rayWeight );
+      Iout = Iout + calcIout( N, R, E, E, kd, mat->ks, mat->n, Iin );
+    }
     
   } else if (g > 0) {
 
@@ -200,117 +305,63 @@ vec3 Scene::raytrace( vec3 &rayStart, vec3 &rayDir, int depth, int thisObjIndex,
     // that average to Iout.
 
 
-    // YOUR CODE HERE
-    float cone = acos(g);  // half angle of cone
-    float l = 1/tan(cone); // disc distance
-
     vec3 IoutTemp = vec3(0,0,0);
 
-    
-    for (int i = 0; i < glossyIterations; i++) {
-      float a = 1, b = 1;
-      // get an a, b coord within the circle, while providing equal probability of all points
-      do {
-        a = randIn01();
-        b = randIn01();
-      } while (a + b > 1);
-      
-      // calc random ray and add it to Iout
-      vec3 randRay = (l * R + a * R.perp1() + b * R.perp2());
-      vec3 Iin = raytrace( P, randRay, depth, objIndex, objPartIndex );
-      IoutTemp = IoutTemp + calcIout( N, R, E, E, kd, mat->ks, mat->n, Iin );
-    }
-    // average all random ray components
-    IoutTemp = (1/float(glossyIterations)) * IoutTemp;
-    Iout = Iout + IoutTemp;
-  }
-  
-  // Add direct contributions from lights
-
-  for (int i=0; i<lights.size(); i++) {
-    Light &light = *lights[i];
-
-    vec3 L = light.position - P; // point light
-
-    if (N*L > 0) {
-
-      float  Ldist = L.length();
-      L = (1.0/Ldist) * L;
-
-      vec3 intP, intN, intTexCoords;
-      float intT;
-      int intObjIndex, intObjPartIndex;
-      Material *intMat;
+    // With pruning, a ray of low weight sends fewer glossy rays (at
+    // least one), so deep glossy bounces don't multiply
 
-      // Is there an object between P and the light?
+    int numGlossy = glossyIterations;
 
-      bool found = findFirstObjectInt( P, L, objIndex, objPartIndex, intP, intN, intTexCoords, intT, intObjIndex, intObjPartIndex, intMat, i );
+    if (rayCutoff > 0) {
+      numGlossy = (int) ceil( glossyIterations * weight );
+      if (numGlossy < 1)
+	numGlossy = 1;
+      else if (numGlossy > glossyIterations)
+	numGlossy = glossyIterations;
+    }
 
-      if (!found || intT > Ldist) { // no object: Add contribution from this light
-        vec3 Lr = (2 * (L * N)) * N - L;
-        Iout = Iout + calcIout( N, L, E, Lr, kd, mat->ks, mat->n, light.colour);
+    for (int i = 0; i < numGlossy; i++) {
+      // calc random ray and add it to Iout
+      vec3 randRay = glossyDirection( R, g );
+      float rayWeight = reflectWeight / numGlossy;
+      float scale = traceWeight( rayWeight );
+      if (scale > 0) {
+        if (depth < maxDepth)
+          perfCounters.add( PERF_GLOSSY_RAYS, 1 );
+        vec3 Iin = scale * raytrace( P, randRay, depth, objIndex, objPartIndex, rayWeight );
+        IoutTemp = IoutTemp + calcIout( N, R, E, E, kd, mat->ks, mat->n, Iin );
       }
     }
+    // average all random ray components
+    IoutTemp = (1/float(numGlossy)) * IoutTemp;
+    Iout = Iout + IoutTemp;
   }
+  
+  // Add direct contributions from lights and emitting triangles
 
-  // Add contributions from emitting triangles
-
-  for (int i=0; i<objects.size(); i++) {
-    if (i != thisObjIndex) {
-      Triangle* tri = dynamic_cast<Triangle*>( objects[i] );
-      if (tri && tri->mat->Ie.squaredLength() > 0)
-	for (int j=0; j<NUM_SOFT_SHADOW_RAYS; j++) {
-
-	  float a,b;
-	  do {
-	    a = randIn01();
-	    b = randIn01();
-	  } while (a+b > 1);
-
-	  Triangle *triangle = (Triangle*) objects[i];
-
-	  vec3 pointOnLight = triangle->pointFromBarycentricCoords( a, b, 1-a-b );
-
-	  vec3 L = pointOnLight - P;
-
-	  if (N*L > 0) {
-
-	    float  Ldist = L.length();
-	    L = (1.0/Ldist) * L;
-
-	    vec3 intP, intN, intTexCoords;
-	    float intT;
-	    int intObjIndex, intObjPartIndex;
-	    Material *intMat;
-
-	    // Is there an object between P and the light?
-
-	    bool hit = findFirstObjectInt( P, L, objIndex, objPartIndex, intP, intN, intTexCoords, intT, intObjIndex, intObjPartIndex, intMat, -1 );
-
-	    if (hit && intObjIndex == i) { // no object before light: Add contribution from this light
-	      vec3 Lr = (2 * (L * N)) * N - L;
-	      Iout = Iout + calcIout( N, L, E, Lr, kd, mat->ks, mat->n, (1.0/(float)NUM_SOFT_SHADOW_RAYS) * triangle->mat->Ie);
-	    }
-	  }
-	}
-    }
-  }
+  Iout = Iout + directLight( P, N, E, kd, mat, objIndex, objPartIndex );
 
   // Blend the refraction ray coming up through a transparent surface
   // with the reflection ray calculated as 'Iout' above.  The blend
   // should be 'opacity' of the reflected ray and '1-opacity' of the
   // refracted ray.
 
-  float opacity = alpha * mat->alpha;
-
   if (opacity < 1.0) { // not completely opaque
 
     // YOUR CODE HERE
     vec3 refractionDir;
     // If total internal reflection does not occur, blend 
     // reflection and refraction rays proportional to opacity
-    if(findRefractionDirection(rayDir, N, refractionDir))
-       Iout = (opacity)*Iout + (1-opacity)*raytrace(P,refractionDir, depth, objIndex, objPartIndex);
+    if(findRefractionDirection(rayDir, N, refractionDir)) {
+       float rayWeight = weight * (1-opacity);
+       float scale = traceWeight( rayWeight );
+       Iout = (opacity)*Iout;
+       if (scale > 0) {
+         if (depth < maxDepth)
+           perfCounters.add( PERF_REFRACTION_RAYS, 1 );
+         Iout = Iout + (scale*(1-opacity))*raytrace(P,refractionDir, depth, objIndex, objPartIndex, rayWeight);
+       }
+    }
     // Use the 'findRefractionDirection' function (below).
   }
   return Iout;
@@ -406,7 +457,7 @@ vec3 Scene::pixelColour( int x, int y )
 
   vec3 dir = (llCorner + (x+0.5)*right + (y+0.5)*up).normalize(); // pixel centre
 
-  result = raytrace( eye->position, dir, 0, -1, -1 );
+  result = raytrace( rayOrigin, dir, 0, -1, -1, 1 );
 
 #else
 
@@ -420,6 +471,7 @@ vec3 Scene::pixelColour( int x, int y )
     {
       for (int n = 0; n < numPixelSamples; n++)
     {
+      Sampler::startSample( x, y, i * numPixelSamples + n );
       vec3 dir;
       if (jitter)
         // Take random samples from the pixel split into sectors based on numPixSample and the i, n values
@@ -427,9 +479,11 @@ vec3 Scene::pixelColour( int x, int y )
       else
         dir = (llCorner + (x+randIn01())*right + (y+randIn01())*up).normalize(); // random point in pixel
       // Balance the weighting of each colour sample
-      result = result + 1.0/square * raytrace( eye->position, dir, 0, -1, -1 );
+      result = result + 1.0/square * raytrace( rayOrigin, dir, 0, -1, -1, 1 );
     }
   }
+
+  perfCounters.add( PERF_PRIMARY_RAYS, square );
   
   // Change the "#if 1" above to "#if 0" once your code here is ready.
 
@@ -510,11 +564,6 @@ void Scene::read( const char *basename, istream &in )
 
       eye = new Eye();
       in >> *eye;
-
-      win->eye = eye->position;
-      win->lookAt = eye->lookAt;
-      win->upDir = eye->upDir;
-      win->fovy = eye->fovy;
       
     } else {
       
@@ -527,6 +576,211 @@ void Scene::read( const char *basename, istream &in )
     cerr << "No lights were provided in " << basename << " so the scene would be black." << endl;
     exit(1);
   }
+
+  if (eye == NULL) {
+    cerr << "No eye was provided in " << basename << endl;
+    exit(1);
+  }
+
+  // Build the top-level BVH over all objects
+
+  objectBVH.build( objects );
+
+  buildEmitters();
+}
+
+
+
+// A random glossy reflection direction around the mirror direction R
+// for glossiness 'g' in (0,1).  The half angle of the cone of
+// directions is arccos(g).
+
+vec3 Scene::glossyDirection( vec3 &R, float g )
+
+{
+  float cone = acos(g);  // half angle of cone
+  float l = 1/tan(cone); // disc distance
+
+  float a = 1, b = 1;
+  // get an a, b coord within the circle, while providing equal probability of all points
+  do {
+    a = randIn01();
+    b = randIn01();
+  } while (a + b > 1);
+
+  return (l * R + a * R.perp1() + b * R.perp2());
+}
+
+
+
+// Light arriving at P directly from the point lights and the emitting
+// triangles, as reflected toward E
+
+vec3 Scene::directLight( vec3 &P, vec3 &N, vec3 &E, vec3 &kd, Material *mat, int objIndex, int objPartIndex )
+
+{
+  vec3 Iout(0,0,0);
+
+  for (int i=0; i<lights.size(); i++) {
+    Light &light = *lights[i];
+
+    vec3 L = light.position - P; // point light
+
+    if (N*L > 0) {
+
+      float  Ldist = L.length();
+      L = (1.0/Ldist) * L;
+
+      // Is there an object between P and the light?
+
+      perfCounters.add( PERF_SHADOW_RAYS, 1 );
+
+      if (!occluded( P, L, objIndex, objPartIndex, Ldist, i, i )) { // no object: Add contribution from this light
+        vec3 Lr = (2 * (L * N)) * N - L;
+        Iout = Iout + calcIout( N, L, E, Lr, kd, mat->ks, mat->n, light.colour);
+      }
+    }
+  }
+
+  return Iout + emitterLight( P, N, E, kd, mat, objIndex, objPartIndex );
+}
+
+
+
+// Find the emitting triangles
+
+void Scene::buildEmitters()
+
+{
+  emitters.clear();
+
+  for (int i=0; i<objects.size(); i++) {
+
+    Triangle *tri = dynamic_cast<Triangle*>( objects[i] );
+
+    if (tri && tri->mat->Ie.squaredLength() > 0) {
+
+      Emitter e;
+
+      vec3 v0 = tri->vertexPosition(0);
+      vec3 v1 = tri->vertexPosition(1);
+      vec3 v2 = tri->vertexPosition(2);
+
+      e.tri      = tri;
+      e.objIndex = i;
+      e.Ie       = tri->mat->Ie;
+      e.radiance = (e.Ie.x + e.Ie.y + e.Ie.z) / 3.0;
+      e.area     = 0.5 * ((v1-v0) ^ (v2-v0)).length();
+      e.centroid = (1/3.0) * (v0 + v1 + v2);
+
+      emitters.add( e );
+    }
+  }
+}
+
+
+
+// Light arriving at P from the emitting triangles
+//
+// 'emitterShadowRays' shadow rays are shared among the emitters.
+// Each ray goes to a random point on an emitter chosen with
+// probability proportional to its expected contribution: its radiance
+// times the solid angle it subtends at P.  The solid angle is
+// approximated as area/distance^2, without the emitter's orientation,
+// as emitters light both of their sides.  Emitters that are entirely
+// below the horizon at P contribute nothing and are never chosen.
+//
+// Dividing each sample by its probability gives the same expected
+// light as sampling every emitter with the full number of rays.
+
+vec3 Scene::emitterLight( vec3 &P, vec3 &N, vec3 &E, vec3 &kd, Material *mat, int objIndex, int objPartIndex )
+
+{
+  vec3 Iout(0,0,0);
+
+  if (emitters.size() == 0 || emitterShadowRays < 1)
+    return Iout;
+
+  // Cumulative weights
+
+  while (emitterCDF.size() < emitters.size())
+    emitterCDF.add( 0 );
+
+  float total = 0;
+
+  for (int i=0; i<emitters.size(); i++) {
+
+    Emitter &e = emitters[i];
+
+    float w = 0;
+
+    if (e.objIndex != objIndex &&
+	(N * (e.tri->vertexPosition(0) - P) > 0 ||
+	 N * (e.tri->vertexPosition(1) - P) > 0 ||
+	 N * (e.tri->vertexPosition(2) - P) > 0)) {
+
+      float d2 = (e.centroid - P).squaredLength();
+      float solidAngle = (d2 * MAX_SOLID_ANGLE > e.area ? e.area / d2 : MAX_SOLID_ANGLE);
+
+      w = e.radiance * solidAngle;
+    }
+
+    total += w;
+    emitterCDF[i] = total;
+  }
+
+  if (total <= 0)
+    return Iout;
+
+  // Trace the shadow rays
+
+  for (int s=0; s<emitterShadowRays; s++) {
+
+    // Choose an emitter (the first whose cumulative weight exceeds u)
+
+    float u = randIn01() * total;
+
+    int lo = 0, hi = emitters.size()-1;
+    while (lo < hi) {
+      int mid = (lo+hi)/2;
+      if (emitterCDF[mid] > u || emitterCDF[mid] >= total)
+	hi = mid;
+      else
+	lo = mid+1;
+    }
+
+    Emitter &e = emitters[lo];
+    float prob = (emitterCDF[lo] - (lo > 0 ? emitterCDF[lo-1] : 0)) / total;
+
+    // Choose a point on it
+
+    float a,b;
+    do {
+      a = randIn01();
+      b = randIn01();
+    } while (a+b > 1);
+
+    vec3 pointOnLight = e.tri->pointFromBarycentricCoords( a, b, 1-a-b );
+
+    vec3 L = pointOnLight - P;
+
+    if (N*L > 0) {
+
+      float  Ldist = L.length();
+      L = (1.0/Ldist) * L;
+
+      // Is there an object before the light?
+
+      perfCounters.add( PERF_EMITTER_RAYS, 1 );
+
+      if (!occluded( P, L, objIndex, objPartIndex, (1-LIGHT_EPSILON) * Ldist, lights.size()+e.objIndex, -1 )) {
+	vec3 Lr = (2 * (L * N)) * N - L;
+	Iout = Iout + calcIout( N, L, E, Lr, kd, mat->ks, mat->n, (1.0/(emitterShadowRays*prob)) * e.Ie );
+      }
+    }
+  }
+
+  return Iout;
 }
 
 
@@ -555,28 +809,45 @@ char *Scene::statusMessage()
 {
   static char buffer[1000];
 
-  sprintf( buffer, "depth %d, glossy %d", maxDepth, glossyIterations );
+  if (integrator == PATH_INTEGRATOR)
+    sprintf( buffer, "depth %d, path tracing", maxDepth );
+  else
+    sprintf( buffer, "depth %d, glossy %d", maxDepth, glossyIterations );
+
+  // Rays per second in the RT image so far
+
+  if (rtImage != NULL) {
+    double seconds = renderSeconds();
+    if (seconds > 0)
+      sprintf( buffer + strlen(buffer), ", %.2f Mrays/s", perfCounters.totalRays() / seconds / 1e6 );
+  }
 
   return buffer;
 }
 
 
 
-// Draw the scene.  This sets things up and simply
-// calls pixelColour() for each pixel.
+// Draw the scene.  This sets things up and hands the tiles of the
+// image to the threadPool, which calls pixelColour() for each pixel.
+//
+// This is called repeatedly from the main loop.  Each call after the
+// first just shows the progress of the tiles that have finished.
 
 
 void Scene::renderRT( bool restart )
 
 {
   static float nextDot;
-  static int nextx, nexty;
 
   mat4 WCS_to_VCS = lookat( win->eye, win->lookAt, win->upDir );
   mat4 VCS_to_CCS = perspective( win->fovy, win->windowWidth / win->windowHeight, win->zNear, win->zFar );
 
   if (restart) {
 
+    // Stop tracing the tiles of any previous image
+
+    cancelRT();
+
     // Copy the window eye into the scene eye
 
     eye->position = win->eye;
@@ -584,26 +855,13 @@ void Scene::renderRT( bool restart )
     eye->upDir = win->upDir;
     eye->fovy = win->fovy;
 
-    // Compute the image plane coordinate system
-
-    up = (2 * tan( eye->fovy / 2.0 )) * eye->upDir.normalize();
-
-    right = (2 * tan( eye->fovy / 2.0 ) * (float) win->windowWidth / (float) win->windowHeight)
-      * ((eye->lookAt - eye->position) ^ eye->upDir).normalize();
-  
-    llCorner = (eye->lookAt - eye->position).normalize()
-      - 0.5 * up - 0.5 * right;
-
-    up = (1.0 / (float) (win->windowHeight-1)) * up;
-    right = (1.0 / (float) (win->windowWidth-1)) * right;
+    setupCamera( (int) win->windowWidth, (int) win->windowHeight );
 
     if (nextDot != 0) {
       cout << "\r           \r";
       cout.flush();
     }
 
-    nextx = 0;
-    nexty = 0;
     nextDot = UPDATE_INTERVAL;
 
     stop = false;
@@ -616,67 +874,1107 @@ void Scene::renderRT( bool restart )
     rtImage = NULL;
   }
 
-  // Set up a new RT image
+  // Set up a new RT image and start tracing its tiles
 
-  if (rtImage == NULL) {
-    rtImage = new vec4[ (int) (win->windowWidth * win->windowHeight) ];
-    for (int i=0; i<win->windowWidth * win->windowHeight; i++)
-      rtImage[i] = vec4(0,0,0,0); // transparent
-  }
+  if (rtImage == NULL)
+    startTiles();
 
   if (stop)
     return;
 
-  // Draw the next pixel
-
-  vec3 colour = pixelColour( nextx, nexty );
+  // Show progress
 
-  rtImage[ nextx + nexty * (int) win->windowWidth ] = vec4( colour.x, colour.y, colour.z, 1 ); // opaque
+  int numTiles = numTilesX * numTilesY;
 
-  // Move (nextx,nexty) to the next pixel
-
-  nexty++;
-  if (nexty >= win->windowHeight) {
-    nexty = 0;
-    nextx++;
-    if ((float)nextx/(float)win->windowWidth >= nextDot) {
+  if ((float)numTilesDone/(float)numTiles >= nextDot) {
 
+    while ((float)numTilesDone/(float)numTiles >= nextDot)
       nextDot += UPDATE_INTERVAL;
 
+    if (numTilesDone < numTiles)
       draw_RT_and_GL( gpuProg, WCS_to_VCS, VCS_to_CCS ); // gpuProg is from main.cpp
-    }
-    
-    if (nextx >= win->windowWidth) { // finished
+  }
 
-      draw_RT_and_GL( gpuProg, WCS_to_VCS, VCS_to_CCS );
+  if (numTilesDone == numTiles) { // finished
 
-      nextx = 0;
-      stop = true;
-      cout << "\r           \r";
-      cout.flush();
-    }
+    rtSeconds = clockSeconds() - rtStartTime;
+
+    draw_RT_and_GL( gpuProg, WCS_to_VCS, VCS_to_CCS );
+
+    if (perfOutput != NULL)
+      writePerfStats( perfOutput );
+
+    stop = true;
+    cout << "\r           \r";
+    cout.flush();
   }
 }
 
 
-// Render the scene with OpenGL
-
+// Compute the image plane coordinate system for a 'width' x 'height'
+// image seen from the scene's eye.
 
-void Scene::renderGL( mat4 &WCS_to_VCS, mat4 &VCS_to_CCS )
+void Scene::setupCamera( int width, int height )
 
 {
-  // create axes and glverts here so that they are not created before
-  // the window is initialized
+  rtWidth  = width;
+  rtHeight = height;
 
-  if (axes == NULL)
-    axes = new Axes();
+  up = (2 * tan( eye->fovy / 2.0 )) * eye->upDir.normalize();
 
-  if (glverts == NULL)
-    glverts = new GLVerts();
+  right = (2 * tan( eye->fovy / 2.0 ) * (float) rtWidth / (float) rtHeight)
+    * ((eye->lookAt - eye->position) ^ eye->upDir).normalize();
   
-  // Set up the framebuffer
- 
-  glEnable( GL_DEPTH_TEST );
+  llCorner = (eye->lookAt - eye->position).normalize()
+    - 0.5 * up - 0.5 * right;
+
+  up = (1.0 / (float) (rtHeight-1)) * up;
+  right = (1.0 / (float) (rtWidth-1)) * right;
+
+  rayOrigin = eye->position;
+}
+
+
+// Allocate a new (transparent) RT image and give its tiles to the
+// threadPool.  With 'resumeFrom', the tiles in that checkpoint are
+// restored rather than traced.
+
+void Scene::startTiles( const char *resumeFrom )
+
+{
+  rtImage = new vec4[ rtWidth * rtHeight ];
+  for (int i=0; i<rtWidth * rtHeight; i++)
+    rtImage[i] = vec4(0,0,0,0); // transparent
+
+  numTilesX = (rtWidth  + TILE_SIZE-1) / TILE_SIZE;
+  numTilesY = (rtHeight + TILE_SIZE-1) / TILE_SIZE;
+  numTilesDone = 0;
+  samplesTraced = 0;
+
+  if (finishedTiles != NULL)
+    delete [] finishedTiles;
+
+  finishedTiles = new std::atomic<int>[ numTilesX * numTilesY ];
+  for (int i=0; i<numTilesX * numTilesY; i++)
+    finishedTiles[i] = -1;
+
+  numTilesClaimed = 0;
+  rtTexStale = true;
+
+  if (pixelTime != NULL)
+    delete [] pixelTime;
+
+  pixelTime = new float[ rtWidth * rtHeight ];
+  for (int i=0; i<rtWidth * rtHeight; i++)
+    pixelTime[i] = 0;
+
+  if (pixelSamples != NULL)
+    delete [] pixelSamples;
+
+  pixelSamples = new int[ rtWidth * rtHeight ];
+  for (int i=0; i<rtWidth * rtHeight; i++)
+    pixelSamples[i] = 0;
+
+  numTilesCheckpointed = 0;
+
+  bool *restored = new bool[ numTilesX * numTilesY ];
+  for (int i=0; i<numTilesX * numTilesY; i++)
+    restored[i] = false;
+
+  if (resumeFrom != NULL)
+    readCheckpoint( resumeFrom, restored );
+
+  perfCounters.clear();		// the workers are idle, after cancelRT()
+
+  rtStartTime = clockSeconds();
+  rtSeconds = -1;
+
+  int generation = rtGeneration;
+
+  // Submit in reverse order: each worker takes its own tiles from
+  // the back of its queue, so tiles are started roughly in order.
+
+  for (int i=numTilesX*numTilesY-1; i>=0; i--)
+    if (!restored[i])
+      threadPool->submit( rtTasks, [this,i,generation] { renderTile( i, generation ); } );
+
+  delete [] restored;
+}
+
+
+// Raytrace a 'width' x 'height' image from the scene's eye without a
+// window.  This returns once the whole image is in rtImage.
+//
+// With a checkpointFile, a background thread saves the finished tiles
+// to it every checkpointInterval seconds, and with 'resume' the tiles
+// already in it aren't traced again.  Each pixel's samples depend only
+// on the pixel and the sampler settings, so a resumed render ends
+// with the same image as one that was never stopped.
+
+void Scene::renderHeadless( int width, int height )
+
+{
+  cancelRT();
+
+  setupCamera( width, height );
+
+  if (rtImage != NULL)
+    delete [] rtImage;
+
+  if (checkpointFile != NULL)
+    checkpointKey( rtCheckpointKey );
+
+  startTiles( checkpointFile != NULL && resume ? checkpointFile : NULL );
+
+  std::thread             checkpointer;
+  std::mutex              checkpointMutex;
+  std::condition_variable checkpointWake;
+  bool                    finished = false;
+
+  if (checkpointFile != NULL)
+    checkpointer = std::thread( [&] {
+      std::unique_lock<std::mutex> lock( checkpointMutex );
+      while (!checkpointWake.wait_for( lock, std::chrono::duration<float>( checkpointInterval ), [&] { return finished; } ))
+	writeCheckpoint( checkpointFile );
+    } );
+
+  threadPool->wait( rtTasks ); // this thread helps with the tiles
+
+  rtSeconds = clockSeconds() - rtStartTime;
+
+  if (checkpointer.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock( checkpointMutex );
+      finished = true;
+    }
+    checkpointWake.notify_one();
+    checkpointer.join();
+  }
+}
+
+
+// Seconds spent on the RT image: so far, if it is still being traced
+
+double Scene::renderSeconds()
+
+{
+  return (rtSeconds >= 0 ? rtSeconds : clockSeconds() - rtStartTime);
+}
+
+
+// Write the RT image to a file.  A filename ending in ".pfm" gets a
+// floating-point PFM image; anything else gets an 8-bit PPM image
+// with colours clamped to [0,1].
+//
+// Return false if the file couldn't be written.
+
+bool Scene::writeImage( const char *filename )
+
+{
+  if (rtImage == NULL)
+    return false;
+
+  FILE *out = fopen( filename, "wb" );
+  if (out == NULL) {
+    cerr << "Could not open " << filename << " for writing." << endl;
+    return false;
+  }
+
+  const char *ext = strrchr( filename, '.' );
+
+  if (ext != NULL && strcmp( ext, ".pfm" ) == 0) {
+
+    // PFM: rows go bottom-to-top, as in rtImage.  A negative scale
+    // means little-endian floats.
+
+    fprintf( out, "PF\n%d %d\n-1.0\n", rtWidth, rtHeight );
+
+    float *row = new float[ 3*rtWidth ];
+
+    for (int y=0; y<rtHeight; y++) {
+      for (int x=0; x<rtWidth; x++) {
+        vec4 &c = rtImage[ x + y * rtWidth ];
+        row[3*x]   = c.x;
+        row[3*x+1] = c.y;
+        row[3*x+2] = c.z;
+      }
+      fwrite( row, sizeof(float), 3*rtWidth, out );
+    }
+
+    delete [] row;
+
+  } else {
+
+    // PPM: rows go top-to-bottom
+
+    fprintf( out, "P6\n%d %d\n255\n", rtWidth, rtHeight );
+
+    unsigned char *row = new unsigned char[ 3*rtWidth ];
+
+    for (int y=rtHeight-1; y>=0; y--) {
+      for (int x=0; x<rtWidth; x++) {
+        vec4 &c = rtImage[ x + y * rtWidth ];
+        float rgb[3] = { c.x, c.y, c.z };
+        for (int i=0; i<3; i++)
+          row[3*x+i] = (unsigned char) (rgb[i] <= 0 ? 0 : (rgb[i] >= 1 ? 255 : rgb[i]*255 + 0.5));
+      }
+      fwrite( row, 1, 3*rtWidth, out );
+    }
+
+    delete [] row;
+  }
+
+  fclose( out );
+
+  return true;
+}
+
+
+
+// Write the performance of the RT image: a heatmap of the time spent
+// on each pixel to 'basename'.ppm and a summary of the counters to
+// 'basename'.json.
+//
+// The heatmap goes from black through red and yellow to white, which
+// is the 99th percentile of the pixel times (so that a few slow
+// pixels don't make the rest dark).
+//
+// Return false if a file couldn't be written.
+
+bool Scene::writePerfStats( const char *basename )
+
+{
+  if (rtImage == NULL || pixelTime == NULL)
+    return false;
+
+  int numPixels = rtWidth * rtHeight;
+
+  // Pixel times
+
+  float *sorted = new float[ numPixels ];
+  memcpy( sorted, pixelTime, numPixels * sizeof(float) );
+
+  float *p99 = sorted + (int) (0.99 * (numPixels-1));
+  std::nth_element( sorted, p99, sorted + numPixels );
+
+  float  maxTime = *std::max_element( sorted, sorted + numPixels );
+  float  scale   = (*p99 > 0 ? 1 / *p99 : 0);
+  double sumTime = 0;
+
+  for (int i=0; i<numPixels; i++)
+    sumTime += pixelTime[i];
+
+  // Heatmap
+
+  string heatmapName = string( basename ) + ".ppm";
+
+  FILE *out = fopen( heatmapName.c_str(), "wb" );
+  if (out == NULL) {
+    cerr << "Could not open " << heatmapName << " for writing." << endl;
+    delete [] sorted;
+    return false;
+  }
+
+  fprintf( out, "P6\n%d %d\n255\n", rtWidth, rtHeight );
+
+  unsigned char *row = new unsigned char[ 3*rtWidth ];
+
+  for (int y=rtHeight-1; y>=0; y--) { // top-to-bottom, as in writeImage()
+    for (int x=0; x<rtWidth; x++) {
+      float v = 3 * scale * pixelTime[ x + y * rtWidth ];
+      for (int i=0; i<3; i++) {
+	float c = v - i;
+	row[3*x+i] = (unsigned char) (c <= 0 ? 0 : (c >= 1 ? 255 : c*255 + 0.5));
+      }
+    }
+    fwrite( row, 1, 3*rtWidth, out );
+  }
+
+  delete [] row;
+  fclose( out );
+
+  // Summary
+
+  string summaryName = string( basename ) + ".json";
+
+  out = fopen( summaryName.c_str(), "w" );
+  if (out == NULL) {
+    cerr << "Could not open " << summaryName << " for writing." << endl;
+    delete [] sorted;
+    return false;
+  }
+
+  double    seconds = renderSeconds();
+  long long rays    = perfCounters.totalRays();
+
+  fprintf( out, "{\n" );
+  fprintf( out, "  \"width\": %d,\n  \"height\": %d,\n", rtWidth, rtHeight );
+  fprintf( out, "  \"threads\": %d,\n", threadPool->size() );
+  fprintf( out, "  \"seconds\": %g,\n", seconds );
+  fprintf( out, "  \"rays\": %lld,\n", rays );
+  fprintf( out, "  \"raysPerSecond\": %g,\n", (seconds > 0 ? rays / seconds : 0) );
+
+  fprintf( out, "  \"counters\": {" );
+  for (int c=0; c<NUM_PERF_COUNTERS; c++)
+    fprintf( out, "%s\n    \"%s\": %lld", (c > 0 ? "," : ""), PerfCounters::name( (PerfCounter) c ), perfCounters.total( (PerfCounter) c ) );
+  fprintf( out, "\n  },\n" );
+
+  fprintf( out, "  \"perRay\": {" );
+  for (int c=NUM_PERF_RAY_COUNTERS; c<NUM_PERF_COUNTERS; c++)
+    fprintf( out, "%s\n    \"%s\": %g", (c > NUM_PERF_RAY_COUNTERS ? "," : ""), PerfCounters::name( (PerfCounter) c ),
+	     (rays > 0 ? perfCounters.total( (PerfCounter) c ) / (double) rays : 0) );
+  fprintf( out, "\n  },\n" );
+
+  // One entry per pool thread (slots 1 on), so that there are
+  // 'threads' of them.  Slot 0 is of the threads outside the pool,
+  // such as the main thread.
+
+  fprintf( out, "  \"raysPerThread\": [" );
+  for (int i=1; i<perfCounters.size(); i++)
+    fprintf( out, "%s%lld", (i > 1 ? ", " : " "), perfCounters.threadRays( i ) );
+  fprintf( out, " ],\n" );
+  fprintf( out, "  \"raysOutsidePool\": %lld,\n", perfCounters.threadRays( 0 ) );
+
+  fprintf( out, "  \"pixelSeconds\": { \"mean\": %g, \"p99\": %g, \"max\": %g },\n",
+	   sumTime / numPixels, *p99, maxTime );
+  fprintf( out, "  \"heatmap\": \"%s\"\n", heatmapName.c_str() );
+  fprintf( out, "}\n" );
+
+  fclose( out );
+
+  delete [] sorted;
+
+  return true;
+}
+
+
+
+// Checkpoint file:
+//
+//   CHECKPOINT_MAGIC
+//   keyLength      int
+//   key            keyLength chars from checkpointKey()
+//   numTiles       int
+//   numTiles x {
+//     tileIndex    int
+//     colours      3 floats per pixel of the tile, row by row
+//     samples      an int per pixel of the tile
+//   }
+//
+// in this machine's byte order.  Only finished tiles are saved.
+
+#define CHECKPOINT_MAGIC   "RTCKPT02"
+#define CHECKPOINT_MAX_KEY 1000000	// longer keys are of damaged files
+
+
+// A line of the checkpoint key naming an input file and the hash of
+// its contents
+
+static string inputFileKey( const char *kind, const char *filename )
+
+{
+  MappedFile file;
+  char       line[1200];
+
+  if (file.open( filename ))
+    snprintf( line, sizeof(line), "%s %s %016llx\n", kind, filename, file.hash() );
+  else
+    snprintf( line, sizeof(line), "%s %s missing\n", kind, filename );
+
+  return line;
+}
+
+
+// Describe everything that the traced pixels depend on, one field per
+// line, so that a checkpoint isn't resumed with another scene or
+// other settings.  The scene is identified by the world's path and
+// the contents of the files it reads: the world, its OBJ files and
+// their material libraries, and its textures.
+
+void Scene::checkpointKey( string &key )
+
+{
+  char line[1000];
+
+  key = "";
+
+#define KEY_FIELD(...) { snprintf( line, sizeof(line), __VA_ARGS__ ); key += line; key += '\n'; }
+
+  KEY_FIELD( "world %s", (worldFile != NULL ? worldFile : "-") );
+
+  if (worldFile != NULL)
+    key += inputFileKey( "world-file", worldFile );
+
+  for (int i=0; i<objects.size(); i++) {
+
+    WavefrontObj *wfo = dynamic_cast<WavefrontObj*>( objects[i] );
+    if (wfo == NULL || wfo->objFilename() == NULL)
+      continue;
+
+    key += inputFileKey( "obj", wfo->objFilename() );
+
+    if (wfo->mtlFilename() != NULL) {
+      string mtl = wfo->objFilename();
+      size_t slash = mtl.rfind( '/' );
+      mtl = (slash != string::npos ? mtl.substr( 0, slash+1 ) : string( "" )) + wfo->mtlFilename();
+      key += inputFileKey( "mtl", mtl.c_str() );
+    }
+  }
+
+  for (int i=0; i<textures.size(); i++)
+    key += inputFileKey( "texture", textures[i]->name );
+
+  KEY_FIELD( "size %dx%d tile %d", rtWidth, rtHeight, TILE_SIZE );
+  KEY_FIELD( "eye %g %g %g lookAt %g %g %g up %g %g %g fovy %g",
+	     eye->position.x, eye->position.y, eye->position.z, eye->lookAt.x, eye->lookAt.y, eye->lookAt.z,
+	     eye->upDir.x, eye->upDir.y, eye->upDir.z, eye->fovy );
+  KEY_FIELD( "objects %d lights %d", objects.size(), lights.size() );
+  KEY_FIELD( "samples %d jitter %d packets %d", numPixelSamples, jitter, usePackets );
+  KEY_FIELD( "adaptive %d min %d max %d threshold %g", adaptive, minSamples, maxSamples, adaptiveThreshold );
+  KEY_FIELD( "depth %d glossy %d cutoff %g", maxDepth, glossyIterations, rayCutoff );
+  KEY_FIELD( "integrator %d shadowRays %d", (int) integrator, emitterShadowRays );
+  KEY_FIELD( "sampler %d seed %u", (int) Sampler::type, Sampler::seed );
+  KEY_FIELD( "kernel %d", (int) BVH::kernel );
+  KEY_FIELD( "textureTransparency %d mipMaps %d", useTextureTransparency, Texture::useMipMaps );
+
+#undef KEY_FIELD
+}
+
+
+// Report the lines of two checkpoint keys that differ
+
+static void reportKeyDifferences( const string &key, const string &fileKey )
+
+{
+  size_t a = 0, b = 0;
+
+  while (a < key.size() || b < fileKey.size()) {
+
+    size_t aEnd = key.find( '\n', a );
+    size_t bEnd = fileKey.find( '\n', b );
+
+    if (aEnd == string::npos) aEnd = key.size();
+    if (bEnd == string::npos) bEnd = fileKey.size();
+
+    string lineA = (a < key.size()     ? key.substr( a, aEnd-a )     : string( "(none)" ));
+    string lineB = (b < fileKey.size() ? fileKey.substr( b, bEnd-b ) : string( "(none)" ));
+
+    if (lineA != lineB)
+      cerr << "  this render: " << lineA << endl
+	   << "  checkpoint:  " << lineB << endl;
+
+    a = (aEnd < key.size()     ? aEnd+1 : key.size());
+    b = (bEnd < fileKey.size() ? bEnd+1 : fileKey.size());
+  }
+}
+
+
+// Save the finished tiles of the RT image to 'filename'.  This is
+// called from a thread of its own while the workers trace, and reads
+// the tiles published in finishedTiles[] as the main thread does.
+// The file is written under a temporary name and then renamed, so a
+// render killed while writing leaves the previous checkpoint.
+//
+// Return false if the file couldn't be written.
+
+bool Scene::writeCheckpoint( const char *filename )
+
+{
+  int  total = numTilesX * numTilesY;
+  int *tiles = new int[ total ];
+  int  numTiles = 0;
+
+  while (numTiles < total) {
+    int t = finishedTiles[ numTiles ].load( std::memory_order_acquire );
+    if (t < 0)
+      break;			// not yet published
+    tiles[ numTiles++ ] = t;
+  }
+
+  if (numTiles == numTilesCheckpointed) { // nothing new
+    delete [] tiles;
+    return true;
+  }
+
+  string tmpName = string( filename ) + ".tmp";
+
+  FILE *out = fopen( tmpName.c_str(), "wb" );
+  if (out == NULL) {
+    cerr << "Could not open " << tmpName << " for writing." << endl;
+    delete [] tiles;
+    return false;
+  }
+
+  int keyLength = rtCheckpointKey.size();
+
+  fwrite( CHECKPOINT_MAGIC, 1, strlen( CHECKPOINT_MAGIC ), out );
+  fwrite( &keyLength, sizeof(int), 1, out );
+  fwrite( rtCheckpointKey.c_str(), 1, keyLength, out );
+  fwrite( &numTiles, sizeof(int), 1, out );
+
+  float colours[ 3 * TILE_SIZE * TILE_SIZE ];
+  int   samples[ TILE_SIZE * TILE_SIZE ];
+
+  for (int i=0; i<numTiles; i++) {
+
+    int x0, y0, x1, y1;
+    tileBounds( tiles[i], x0, y0, x1, y1 );
+
+    int n = 0;
+    for (int y=y0; y<y1; y++)
+      for (int x=x0; x<x1; x++) {
+	vec4 &c = rtImage[ x + y * rtWidth ];
+	colours[3*n]   = c.x;
+	colours[3*n+1] = c.y;
+	colours[3*n+2] = c.z;
+	samples[n] = pixelSamples[ x + y * rtWidth ];
+	n++;
+      }
+
+    fwrite( &tiles[i], sizeof(int), 1, out );
+    fwrite( colours, sizeof(float), 3*n, out );
+    fwrite( samples, sizeof(int), n, out );
+  }
+
+  delete [] tiles;
+
+  bool ok = !ferror( out );
+  ok = (fclose( out ) == 0) && ok;
+
+#ifdef _WIN32
+  remove( filename );		// rename() won't replace a file
+#endif
+
+  if (!ok || rename( tmpName.c_str(), filename ) != 0) {
+    cerr << "Could not write checkpoint " << filename << endl;
+    remove( tmpName.c_str() );
+    return false;
+  }
+
+  numTilesCheckpointed = numTiles;
+
+  return true;
+}
+
+
+// Restore the tiles saved in a checkpoint into rtImage and publish
+// them as finished, setting restored[] for each.  A checkpoint of
+// other settings is ignored, and one cut short gives the tiles before
+// the cut.
+//
+// Return false if nothing could be restored.
+
+bool Scene::readCheckpoint( const char *filename, bool *restored )
+
+{
+  FILE *in = fopen( filename, "rb" );
+  if (in == NULL) {
+    cout << "No checkpoint " << filename << "; starting from the beginning." << endl;
+    return false;
+  }
+
+  char magic[ sizeof(CHECKPOINT_MAGIC) ];
+  int  keyLength, numTiles;
+  bool ok;
+
+  int magicLength = strlen( CHECKPOINT_MAGIC );
+
+  ok = (fread( magic, 1, magicLength, in ) == (size_t) magicLength && memcmp( magic, CHECKPOINT_MAGIC, magicLength ) == 0 &&
+	fread( &keyLength, sizeof(int), 1, in ) == 1 && keyLength >= 0 && keyLength <= CHECKPOINT_MAX_KEY);
+
+  string fileKey( ok ? keyLength : 0, ' ' );
+
+  if (!ok ||
+      (keyLength > 0 && fread( &fileKey[0], 1, keyLength, in ) != (size_t) keyLength) ||
+      fread( &numTiles, sizeof(int), 1, in ) != 1) {
+    cerr << filename << " is not a checkpoint; starting from the beginning." << endl;
+    fclose( in );
+    return false;
+  }
+
+  if (fileKey != rtCheckpointKey) {
+    cerr << "Checkpoint " << filename << " is of another scene or other settings; starting from the beginning." << endl;
+    reportKeyDifferences( rtCheckpointKey, fileKey );
+    fclose( in );
+    return false;
+  }
+
+  float colours[ 3 * TILE_SIZE * TILE_SIZE ];
+  int   samples[ TILE_SIZE * TILE_SIZE ];
+  int   numRestored = 0;
+
+  for (int i=0; i<numTiles; i++) {
+
+    int tileIndex;
+
+    if (fread( &tileIndex, sizeof(int), 1, in ) != 1 ||
+	tileIndex < 0 || tileIndex >= numTilesX * numTilesY || restored[tileIndex])
+      break;
+
+    int x0, y0, x1, y1;
+    tileBounds( tileIndex, x0, y0, x1, y1 );
+
+    int n = (x1-x0) * (y1-y0);
+
+    if (fread( colours, sizeof(float), 3*n, in ) != (size_t) (3*n) ||
+	fread( samples, sizeof(int), n, in ) != (size_t) n)
+      break;
+
+    long long tileSamples = 0;
+
+    n = 0;
+    for (int y=y0; y<y1; y++)
+      for (int x=x0; x<x1; x++) {
+	rtImage[ x + y * rtWidth ] = vec4( colours[3*n], colours[3*n+1], colours[3*n+2], 1 ); // opaque
+	pixelSamples[ x + y * rtWidth ] = samples[n];
+	tileSamples += samples[n];
+	n++;
+      }
+
+    if (adaptive)
+      samplesTraced += tileSamples;
+
+    restored[tileIndex] = true;
+
+    finishedTiles[ numTilesClaimed++ ].store( tileIndex, std::memory_order_release );
+    numTilesDone++;
+
+    numRestored++;
+  }
+
+  fclose( in );
+
+  numTilesCheckpointed = numRestored;
+
+  cout << "Resumed " << numRestored << " of " << numTilesX * numTilesY << " tiles from " << filename << endl;
+
+  return (numRestored > 0);
+}
+
+
+// Pixels [x0,x1) x [y0,y1) of a tile.  Tiles are numbered
+// column-by-column, as pixels used to be traced.
+
+void Scene::tileBounds( int tileIndex, int &x0, int &y0, int &x1, int &y1 )
+
+{
+  x0 = (tileIndex / numTilesY) * TILE_SIZE;
+  y0 = (tileIndex % numTilesY) * TILE_SIZE;
+
+  x1 = (x0+TILE_SIZE < rtWidth  ? x0+TILE_SIZE : rtWidth);
+  y1 = (y0+TILE_SIZE < rtHeight ? y0+TILE_SIZE : rtHeight);
+}
+
+
+// Trace one tile of the RT image.  This is run by a threadPool worker.
+//
+// The tile is traced into a local buffer which is then copied into
+// rtImage and published in finishedTiles[] for the main thread to
+// show.  The tile is abandoned if rtGeneration changes (i.e. the RT
+// image has been restarted).
+
+void Scene::renderTile( int tileIndex, int generation )
+
+{
+  int x0, y0, x1, y1;
+
+  tileBounds( tileIndex, x0, y0, x1, y1 );
+
+  vec4 tile[ TILE_SIZE * TILE_SIZE ];
+
+  if (adaptive) {
+
+    if (!renderTileAdaptive( x0, y0, x1, y1, tile, generation ))
+      return;
+
+  } else if (!usePackets)
+
+    for (int y=y0; y<y1; y++)
+      for (int x=x0; x<x1; x++) {
+
+	if (rtGeneration != generation)
+	  return;
+
+	double start = clockSeconds();
+
+	vec3 colour = pixelColour( x, y );
+	tile[ (x-x0) + (y-y0) * TILE_SIZE ] = vec4( colour.x, colour.y, colour.z, 1 ); // opaque
+
+	pixelTime[ x + y * rtWidth ] = clockSeconds() - start;
+      }
+
+  else {
+
+    // Trace the primary rays of each block of pixels in packets
+
+    int  block = packetBlockSize();
+    vec3 colours[ MAX_PACKET_RAYS ];
+
+    for (int by=y0; by<y1; by+=block)
+      for (int bx=x0; bx<x1; bx+=block) {
+
+	if (rtGeneration != generation)
+	  return;
+
+	int bx1 = (bx+block < x1 ? bx+block : x1);
+	int by1 = (by+block < y1 ? by+block : y1);
+
+	double start = clockSeconds();
+
+	renderBlock( bx, by, bx1, by1, colours );
+
+	// The pixels of a block are traced together, so they share its time
+
+	float time = (clockSeconds() - start) / ((bx1-bx) * (by1-by));
+
+	for (int y=by; y<by1; y++)
+	  for (int x=bx; x<bx1; x++) {
+	    vec3 &colour = colours[ (x-bx) + (y-by) * block ];
+	    tile[ (x-x0) + (y-y0) * TILE_SIZE ] = vec4( colour.x, colour.y, colour.z, 1 ); // opaque
+	    pixelTime[ x + y * rtWidth ] = time;
+	  }
+      }
+  }
+
+  if (rtGeneration != generation)
+    return;
+
+  for (int y=y0; y<y1; y++)
+    for (int x=x0; x<x1; x++) {
+      rtImage[ x + y * rtWidth ] = tile[ (x-x0) + (y-y0) * TILE_SIZE ];
+      if (!adaptive)
+	pixelSamples[ x + y * rtWidth ] = numPixelSamples * numPixelSamples;
+    }
+
+  // Publish it.  The release makes the pixels visible to the main
+  // thread before it sees the index.
+
+  finishedTiles[ numTilesClaimed++ ].store( tileIndex, std::memory_order_release );
+
+  numTilesDone++;
+}
+
+
+// Find the colours of the pixels [x0,x1) x [y0,y1) of a tile by
+// adaptive sampling.  Each pixel gets 'minSamples' samples, then more
+// in batches of 'minSamples' while the standard error of its mean
+// luminance is above 'adaptiveThreshold', up to 'maxSamples'.  Flat
+// regions stop after the first batch; edges, highlights, and soft
+// shadows are refined.
+//
+// A few samples can all land on the same side of an edge and show no
+// variance, so after the first pass a pixel is also refined if it
+// contrasts with a neighbour by more than ADAPTIVE_CONTRAST.  Only
+// neighbours in the same tile are compared: a neighbouring tile may or
+// may not be finished, and depending on that would make the image
+// depend on the tile schedule.  So an edge that lies along a tile
+// border, with no contrast inside either tile, isn't refined by this
+// test (the variance test still applies).
+//
+// Samples are at random points in the pixel.  The samples of each
+// pass are traced in packets, in scanline order over the tile.
+//
+// Returns false if the tile was cancelled.
+
+bool Scene::renderTileAdaptive( int x0, int y0, int x1, int y1, vec4 *tile, int generation )
+
+{
+  PixelStats stats[ TILE_SIZE * TILE_SIZE ];
+  bool       active[ TILE_SIZE * TILE_SIZE ];
+
+  for (int y=y0; y<y1; y++)
+    for (int x=x0; x<x1; x++) {
+
+      int i = (x-x0) + (y-y0) * TILE_SIZE;
+
+      if (x == debugPixel.x && y == debugPixel.y) { // traced on its own, as in renderBlock()
+	stats[i].add( pixelColour( x, y ) );
+	active[i] = false;
+      } else
+	active[i] = true;
+    }
+
+  RayPacket packet;
+  int       owner[ MAX_PACKET_RAYS ];	// index in 'stats' of each ray's pixel
+
+  packet.org = rayOrigin;
+
+  long long traced = 0;
+  bool      refine = true;
+
+  for (int pass=0; refine; pass++) {
+
+    if (rtGeneration != generation)
+      return false;
+
+    // Trace a batch of samples in each active pixel
+
+    for (int y=y0; y<y1; y++)
+      for (int x=x0; x<x1; x++) {
+
+	int i = (x-x0) + (y-y0) * TILE_SIZE;
+
+	if (!active[i])
+	  continue;
+
+	int batch = (stats[i].count + minSamples <= maxSamples ? minSamples : maxSamples - stats[i].count);
+	int first = stats[i].count; // index of the batch's first sample
+
+	for (int s=0; s<batch; s++) {
+
+	  Sampler::startSample( x, y, first + s );
+
+	  owner[ packet.numRays ] = i;
+	  packet.dir[ packet.numRays ] = (llCorner + (x+randIn01())*right + (y+randIn01())*up).normalize();
+	  packet.pixelX[ packet.numRays ] = x;
+	  packet.pixelY[ packet.numRays ] = y;
+	  packet.sampleIndex[ packet.numRays ] = first + s;
+	  packet.numRays++;
+
+	  if (packet.numRays == MAX_PACKET_RAYS) {
+	    traceSamples( packet, owner, stats );
+	    traced += packet.numRays;
+	    packet.numRays = 0;
+	  }
+	}
+      }
+
+    if (packet.numRays > 0) {
+      traceSamples( packet, owner, stats );
+      traced += packet.numRays;
+      packet.numRays = 0;
+    }
+
+    // Which pixels need more?
+
+    refine = false;
+
+    for (int y=y0; y<y1; y++)
+      for (int x=x0; x<x1; x++) {
+
+	int i = (x-x0) + (y-y0) * TILE_SIZE;
+
+	if (!active[i])
+	  continue;
+
+	if (stats[i].count >= maxSamples)
+	  active[i] = false;
+
+	else if (stats[i].meanVariance() <= adaptiveThreshold * adaptiveThreshold) {
+
+	  active[i] = false;
+
+	  if (pass == 0) {
+	    float lum = stats[i].meanLum();
+	    for (int k=0; k<4; k++) {
+	      int nx = x + (k==0) - (k==1);
+	      int ny = y + (k==2) - (k==3);
+	      if (nx >= x0 && nx < x1 && ny >= y0 && ny < y1 &&
+		  fabs( stats[ (nx-x0) + (ny-y0) * TILE_SIZE ].meanLum() - lum ) > ADAPTIVE_CONTRAST)
+		active[i] = true;
+	    }
+	  }
+	}
+
+	if (active[i])
+	  refine = true;
+      }
+  }
+
+  for (int y=y0; y<y1; y++)
+    for (int x=x0; x<x1; x++) {
+      int i = (x-x0) + (y-y0) * TILE_SIZE;
+      vec3 colour = stats[i].mean();
+      tile[i] = vec4( colour.x, colour.y, colour.z, 1 ); // opaque
+      pixelSamples[ x + y * rtWidth ] = stats[i].count;
+    }
+
+  samplesTraced += traced;
+
+  return true;
+}
+
+
+// Trace the rays of a packet and add each one's colour to the
+// statistics of its pixel, stats[owner[r]].  Each ray is charged an
+// equal share of the packet's time in pixelTime[].
+
+void Scene::traceSamples( RayPacket &packet, int *owner, PixelStats *stats )
+
+{
+  vec3 rayColours[ MAX_PACKET_RAYS ];
+
+  double start = clockSeconds();
+
+  if (usePackets)
+    tracePacket( packet, rayColours );
+  else {
+    perfCounters.add( PERF_PRIMARY_RAYS, packet.numRays );
+    for (int r=0; r<packet.numRays; r++) {
+      Sampler::startSample( packet.pixelX[r], packet.pixelY[r], packet.sampleIndex[r], PIXEL_DIMENSIONS );
+      rayColours[r] = raytrace( packet.org, packet.dir[r], 0, -1, -1, 1 );
+    }
+  }
+
+  float time = (clockSeconds() - start) / packet.numRays;
+
+  for (int r=0; r<packet.numRays; r++) {
+    stats[ owner[r] ].add( rayColours[r] );
+    pixelTime[ packet.pixelX[r] + packet.pixelY[r] * rtWidth ] += time;
+  }
+}
+
+
+// Width of the square blocks of pixels whose primary rays are traced
+// together: the largest power of two such that a block has at most
+// MAX_PACKET_RAYS rays.  With many samples per pixel, the block is a
+// single pixel and its rays are split over several packets.
+
+int Scene::packetBlockSize()
+
+{
+  int block = 1;
+
+  while (block < TILE_SIZE && (2*block) * (2*block) * numPixelSamples * numPixelSamples <= MAX_PACKET_RAYS)
+    block *= 2;
+
+  return block;
+}
+
+
+// Find the colours of pixels [x0,x1) x [y0,y1) by tracing their
+// primary rays in packets.  The samples are placed as in
+// pixelColour().  'colours' gets the pixels row by row with a stride
+// of packetBlockSize().
+
+void Scene::renderBlock( int x0, int y0, int x1, int y1, vec3 *colours )
+
+{
+  int block = packetBlockSize();
+
+  // The debug pixel is traced on its own so that its output isn't
+  // mixed with that of other rays
+
+  if (debugPixel.x >= x0 && debugPixel.x < x1 && debugPixel.y >= y0 && debugPixel.y < y1) {
+    for (int y=y0; y<y1; y++)
+      for (int x=x0; x<x1; x++)
+	colours[ (x-x0) + (y-y0) * block ] = pixelColour( x, y );
+    return;
+  }
+
+  for (int i=0; i<block*block; i++)
+    colours[i] = vec3(0,0,0);
+
+  float weight = 1.0 / (numPixelSamples * numPixelSamples);
+
+  RayPacket packet;
+  int       owner[ MAX_PACKET_RAYS ];	// index in 'colours' of each ray's pixel
+  vec3      rayColours[ MAX_PACKET_RAYS ];
+
+  packet.org = rayOrigin;
+
+  for (int y=y0; y<y1; y++)
+    for (int x=x0; x<x1; x++)
+      for (int i = 0; i < numPixelSamples; i++)
+	for (int n = 0; n < numPixelSamples; n++) {
+
+	  Sampler::startSample( x, y, i * numPixelSamples + n );
+
+	  vec3 dir;
+	  if (jitter)
+	    dir = (llCorner + (x+1.0/numPixelSamples * (i + randIn01()))*right + (y+1.0/numPixelSamples * (n + randIn01()))*up).normalize();
+	  else
+	    dir = (llCorner + (x+randIn01())*right + (y+randIn01())*up).normalize(); // random point in pixel
+
+	  owner[ packet.numRays ] = (x-x0) + (y-y0) * block;
+	  packet.dir[ packet.numRays ] = dir;
+	  packet.pixelX[ packet.numRays ] = x;
+	  packet.pixelY[ packet.numRays ] = y;
+	  packet.sampleIndex[ packet.numRays ] = i * numPixelSamples + n;
+	  packet.numRays++;
+
+	  if (packet.numRays == MAX_PACKET_RAYS) {
+	    tracePacket( packet, rayColours );
+	    for (int r=0; r<packet.numRays; r++)
+	      colours[ owner[r] ] = colours[ owner[r] ] + weight * rayColours[r];
+	    packet.numRays = 0;
+	  }
+	}
+
+  if (packet.numRays > 0) {
+    tracePacket( packet, rayColours );
+    for (int r=0; r<packet.numRays; r++)
+      colours[ owner[r] ] = colours[ owner[r] ] + weight * rayColours[r];
+  }
+}
+
+
+// Find the closest intersections of a packet of primary rays, then
+// shade each ray and return its colour in rayColours[].  A packet
+// whose rays are not coherent is traced one ray at a time.
+
+void Scene::tracePacket( RayPacket &packet, vec3 *rayColours )
+
+{
+  perfCounters.add( PERF_PRIMARY_RAYS, packet.numRays );
+
+  if (packet.setup())
+    objectBVH.packetInt( packet );
+  else
+    for (int r=0; r<packet.numRays; r++)
+      packet.hit[r] = findFirstObjectInt( packet.org, packet.dir[r], -1, -1,
+					  packet.P[r], packet.N[r], packet.T[r], packet.t[r],
+					  packet.objIndex[r], packet.objPartIndex[r], packet.mat[r], -1 );
+
+  for (int r=0; r<packet.numRays; r++) {
+
+    // Resume the ray's sample where placing it in its pixel left off
+
+    Sampler::startSample( packet.pixelX[r], packet.pixelY[r], packet.sampleIndex[r], PIXEL_DIMENSIONS );
+
+    if (maxDepth < 1)
+      rayColours[r] = blackColour;
+    else if (integrator == PATH_INTEGRATOR)
+      rayColours[r] = pathShade( packet.org, packet.dir[r], packet.hit[r], packet.P[r], packet.N[r], packet.T[r],
+				 packet.objIndex[r], packet.objPartIndex[r], packet.mat[r] );
+    else
+      rayColours[r] = shade( packet.org, packet.dir[r], 1, -1, packet.hit[r], packet.P[r], packet.N[r], packet.T[r],
+			     packet.objIndex[r], packet.objPartIndex[r], packet.mat[r], 1 );
+  }
+}
+
+
+
+// Stop tracing the current RT image and wait for the workers to
+// finish any tiles they have already started.
+
+void Scene::cancelRT()
+
+{
+  rtGeneration++;
+  threadPool->wait( rtTasks );
+}
+
+
+
+// Render the scene with OpenGL
+
+
+void Scene::renderGL( mat4 &WCS_to_VCS, mat4 &VCS_to_CCS )
+
+{
+  // create axes and glverts here so that they are not created before
+  // the window is initialized
+
+  if (axes == NULL)
+    axes = new Axes();
+
+  if (glverts == NULL)
+    glverts = new GLVerts();
+  
+  // Set up the framebuffer
+ 
+  glEnable( GL_DEPTH_TEST );
   glClearColor( backgroundColour.x, backgroundColour.y, backgroundColour.z, 0 );
   glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
 
@@ -869,15 +2167,17 @@ void Scene::showPixelZoom( vec2 mouse )
     texPos + vec2(  texRadius.x,  texRadius.y )
   };
     
-  GLuint VAO, VBO;
+  // The VAO and VBO are kept between calls; only the vertices change
 
-  glGenVertexArrays( 1, &VAO );
-  glBindVertexArray( VAO );
+  if (zoomVAO == 0) {
+    glGenVertexArrays( 1, &zoomVAO );
+    glGenBuffers( 1, &zoomVBO );
+  }
 
-  glGenBuffers( 1, &VBO );
-  glBindBuffer( GL_ARRAY_BUFFER, VBO );
+  glBindVertexArray( zoomVAO );
+  glBindBuffer( GL_ARRAY_BUFFER, zoomVBO );
 
-  glBufferData( GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW );
+  glBufferData( GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STREAM_DRAW );
 
   glEnableVertexAttribArray( 0 );
   glVertexAttribPointer( 0, 2, GL_FLOAT, GL_FALSE, 0, 0 );
@@ -908,7 +2208,7 @@ void Scene::showPixelZoom( vec2 mouse )
     winPos + vec2( -winRadius.x,  winRadius.y )
   };
     
-  glBufferData( GL_ARRAY_BUFFER, sizeof(lineverts), lineverts, GL_STATIC_DRAW );
+  glBufferData( GL_ARRAY_BUFFER, sizeof(lineverts), lineverts, GL_STREAM_DRAW );
 
   glEnableVertexAttribArray( 0 );
   glVertexAttribPointer( 0, 2, GL_FLOAT, GL_FALSE, 0, 0 );
@@ -926,9 +2226,7 @@ void Scene::showPixelZoom( vec2 mouse )
   gpu->deactivate();
   glEnable( GL_DEPTH_TEST );
 
-  glDeleteBuffers( 1, &VBO );
-  glDeleteVertexArrays( 1, &VAO );
-
+  glBindVertexArray( 0 );
   glBindTexture( GL_TEXTURE_2D, 0 );
 }
 
@@ -945,41 +2243,38 @@ void Scene::drawRTImage()
     gpu->init( vertShader, fragShader );
   }
 
-  // Send texture to GPU
-
-  if (rtImageTexID == 0)
-    glGenTextures( 1, &rtImageTexID );
+  // Send new tiles to the GPU
 
   glActiveTexture( GL_TEXTURE1 );
-  glBindTexture( GL_TEXTURE_2D, rtImageTexID );
 
-  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
-  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+  uploadFinishedTiles();
 
-  glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA, win->windowWidth, win->windowHeight, 0, GL_RGBA, GL_FLOAT, rtImage );
+  // Draw texture on a full-screen quad.  The quad never changes, so
+  // it's set up once.
 
-  // Draw texture on a full-screen quad
+  if (rtQuadVAO == 0) {
 
-  vec2 verts[8] = {
-    vec2( -1, -1 ), vec2( -1, 1 ), vec2( 1, -1 ), vec2( 1, 1 ), // positions
-    vec2(  0,  0 ), vec2(  0, 1 ), vec2( 1,  0 ), vec2( 1, 1 )  // texture coordinates
-  };
-    
-  GLuint VAO, VBO;
+    vec2 verts[8] = {
+      vec2( -1, -1 ), vec2( -1, 1 ), vec2( 1, -1 ), vec2( 1, 1 ), // positions
+      vec2(  0,  0 ), vec2(  0, 1 ), vec2( 1,  0 ), vec2( 1, 1 )  // texture coordinates
+    };
 
-  glGenVertexArrays( 1, &VAO );
-  glBindVertexArray( VAO );
+    glGenVertexArrays( 1, &rtQuadVAO );
+    glBindVertexArray( rtQuadVAO );
 
-  glGenBuffers( 1, &VBO );
-  glBindBuffer( GL_ARRAY_BUFFER, VBO );
+    glGenBuffers( 1, &rtQuadVBO );
+    glBindBuffer( GL_ARRAY_BUFFER, rtQuadVBO );
 
-  glBufferData( GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW );
+    glBufferData( GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW );
 
-  glEnableVertexAttribArray( 0 );
-  glVertexAttribPointer( 0, 2, GL_FLOAT, GL_FALSE, 0, 0 );
+    glEnableVertexAttribArray( 0 );
+    glVertexAttribPointer( 0, 2, GL_FLOAT, GL_FALSE, 0, 0 );
 
-  glEnableVertexAttribArray( 1 );
-  glVertexAttribPointer( 1, 2, GL_FLOAT, GL_FALSE, 0, (void*) (sizeof(vec2)*4) );
+    glEnableVertexAttribArray( 1 );
+    glVertexAttribPointer( 1, 2, GL_FLOAT, GL_FALSE, 0, (void*) (sizeof(vec2)*4) );
+  }
+
+  glBindVertexArray( rtQuadVAO );
 
   glDisable( GL_DEPTH_TEST );
   glEnable( GL_BLEND );
@@ -994,13 +2289,153 @@ void Scene::drawRTImage()
   glDisable( GL_BLEND );
   glEnable( GL_DEPTH_TEST );
 
-  glDeleteBuffers( 1, &VBO );
-  glDeleteVertexArrays( 1, &VAO );
-
+  glBindVertexArray( 0 );
   glBindTexture( GL_TEXTURE_2D, 0 );
 }
 
 
+// Convert to a 16-bit float, rounding to nearest.  Values too small
+// for a normalized half become 0 and values too large become the
+// largest half.  That's plenty for display: the fragment shader works
+// in mediump anyway.
+
+static unsigned short floatToHalf( float f )
+
+{
+  unsigned int x;
+  memcpy( &x, &f, sizeof(x) );
+
+  unsigned int sign = (x >> 16) & 0x8000;
+  int          exp  = (int) ((x >> 23) & 0xff) - 127 + 15;
+  unsigned int mant = x & 0x7fffff;
+
+  if (((x >> 23) & 0xff) == 0xff && mant != 0)
+    return sign | 0x7e00;	// NaN
+
+  if (exp <= 0)
+    return sign;
+
+  if (exp >= 31)
+    return sign | 0x7bff;
+
+  unsigned int h    = sign | (exp << 10) | (mant >> 13);
+  unsigned int rest = mant & 0x1fff;
+
+  if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+    h++;			// a carry into the exponent is still correct
+
+  return h;
+}
+
+
+// Send the tiles published since the last call to rtImageTexID, which
+// must be on the active texture unit.  Tiles are converted to half
+// floats (a quarter of the bytes of rtImage's floats) and packed,
+// one after another, into a pixel buffer of the ring.  Each
+// glTexSubImage2D then copies from that buffer, so it doesn't wait
+// for the transfer, and the next call fills a different buffer rather
+// than waiting for the GPU to finish reading this one.
+//
+// Stop at a slot of finishedTiles[] that has been claimed but not yet
+// published; it'll be sent next time.
+
+void Scene::uploadFinishedTiles()
+
+{
+  if (rtImageTexID == 0) {
+    glGenTextures( 1, &rtImageTexID );
+    glBindTexture( GL_TEXTURE_2D, rtImageTexID );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+    glGenBuffers( RT_UPLOAD_PBOS, uploadPBOs );
+  } else
+    glBindTexture( GL_TEXTURE_2D, rtImageTexID );
+
+  // A new image starts transparent.  (rtImage can't be sent, as the
+  // workers are writing into it.)
+
+  if (rtTexStale) {
+    unsigned short *clear = new unsigned short[ 4 * rtWidth * rtHeight ];
+    memset( clear, 0, 4 * rtWidth * rtHeight * sizeof(unsigned short) ); // 0 is +0.0 as a half
+    glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA16F, rtWidth, rtHeight, 0, GL_RGBA, GL_HALF_FLOAT, clear );
+    delete [] clear;
+    numTilesShown = 0;
+    rtTexStale = false;
+  }
+
+  // Which tiles are ready?
+
+  int first = numTilesShown;
+  int last  = first;
+
+  while (last < numTilesClaimed && finishedTiles[last].load( std::memory_order_acquire ) >= 0)
+    last++;
+
+  if (last == first)
+    return;
+
+  // Fill the next pixel buffer of the ring, growing it if needed.
+  // Mapping with INVALIDATE lets the driver hand over fresh memory if
+  // the GPU is still reading the old contents.
+
+  GLuint     pbo   = uploadPBOs[ nextUploadPBO ];
+  GLsizeiptr bytes = (GLsizeiptr) (last-first) * TILE_SIZE * TILE_SIZE * 4 * sizeof(unsigned short);
+
+  glBindBuffer( GL_PIXEL_UNPACK_BUFFER, pbo );
+
+  if (uploadPBOSizes[ nextUploadPBO ] < bytes) {
+    glBufferData( GL_PIXEL_UNPACK_BUFFER, bytes, NULL, GL_STREAM_DRAW );
+    uploadPBOSizes[ nextUploadPBO ] = bytes;
+  }
+
+  unsigned short *halves = (unsigned short *) glMapBufferRange( GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT );
+
+  if (halves == NULL) {
+    glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+    return;			// try again next time
+  }
+
+  unsigned short *p = halves;
+
+  for (int i=first; i<last; i++) {
+
+    int x0, y0, x1, y1;
+    tileBounds( finishedTiles[i], x0, y0, x1, y1 );
+
+    for (int y=y0; y<y1; y++)
+      for (int x=x0; x<x1; x++) {
+	vec4 &c = rtImage[ x + y * rtWidth ];
+	*p++ = floatToHalf( c.x );
+	*p++ = floatToHalf( c.y );
+	*p++ = floatToHalf( c.z );
+	*p++ = floatToHalf( c.w );
+      }
+  }
+
+  glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER );
+
+  // Copy each tile from the pixel buffer into the texture.  With a
+  // buffer bound, the last argument is an offset into it.
+
+  size_t offset = 0;
+
+  for (int i=first; i<last; i++) {
+
+    int x0, y0, x1, y1;
+    tileBounds( finishedTiles[i], x0, y0, x1, y1 );
+
+    glTexSubImage2D( GL_TEXTURE_2D, 0, x0, y0, x1-x0, y1-y0, GL_RGBA, GL_HALF_FLOAT, (void *) offset );
+
+    offset += (x1-x0) * (y1-y0) * 4 * sizeof(unsigned short);
+  }
+
+  glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+
+  nextUploadPBO = (nextUploadPBO+1) % RT_UPLOAD_PBOS;
+  numTilesShown = last;
+}
+
+
 
 char *Scene::vertShader = "\n\
 \n\
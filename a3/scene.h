@@ -9,7 +9,16 @@
 class RTwindow;
 
 
+#define NUM_EMITTER_SHADOW_RAYS 50 // default for Scene::emitterShadowRays
+#define RT_UPLOAD_PBOS 3	   // pixel buffers in the ring through which tiles go to rtImageTexID
+#define CHECKPOINT_INTERVAL 60	   // default seconds between checkpoints of a headless render
+
+
+enum Integrator { WHITTED_INTEGRATOR, PATH_INTEGRATOR };
+
+
 #include <iostream>
+#include <string>
 #include "seq.h"
 #include "linalg.h"
 #include "object.h"
@@ -19,6 +28,72 @@ class RTwindow;
 #include "axes.h"
 #include "glverts.h"
 #include "arrow.h"
+#include "threadPool.h"
+#include "objectBVH.h"
+#include "triangle.h"
+#include "packet.h"
+
+
+// An emitting triangle, with what's needed to choose among emitters
+// at a shading point
+
+class Emitter {
+
+ public:
+
+  Triangle *tri;
+  int       objIndex;		// index in Scene::objects
+  vec3      Ie;			// emission
+  float     radiance;		// average of Ie's components
+  float     area;
+  vec3      centroid;
+};
+
+
+// Running statistics of the samples of one pixel, for adaptive
+// sampling
+
+class PixelStats {
+
+ public:
+
+  vec3  sum;
+  float lumSum, lumSumSq;	// of the samples' luminance
+  int   count;
+
+  PixelStats() {
+    sum = vec3(0,0,0);
+    lumSum = lumSumSq = 0;
+    count = 0;
+  }
+
+  void add( vec3 c ) {
+    float lum = (c.x + c.y + c.z) / 3.0;
+    sum = sum + c;
+    lumSum += lum;
+    lumSumSq += lum * lum;
+    count++;
+  }
+
+  vec3 mean() {
+    return (count > 0 ? (1.0/count) * sum : vec3(0,0,0));
+  }
+
+  float meanLum() {
+    return (count > 0 ? lumSum / count : 0);
+  }
+
+  // Estimated variance of the mean luminance (the squared standard
+  // error), from the sample variance
+
+  float meanVariance() {
+    if (count < 2)
+      return FLT_MAX;
+    float m = lumSum / count;
+    float var = (lumSumSq - count * m * m) / (count - 1);
+    return (var > 0 ? var : 0) / count;
+  }
+};
 
 
 class Scene {
@@ -28,10 +103,13 @@ class Scene {
   Eye *         eye;		// viewpoint
   seq<Light *>  lights;		// all lights
   seq<Object *> objects;	// all objects
+  seq<Emitter>  emitters;	// emitting triangles among 'objects'
+  ObjectBVH     objectBVH;	// top-level BVH over 'objects'
 
   vec3        Ia;		// ambient illumination
 
   vec3  llCorner, up, right;	// window parameters
+  vec3  rayOrigin;		// eye position when the RT image was started
 
   seq<vec3> storedPoints;
 
@@ -42,6 +120,60 @@ class Scene {
 
   GLuint rtImageTexID;
   vec4 *rtImage;		// texture storing the raytraced image
+  int   rtWidth, rtHeight;	// dimensions of rtImage
+
+  GLuint     rtQuadVAO, rtQuadVBO;	      // full-screen quad showing rtImageTexID
+  GLuint     zoomVAO, zoomVBO;		      // quad of showPixelZoom()
+  GLuint     uploadPBOs[RT_UPLOAD_PBOS];      // ring of pixel buffers holding half-float tiles on their way to rtImageTexID
+  GLsizeiptr uploadPBOSizes[RT_UPLOAD_PBOS];
+  int        nextUploadPBO;
+
+  void uploadFinishedTiles();
+
+  // Tiles of the rtImage are traced in parallel by the threadPool.
+  // A worker writes a finished tile straight into rtImage, then
+  // publishes its index in finishedTiles[], in order of finishing.
+  // The main thread uploads each published tile to rtImageTexID, and
+  // never reads a tile that isn't published, so no lock is needed.
+
+  TaskGroup         rtTasks;	    // tiles being traced
+  std::atomic<int>  rtGeneration;   // incremented to cancel the tiles in progress
+  std::atomic<int>  numTilesDone;   // tiles published
+  std::atomic<int>  numTilesClaimed; // slots of finishedTiles[] taken (some maybe not yet published)
+  std::atomic<int> *finishedTiles;  // tile indices, or -1 in a slot not yet published
+  int               numTilesShown;  // finishedTiles[] entries uploaded to rtImageTexID
+  bool              rtTexStale;	    // rtImageTexID is of a previous image
+  int               numTilesX, numTilesY;
+
+  // Performance of the current RT image.  The ray and BVH counts are
+  // in perfCounters.
+
+  float *pixelTime;		// seconds spent tracing each pixel of rtImage
+  int   *pixelSamples;		// samples traced in each pixel of rtImage
+  double  rtStartTime;		// clockSeconds() when the image was started
+  double  rtSeconds;		// to trace the whole image, or -1 while tracing
+
+  vec3 glossyDirection( vec3 &R, float g );
+  vec3 directLight( vec3 &P, vec3 &N, vec3 &E, vec3 &kd, Material *mat, int objIndex, int objPartIndex );
+  void buildEmitters();
+  vec3 emitterLight( vec3 &P, vec3 &N, vec3 &E, vec3 &kd, Material *mat, int objIndex, int objPartIndex );
+
+  void tileBounds( int tileIndex, int &x0, int &y0, int &x1, int &y1 );
+  void renderTile( int tileIndex, int generation );
+  bool renderTileAdaptive( int x0, int y0, int x1, int y1, vec4 *tile, int generation );
+  void traceSamples( RayPacket &packet, int *owner, PixelStats *stats );
+  int  packetBlockSize();
+  void renderBlock( int x0, int y0, int x1, int y1, vec3 *colours );
+  void tracePacket( RayPacket &packet, vec3 *rayColours );
+  void setupCamera( int width, int height );
+  void startTiles( const char *resumeFrom = NULL );
+
+  // Checkpoints of a headless render
+
+  int  numTilesCheckpointed;	// finished tiles in the last checkpoint written or read
+  std::string rtCheckpointKey;	// of the current RT image; see checkpointKey()
+  void checkpointKey( std::string &key );
+  bool readCheckpoint( const char *filename, bool *restored );
   static char *vertShader, *fragShader;
   GPUProgram *gpu;
 
@@ -52,7 +184,9 @@ class Scene {
 
   bool stop; // RT stopped
 
-  bool storingRays;
+  static thread_local bool storingRays; // store rays traced by *this thread*
+  static thread_local seq<ObjectBVH_occluder> lastOccluders; // of *this thread's* shadow rays, per light then per emitting object
+  static thread_local seq<float> emitterCDF; // *this thread's* cumulative emitter weights at the current shading point
   seq<vec3> storedRays;	// each pair of points is a ray
   seq<vec3> storedRayColours;
 
@@ -64,8 +198,22 @@ class Scene {
   bool showAxes;
   bool showObjects;
   bool jitter;
+  bool usePackets;		// trace primary rays in packets
+  int emitterShadowRays;	// shadow rays to emitting triangles per shading point (shared among them)
+  bool adaptive;		// adaptive sampling instead of numPixelSamples x numPixelSamples
+  int minSamples;		// adaptive: first batch, and each later batch, of samples per pixel
+  int maxSamples;		// adaptive: max samples per pixel
+  float adaptiveThreshold;	// adaptive: refine while the std error of a pixel's luminance is above this
+  float rayCutoff;		// secondary rays of lower weight are pruned by Russian roulette (0 = never)
+  Integrator integrator;	// Whitted-style ray tree, or one path per sample
+  std::atomic<long long> samplesTraced; // adaptive: primary rays traced for the current RT image
+  const char *perfOutput;	// base name of the heatmap and JSON summary written after each RT image, or NULL
+  const char *checkpointFile;	// headless: finished tiles are saved here every checkpointInterval seconds, or NULL
+  float checkpointInterval;
+  bool resume;			// headless: start from the tiles in checkpointFile
+  const char *worldFile;	// path of the world that was read
   int numPixelSamples;
-  bool debug;
+  static thread_local bool debug;
   vec2 debugPixel;
 
   float sceneScale; // max dimension of scene's bounding box (used to scale the debbugging arrows)
@@ -74,6 +222,8 @@ class Scene {
   GLVerts *glverts; 		// draw some verts
 
   Scene() {
+    win = NULL;
+    eye = NULL;
     Ia = vec3(0.1,0.1,0.1);
     maxDepth = 8;
     glossyIterations = 6;
@@ -83,12 +233,50 @@ class Scene {
     showObjects = true;
     rtImage = NULL;
     rtImageTexID = 0;
+    rtQuadVAO = 0;
+    rtQuadVBO = 0;
+    zoomVAO = 0;
+    zoomVBO = 0;
+    for (int i=0; i<RT_UPLOAD_PBOS; i++) {
+      uploadPBOs[i] = 0;
+      uploadPBOSizes[i] = 0;
+    }
+    nextUploadPBO = 0;
+    rtWidth = 0;
+    rtHeight = 0;
+    rtGeneration = 0;
+    numTilesDone = 0;
+    numTilesClaimed = 0;
+    finishedTiles = NULL;
+    numTilesShown = 0;
+    rtTexStale = true;
+    numTilesX = 0;
+    numTilesY = 0;
+    pixelTime = NULL;
+    pixelSamples = NULL;
+    numTilesCheckpointed = 0;
+    rtStartTime = 0;
+    rtSeconds = -1;
+    perfOutput = NULL;
+    checkpointFile = NULL;
+    checkpointInterval = CHECKPOINT_INTERVAL;
+    resume = false;
+    worldFile = NULL;
     gpu = NULL;
     axes = NULL;
     glverts = NULL;
     arrow = NULL;
     stop = false;
     jitter = false;
+    usePackets = true;
+    emitterShadowRays = NUM_EMITTER_SHADOW_RAYS;
+    adaptive = false;
+    minSamples = 8;
+    maxSamples = 64;
+    adaptiveThreshold = 0.01;
+    samplesTraced = 0;
+    rayCutoff = 0.01;
+    integrator = WHITTED_INTEGRATOR;
     numPixelSamples = 1;
     debug = false;
     debugPixel = vec2(-1,-1);
@@ -99,23 +287,40 @@ class Scene {
     { win = w; }
 
   void renderRT( bool restart );
+  void renderHeadless( int width, int height );
+  void cancelRT();
+  bool writeImage( const char *filename );
+  bool writePerfStats( const char *basename );
+  bool writeCheckpoint( const char *filename );
+  double renderSeconds();
+  vec4 *image() { return rtImage; } // RT image, rows bottom-to-top (NULL before the first)
   void renderGL( mat4 &WCS_to_VCS, mat4 &VCS_to_CCS );
   void draw_RT_and_GL( GPUProgram *gpuProg, mat4 &WCS_to_VCS, mat4 &VCS_to_CCS );
   void showPixelZoom( vec2 mouse );
   void read( const char *basename, istream &in );
   void write( ostream &out );
   vec3 pixelColour( int x, int y );
-  vec3 raytrace( vec3 &rayStart, vec3 &rayDir, int depth, int thisObjIndex, int thisObjPartIndex );
+  vec3 raytrace( vec3 &rayStart, vec3 &rayDir, int depth, int thisObjIndex, int thisObjPartIndex, float weight );
+  vec3 shade( vec3 &rayStart, vec3 &rayDir, int depth, int thisObjIndex,
+	      bool hit, vec3 &P, vec3 &N, vec3 &texcoords, int objIndex, int objPartIndex, Material *mat, float weight );
+  float traceWeight( float &rayWeight );
+  vec3 pathShade( vec3 &rayStart, vec3 &rayDir,
+		  bool hit, vec3 &P, vec3 &N, vec3 &texcoords, int objIndex, int objPartIndex, Material *mat );
   vec3 calcIout( vec3 N, vec3 L, vec3 E, vec3 R,
 		   vec3 Kd, vec3 Ks, float ns, vec3 In );
   bool findFirstObjectInt( vec3 rayStart, vec3 rayDir, int thisObjIndex, int thisObjPartIndex, 
 			   vec3 &P, vec3 &N, vec3 &T, float &param, int &objIndex, int &objPartIndex, Material *&mat, int lightIndex );
 
+  bool occluded( vec3 rayStart, vec3 rayDir, int thisObjIndex, int thisObjPartIndex, float maxParam, int cacheIndex, int lightIndex );
+
   bool findRefractionDirection( vec3 &rayDir, vec3 &N, vec3 &refractionDir );
 
   void outputEye()
     { cout << *eye << endl; }
 
+  Eye *getEye()
+    { return eye; }
+
   void drawStoredRays( GPUProgram *gpuProg, mat4 &WCS_to_VCS, mat4 &VCS_to_CCS );
   void drawRTImage();
   char *statusMessage();
@@ -38,6 +38,12 @@ bool Sphere::rayInt( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxPara
 
   intParam = (t0 < t1 ? t0 : t1);
 
+  if (intParam < 0)		// near point is behind the start, so try the far point
+    intParam = (t0 < t1 ? t1 : t0);
+
+  if (intParam < 0)
+    return false; // sphere is behind starting point
+
   if (intParam > maxParam)
     return false; // too far away
 
@@ -55,6 +61,36 @@ bool Sphere::rayInt( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxPara
 }
 
 
+// Does the sphere block the ray?  As rayInt(), but without the
+// point, normal, and material.
+
+bool Sphere::occluded( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam, int &occluderPart )
+
+{
+  vec3 s = rayStart - centre;
+
+  float a = rayDir * rayDir;
+  float b = 2 * (rayDir * s);
+  float c = s * s - radius * radius;
+
+  float d = b*b - 4*a*c;
+
+  if (d < 0)
+    return false;
+
+  d = sqrt(d);
+
+  float tNear = (-b - d) / (2*a);	// a > 0, so tNear <= tFar
+  float tFar  = (-b + d) / (2*a);
+
+  float t = (tNear >= 0 ? tNear : tFar);
+
+  occluderPart = -1;
+
+  return (t >= 0 && t <= maxParam);
+}
+
+
 // Output a sphere
 
 void Sphere::output( ostream &stream ) const
@@ -36,6 +36,13 @@ class Sphere : public Object {
   bool rayInt( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam,
 	       vec3 &intPoint, vec3 &intNorm, vec3 &intTexCoords, float &intParam, Material * & mat, int &intPartIndex );
 
+  bool occluded( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam, int &occluderPart );
+
+  BBox bbox() {
+    vec3 r( radius, radius, radius );
+    return BBox( centre - r, centre + r );
+  }
+
   void input( istream &stream );
   void output( ostream &stream ) const;
   vec3 polarToCart( float phi, float theta );
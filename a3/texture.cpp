@@ -23,6 +23,7 @@
 using namespace std;
 
 bool Texture::useMipMaps = false;
+bool Texture::useOpenGL = true;
 
 
 /* Register the current texture with OpenGL, assigning
@@ -28,6 +28,7 @@ class Texture {
   GLuint textureID;		/* the OpenGL ID for this texture */
 
   static bool useMipMaps;
+  static bool useOpenGL;	/* false if there is no OpenGL context (headless) */
 
   char *name;			/* filename */
 
@@ -42,7 +43,8 @@ class Texture {
       texmap = readPNG( filename );
 #endif
     name = strdup( filename );
-    registerWithOpenGL();
+    if (useOpenGL)
+      registerWithOpenGL();
   }
 
   GLuint texID() {
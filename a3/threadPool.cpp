@@ -0,0 +1,170 @@
+/* threadPool.cpp
+ */
+
+
+#include "threadPool.h"
+
+
+thread_local int ThreadPool::thisWorker = -1;
+
+
+ThreadPool::ThreadPool( int numThreads )
+
+{
+  if (numThreads < 1)
+    numThreads = 1;
+
+  numWorkers   = numThreads;
+  numQueued    = 0;
+  nextQueue    = 0;
+  shuttingDown = false;
+
+  queues  = new WorkerQueue[ numWorkers ];
+  workers = new std::thread[ numWorkers ];
+
+  for (int i=0; i<numWorkers; i++)
+    workers[i] = std::thread( &ThreadPool::workerLoop, this, i );
+}
+
+
+ThreadPool::~ThreadPool()
+
+{
+  {
+    std::lock_guard<std::mutex> lock( sleepMutex );
+    shuttingDown = true;
+  }
+  wakeup.notify_all();
+
+  for (int i=0; i<numWorkers; i++)
+    workers[i].join();
+
+  delete [] workers;
+  delete [] queues;
+}
+
+
+// Number of threads to use if none is given on the command line
+
+int ThreadPool::defaultNumThreads()
+
+{
+  int n = std::thread::hardware_concurrency();
+  return (n > 0 ? n : 1);
+}
+
+
+// Add a task to the pool.  A worker pushes onto its own queue.  Any
+// other thread spreads its tasks over the queues round-robin.
+
+void ThreadPool::submit( TaskGroup &group, Task task )
+
+{
+  int index = thisWorker;
+  if (index < 0)
+    index = (nextQueue++) % numWorkers;
+
+  group.numPending++;
+
+  {
+    std::lock_guard<std::mutex> lock( queues[index].mutex );
+    PoolTask t;
+    t.task  = task;
+    t.group = &group;
+    queues[index].tasks.push_back( t );
+  }
+
+  numQueued++;
+
+  // Take the sleep lock so that a worker which has just found no work
+  // cannot miss this notification.
+
+  { std::lock_guard<std::mutex> lock( sleepMutex ); }
+  wakeup.notify_one();
+}
+
+
+// Find a task: first from the back of our own queue, then from the
+// front of the others.  'index' is -1 for threads outside the pool.
+
+bool ThreadPool::findTask( int index, PoolTask &t )
+
+{
+  if (numQueued == 0)
+    return false;
+
+  if (index >= 0) {
+    std::lock_guard<std::mutex> lock( queues[index].mutex );
+    if (!queues[index].tasks.empty()) {
+      t = queues[index].tasks.back();
+      queues[index].tasks.pop_back();
+      numQueued--;
+      return true;
+    }
+  }
+
+  int start = (index >= 0 ? index+1 : 0);
+
+  for (int i=0; i<numWorkers; i++) {
+    WorkerQueue &q = queues[ (start+i) % numWorkers ];
+    std::lock_guard<std::mutex> lock( q.mutex );
+    if (!q.tasks.empty()) {
+      t = q.tasks.front();
+      q.tasks.pop_front();
+      numQueued--;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+void ThreadPool::runTask( PoolTask &t )
+
+{
+  t.task();
+  t.group->numPending--;
+}
+
+
+void ThreadPool::workerLoop( int index )
+
+{
+  thisWorker = index;
+
+  while (true) {
+
+    PoolTask t;
+
+    if (findTask( index, t )) {
+      runTask( t );
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock( sleepMutex );
+
+    wakeup.wait( lock, [this] { return shuttingDown || numQueued > 0; } );
+
+    if (shuttingDown)
+      return;
+  }
+}
+
+
+// Wait for all tasks in a group to finish.  Run other tasks while
+// waiting.
+
+void ThreadPool::wait( TaskGroup &group )
+
+{
+  while (group.numPending > 0) {
+
+    PoolTask t;
+
+    if (findTask( thisWorker, t ))
+      runTask( t );
+    else
+      std::this_thread::yield();
+  }
+}
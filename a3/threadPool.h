@@ -0,0 +1,90 @@
+/* threadPool.h
+ *
+ * A pool of worker threads with work stealing.
+ *
+ * Each worker has its own deque of tasks.  A worker takes tasks from
+ * the BACK of its own deque (so nested tasks run depth-first) and,
+ * when its own deque is empty, steals tasks from the FRONT of another
+ * worker's deque.
+ *
+ * Tasks are submitted as part of a TaskGroup.  wait() on a group
+ * returns once all of the group's tasks have run.  The waiting thread
+ * runs other tasks while it waits, so tasks may themselves submit and
+ * wait for more tasks.
+ */
+
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <functional>
+
+
+typedef std::function<void()> Task;
+
+
+class TaskGroup {
+
+ public:
+
+  std::atomic<int> numPending;	// tasks submitted but not yet finished
+
+  TaskGroup() {
+    numPending = 0;
+  }
+};
+
+
+class ThreadPool {
+
+  class PoolTask {
+  public:
+    Task       task;
+    TaskGroup *group;
+  };
+
+  class WorkerQueue {
+  public:
+    std::mutex           mutex;
+    std::deque<PoolTask> tasks;
+  };
+
+  int            numWorkers;
+  std::thread   *workers;
+  WorkerQueue   *queues;
+
+  std::atomic<int>  numQueued;	// tasks sitting in any queue
+  std::atomic<int>  nextQueue;	// round-robin queue for submissions from outside the pool
+  std::mutex        sleepMutex;
+  std::condition_variable wakeup;
+  bool              shuttingDown;
+
+  static thread_local int thisWorker; // index of the current worker, or -1 outside the pool
+
+  void workerLoop( int index );
+  bool findTask( int index, PoolTask &t );
+  void runTask( PoolTask &t );
+
+ public:
+
+  ThreadPool( int numThreads );
+  ~ThreadPool();
+
+  int size() { return numWorkers; }
+
+  void submit( TaskGroup &group, Task task );
+  void wait( TaskGroup &group );
+
+  static int workerIndex() { return thisWorker; }
+
+  static int defaultNumThreads();
+};
+
+
+#endif
@@ -70,6 +70,30 @@ bool Triangle::rayInt( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxPa
 }
 
 
+// Does the triangle block the ray?  As rayInt(), but without the
+// normal and texture coordinates.
+
+bool Triangle::occluded( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam, int &occluderPart )
+
+{
+  float dn = rayDir * faceNormal;
+
+  if (fabs(dn) < 0.0001)
+    return false;		// ray is parallel to plane
+
+  float param = (dist - rayStart*faceNormal) / dn;
+
+  if (param < 0 || param > maxParam)
+    return false;
+
+  vec3 bc = barycentricCoords( rayStart + param * rayDir );
+
+  occluderPart = -1;
+
+  return (bc.x >= 0 && bc.y >= 0 && bc.z >= 0);
+}
+
+
 // Determine the texture colour at a point
 
 
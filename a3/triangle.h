@@ -27,6 +27,16 @@ class Triangle : public Object {
   bool rayInt( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam,
 	       vec3 &intPoint, vec3 &intNorm, vec3 &intTexCoords, float &intParam, Material *&mat, int &intPartIndex );
 
+  bool occluded( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam, int &occluderPart );
+
+  BBox bbox() {
+    BBox b;
+    b.makeEmpty();
+    for (int i=0; i<3; i++)
+      b.include( verts[i].position );
+    return b;
+  }
+
   void input( istream &stream );
   void output( ostream &stream ) const;
   void renderGL( GPUProgram *prog, mat4 &WCS_to_VCS, mat4 &VCS_to_CCS );
@@ -34,6 +44,7 @@ class Triangle : public Object {
   vec3 barycentricCoords( vec3 point );
   vec3 textureColour( vec3 &p, int objPartIndex, float &alpha, vec3 &texCoords );
   vec3 pointFromBarycentricCoords( float a, float b, float c );
+  vec3 vertexPosition( int i ) { return verts[i].position; }
 };
 
 #endif
@@ -127,6 +127,20 @@ class wfGroup {
 };
 
 
+/* The OpenGL vertices and face indices of a group, before they are
+ * given to OpenGL
+ */
+
+
+class wfGroupBuffers {
+ public:
+  GLfloat      *vertexBuffer;
+  GLuint       *faceIndexBuffer;
+  unsigned int  nVerts;
+  int           nFaces;
+};
+
+
 /* A model consisting of groups
  */
 
@@ -149,6 +163,8 @@ class wfModel {
   wfMaterial* findMaterial( char *name );            /* find a named material */
   wfGroup*    findGroup( char *name );               /* find a named group */
   void        readMaterialLibrary( char *filename ); /* read all materials */
+  void        parse( const char *filename );         /* read the OBJ file (in wavefrontParse.cpp) */
+  void        buildGroupBuffers( wfGroup *group, unsigned int vertexSize, wfGroupBuffers &buffers );
 
   int lineNum;
   unsigned int nFaces;
@@ -168,6 +184,8 @@ class wfModel {
 
   static bool newGroupWithNewMaterial; /* create a new group each time the material changes */
   static bool verticesAreCW;	       /* calculate opposite-to-usual face normals */
+  static bool useOpenGL;	       /* false if there is no OpenGL context (headless) */
+  static int  numReadThreads;	       /* threads to parse a file and build its VAOs (0 = one per core) */
 
   vec3 min, max;		/* extents */
 
@@ -182,7 +200,8 @@ class wfModel {
     pathname = mtllibname = NULL;
     objToWorldTransform = identity4();
     read( filename );
-    setupVAO( textureMode );
+    if (useOpenGL)
+      setupVAO( textureMode );
   }
 
   ~wfModel() {
@@ -0,0 +1,428 @@
+/* wavefrontCache.cpp
+ *
+ * Binary cache of a Wavefront object and its BVH.
+ *
+ * After an OBJ file is read and its BVH built, the results are written
+ * to a cache file next to it (e.g. worlds/cow.obj.cache).  The next
+ * time the OBJ is loaded, the cache is used instead if its header
+ * matches: the same format version and struct sizes, the same BVH
+ * builder options, and the same hash of the OBJ file's contents.
+ *
+ * The cache holds the vertices, normals, texture coordinates, and face
+ * normals, the groups and their triangles, and the flattened BVH with
+ * its reordered triangles.  It is mapped into memory and its arrays
+ * are copied out without parsing.  The wide BVH and the packed
+ * triangles are cheap to rebuild from the flattened BVH, so they are
+ * not stored, and the material library is read again, as it is small
+ * and may have changed.
+ */
+
+
+#include "headers.h"
+#include "wavefrontobj.h"
+#include "mappedFile.h"
+
+#include <chrono>
+
+#ifdef _WIN32
+  #include <process.h>
+  #define getpid _getpid
+#endif
+
+
+#define MESH_CACHE_VERSION 2
+#define MESH_CACHE_SUFFIX  ".cache"
+
+
+bool WavefrontObj::useCache = true;
+
+
+static const char meshCacheMagic[8] = { 'R', 'T', 'M', 'E', 'S', 'H', '\0', '\0' };
+
+
+class MeshCacheHeader {
+
+ public:
+
+  char          magic[8];
+  unsigned int  version;
+  unsigned int  structSizes[5];	// header, vec3, BVH_triangle, BVH_flatNode, wfTriangle
+
+  unsigned long long objHash;	// of the OBJ file's contents
+  unsigned long long objSize;
+
+  // Options that change the result
+
+  int           builder;
+  int           sahNumBins;
+  int           sahLeafSize;
+  float         sahCostRatio;
+  unsigned int  buildSeed;
+  int           verticesAreCW;
+  int           newGroupWithNewMaterial;
+
+  // wfModel
+
+  int           numVertices, numNormals, numTexcoords, numFacetnorms;
+  int           numGroups;
+  int           hasVertexNormals, hasVertexTexCoords;
+  float         objToWorldTransform[16];
+
+  // BVH
+
+  int           numTriangles;
+  int           numNodes;
+  int           stackSize;
+};
+
+
+
+// Fill in the parts of the header that a cache must match
+
+static void setKey( MeshCacheHeader &h, MappedFile &objFile )
+
+{
+  memset( &h, 0, sizeof(h) );
+
+  memcpy( h.magic, meshCacheMagic, sizeof(h.magic) );
+
+  h.version        = MESH_CACHE_VERSION;
+  h.structSizes[0] = sizeof(MeshCacheHeader);
+  h.structSizes[1] = sizeof(vec3);
+  h.structSizes[2] = sizeof(BVH_triangle);
+  h.structSizes[3] = sizeof(BVH_flatNode);
+  h.structSizes[4] = sizeof(wfTriangle);
+
+  h.objHash = objFile.hash();
+  h.objSize = objFile.size;
+
+  h.builder      = BVH::builder;
+  h.sahNumBins   = BVH::sahNumBins;
+  h.sahLeafSize  = BVH::sahLeafSize;
+  h.sahCostRatio = BVH::sahCostRatio;
+  h.buildSeed    = BVH::buildSeed;
+
+  h.verticesAreCW           = wfModel::verticesAreCW;
+  h.newGroupWithNewMaterial = wfModel::newGroupWithNewMaterial;
+}
+
+
+static bool sameKey( MeshCacheHeader &a, MeshCacheHeader &b )
+
+{
+  return (memcmp( a.magic, b.magic, sizeof(a.magic) ) == 0 &&
+	  a.version == b.version &&
+	  memcmp( a.structSizes, b.structSizes, sizeof(a.structSizes) ) == 0 &&
+	  a.objHash == b.objHash && a.objSize == b.objSize &&
+	  a.builder == b.builder && a.sahNumBins == b.sahNumBins && a.sahLeafSize == b.sahLeafSize &&
+	  a.sahCostRatio == b.sahCostRatio && a.buildSeed == b.buildSeed &&
+	  a.verticesAreCW == b.verticesAreCW && a.newGroupWithNewMaterial == b.newGroupWithNewMaterial);
+}
+
+
+
+// Reading and writing of the arrays that follow the header
+
+class CacheReader {
+
+ public:
+
+  char  *p, *end;
+  bool   ok;
+
+  CacheReader( char *data, size_t size ) {
+    p = data;
+    end = data + size;
+    ok = true;
+  }
+
+  void *take( size_t bytes ) {
+    if (!ok || (size_t) (end - p) < bytes) {
+      ok = false;
+      return NULL;
+    }
+    void *q = p;
+    p += bytes;
+    return q;
+  }
+
+  // Arrays follow strings, so they may be unaligned: copy with memcpy()
+
+  int readInt() {
+    int i = 0;
+    char *q = (char *) take( sizeof(int) );
+    if (q != NULL)
+      memcpy( &i, q, sizeof(int) );
+    return i;
+  }
+
+  template <class T> void readSeq( seq<T> &s, int n ) {
+    char *q = (char *) take( n * sizeof(T) );
+    if (q != NULL)
+      for (int i=0; i<n; i++) {
+	T t;
+	memcpy( &t, q + i * sizeof(T), sizeof(T) );
+	s.add( t );
+      }
+  }
+
+  char *readString() {
+    int len = readInt();
+    char *q = (char *) take( len );
+    if (q == NULL || len == 0)
+      return NULL;
+    char *s = new char[ len+1 ];
+    memcpy( s, q, len );
+    s[len] = '\0';
+    return s;
+  }
+};
+
+
+static void writeInt( FILE *f, int i )
+
+{
+  fwrite( &i, sizeof(int), 1, f );
+}
+
+
+template <class T> static void writeSeq( FILE *f, seq<T> &s )
+
+{
+  if (s.size() > 0)
+    fwrite( &s[0], sizeof(T), s.size(), f );
+}
+
+
+static void writeString( FILE *f, const char *s )
+
+{
+  int len = (s != NULL ? strlen(s) : 0);
+  writeInt( f, len );
+  fwrite( s, 1, len, f );
+}
+
+
+
+// Read the object and its BVH from the cache of 'filename'.  Returns
+// false, with nothing changed, if there is no matching cache.
+
+bool WavefrontObj::readCache( const char *filename )
+
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  MappedFile objFile, cacheFile;
+
+  if (!objFile.open( filename ))
+    return false;
+
+  char *cacheName = new char[ strlen(filename) + strlen(MESH_CACHE_SUFFIX) + 1 ];
+  sprintf( cacheName, "%s%s", filename, MESH_CACHE_SUFFIX );
+
+  bool opened = cacheFile.open( cacheName );
+  delete [] cacheName;
+
+  if (!opened || cacheFile.size < sizeof(MeshCacheHeader))
+    return false;
+
+  MeshCacheHeader key, h;
+
+  setKey( key, objFile );
+  memcpy( &h, cacheFile.data, sizeof(h) );
+
+  if (!sameKey( key, h ))
+    return false;
+
+  // Check that all of the arrays and groups are there before changing
+  // anything.  A truncated or corrupt cache is just ignored, and the
+  // OBJ is read again (which rewrites the cache).
+
+  if (h.numVertices < 0 || h.numNormals < 0 || h.numTexcoords < 0 || h.numFacetnorms < 0 ||
+      h.numGroups < 0 || h.numTriangles < 0 || h.numNodes < 0)
+    return false;
+
+  size_t arrays = ((size_t) h.numVertices + h.numNormals + h.numTexcoords + h.numFacetnorms) * sizeof(vec3)
+                  + (size_t) h.numTriangles * sizeof(BVH_triangle) + (size_t) h.numNodes * sizeof(BVH_flatNode);
+
+  if (cacheFile.size < sizeof(h) + arrays)
+    return false;
+
+  CacheReader in( cacheFile.data + sizeof(h), cacheFile.size - sizeof(h) );
+
+  CacheReader check = in;
+
+  check.take( arrays );
+  check.take( check.readInt() );	// material library name
+
+  for (int g=0; g<h.numGroups && check.ok; g++) {
+    check.take( check.readInt() );	// group name
+    check.take( check.readInt() );	// material name
+    int numTris = check.readInt();
+    if (numTris < 0)
+      return false;
+    check.take( (size_t) numTris * sizeof(wfTriangle) );
+  }
+
+  if (!check.ok) {
+    cerr << "Mesh cache for " << filename << " is truncated; reading the OBJ file instead." << endl;
+    return false;
+  }
+
+  // The model
+
+  obj->pathname = strdup( filename );
+  obj->hasVertexNormals   = h.hasVertexNormals;
+  obj->hasVertexTexCoords = h.hasVertexTexCoords;
+
+  for (int r=0; r<4; r++)
+    for (int c=0; c<4; c++)
+      obj->objToWorldTransform[r][c] = h.objToWorldTransform[ 4*r + c ];
+
+  in.readSeq( obj->vertices,   h.numVertices );
+  in.readSeq( obj->normals,    h.numNormals );
+  in.readSeq( obj->texcoords,  h.numTexcoords );
+  in.readSeq( obj->facetnorms, h.numFacetnorms );
+
+  // The BVH's triangles and nodes
+
+  in.readSeq( bvh.triangles, h.numTriangles );
+
+  BVH_flatNode *nodes = NULL;
+  if (h.numNodes > 0) {
+    nodes = new BVH_flatNode[ h.numNodes ];
+    memcpy( nodes, in.take( h.numNodes * sizeof(BVH_flatNode) ), h.numNodes * sizeof(BVH_flatNode) );
+  }
+
+  // Materials come from the material library, as when the OBJ is read
+
+  obj->materials.add( new wfMaterial( "default" ) );
+
+  obj->mtllibname = in.readString();
+  if (obj->mtllibname != NULL)
+    obj->readMaterialLibrary( obj->mtllibname );
+
+  // Groups, each with its material name and triangles
+
+  for (int g=0; g<h.numGroups && in.ok; g++) {
+
+    char *name    = in.readString();
+    char *matName = in.readString();
+    int   numTris = in.readInt();
+
+    wfGroup *group = new wfGroup( name != NULL ? name : (char *) "" );
+    group->material = (matName != NULL ? obj->findMaterial( matName ) : obj->materials[0]);
+
+    wfTriangle *tris = (wfTriangle *) in.take( numTris * sizeof(wfTriangle) );
+
+    if (tris != NULL) {
+      wfTriangle *copies = new wfTriangle[ numTris ];
+      memcpy( copies, tris, numTris * sizeof(wfTriangle) );
+      for (int i=0; i<numTris; i++)
+	group->triangles.add( &copies[i] );
+    }
+
+    obj->groups.add( group );
+
+    delete [] name;
+    delete [] matName;
+  }
+
+  // The BVH gets the same materials as when it is built
+
+  copyWavefrontToBVH( bvh, false );
+  bvh.setFlatTree( nodes, h.numNodes, h.stackSize );
+
+  bvh.fromCache = true;
+  bvh.buildTime = std::chrono::duration<float>( std::chrono::steady_clock::now() - start ).count();
+
+  return true;
+}
+
+
+
+// Write the object and its BVH to the cache of 'filename'.  The cache
+// is written to a temporary file and renamed, so a reader never sees
+// part of one.  Failure (e.g. in a read-only directory) just means
+// there's no cache.
+
+void WavefrontObj::writeCache( const char *filename )
+
+{
+  MappedFile objFile;
+
+  if (!objFile.open( filename ))
+    return;
+
+  int   len = strlen(filename) + strlen(MESH_CACHE_SUFFIX);
+  char *cacheName = new char[ len + 1 ];
+  char *tempName  = new char[ len + 32 ];
+
+  sprintf( cacheName, "%s%s", filename, MESH_CACHE_SUFFIX );
+  sprintf( tempName, "%s.%d", cacheName, (int) getpid() );
+
+  FILE *f = fopen( tempName, "wb" );
+
+  if (f == NULL) {
+    delete [] cacheName;
+    delete [] tempName;
+    return;
+  }
+
+  MeshCacheHeader h;
+
+  setKey( h, objFile );
+
+  h.numVertices   = obj->vertices.size();
+  h.numNormals    = obj->normals.size();
+  h.numTexcoords  = obj->texcoords.size();
+  h.numFacetnorms = obj->facetnorms.size();
+  h.numGroups     = obj->groups.size();
+
+  h.hasVertexNormals   = obj->hasVertexNormals;
+  h.hasVertexTexCoords = obj->hasVertexTexCoords;
+
+  for (int r=0; r<4; r++)
+    for (int c=0; c<4; c++)
+      h.objToWorldTransform[ 4*r + c ] = obj->objToWorldTransform[r][c];
+
+  h.numTriangles = bvh.triangles.size();
+  h.numNodes     = bvh.numNodes;
+  h.stackSize    = bvh.stackSize;
+
+  fwrite( &h, sizeof(h), 1, f );
+
+  writeSeq( f, obj->vertices );
+  writeSeq( f, obj->normals );
+  writeSeq( f, obj->texcoords );
+  writeSeq( f, obj->facetnorms );
+
+  writeSeq( f, bvh.triangles );
+  if (bvh.numNodes > 0)
+    fwrite( bvh.nodes, sizeof(BVH_flatNode), bvh.numNodes, f );
+
+  writeString( f, obj->mtllibname );
+
+  for (int g=0; g<obj->groups.size(); g++) {
+
+    wfGroup *group = obj->groups[g];
+
+    writeString( f, group->name );
+    writeString( f, group->material != NULL ? group->material->name : NULL );
+    writeInt( f, group->triangles.size() );
+
+    for (int i=0; i<group->triangles.size(); i++)
+      fwrite( group->triangles[i], sizeof(wfTriangle), 1, f );
+  }
+
+  bool ok = !ferror( f );
+
+  if (fclose( f ) != 0)
+    ok = false;
+
+  if (!ok || rename( tempName, cacheName ) != 0)
+    remove( tempName );
+
+  delete [] cacheName;
+  delete [] tempName;
+}
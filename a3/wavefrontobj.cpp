@@ -10,7 +10,7 @@
 
 // Convert Wavefront object to a list of materials and triangles for the BVH.
 
-void WavefrontObj::copyWavefrontToBVH( BVH &bvh )
+void WavefrontObj::copyWavefrontToBVH( BVH &bvh, bool withTriangles )
 
 {
   bvh.obj       = obj;
@@ -56,15 +56,17 @@ void WavefrontObj::copyWavefrontToBVH( BVH &bvh )
 
     bvh.materials.add( toMat );
 
-    // Add the triangles of this group
-
-    for (int j=0; j<obj->groups[groupID]->triangles.size(); j++) {
-      wfTriangle *tri = obj->groups[groupID]->triangles[j];
-      bvh.triangles.add( BVH_triangle( tri->vindices[0], tri->vindices[1], tri->vindices[2], // indices into vertices[] 
-				       tri->tindices[0], tri->tindices[1], tri->tindices[2], // indices into texcoords[]
-				       tri->nindices[0], tri->nindices[1], tri->nindices[2], // indices into normals[]
-				       bvh.materials.size()-1,                               // index into mats[]
-				       tri->findex ) );                                      // index into facetnorms[]
-    }    
+    // Add the triangles of this group (unless they come from a cache,
+    // already in BVH order)
+
+    if (withTriangles)
+      for (int j=0; j<obj->groups[groupID]->triangles.size(); j++) {
+	wfTriangle *tri = obj->groups[groupID]->triangles[j];
+	bvh.triangles.add( BVH_triangle( tri->vindices[0], tri->vindices[1], tri->vindices[2], // indices into vertices[] 
+					 tri->tindices[0], tri->tindices[1], tri->tindices[2], // indices into texcoords[]
+					 tri->nindices[0], tri->nindices[1], tri->nindices[2], // indices into normals[]
+					 bvh.materials.size()-1,                               // index into mats[]
+					 tri->findex ) );                                      // index into facetnorms[]
+      }    
   }
 }
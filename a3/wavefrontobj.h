@@ -13,7 +13,10 @@
 
 class WavefrontObj : public Object {
 
-  void copyWavefrontToBVH( BVH &bvh );
+  void copyWavefrontToBVH( BVH &bvh, bool withTriangles = true );
+
+  bool readCache( const char *filename ); // in wavefrontCache.cpp
+  void writeCache( const char *filename );
 
  public:
 
@@ -21,14 +24,31 @@ class WavefrontObj : public Object {
 
   BVH bvh;			/* bounding volume hierarchy of triangle primitives */
 
+  static bool useCache;		/* read and write a binary cache next to each OBJ file */
+
   WavefrontObj() {}
 
   WavefrontObj( const char *filename ) {
-    obj = new wfModel( filename, MIPMAP_LINEAR ); // Read the object
-    copyWavefrontToBVH( bvh ); // Copy to the BVH
-    bvh.buildTree(); // Build the BVH
+    obj = new wfModel();
+    if (!useCache || !readCache( filename )) { // Try the cache first
+      obj->read( filename ); // Read the object
+      copyWavefrontToBVH( bvh ); // Copy to the BVH
+      bvh.buildTree(); // Build the BVH
+      if (useCache)
+	writeCache( filename );
+    }
+    if (wfModel::useOpenGL)
+      obj->setupVAO( MIPMAP_LINEAR );
+    cout << obj->pathname << ": ";
+    bvh.printStats( cout );
   }
 
+  // Files this object was read from: the OBJ, and its material
+  // library (or NULL), which is named relative to the OBJ's directory
+
+  const char *objFilename() { return obj->pathname; }
+  const char *mtlFilename() { return obj->mtllibname; }
+
   void renderGL( GPUProgram * gpuProg, mat4 &WCS_to_VCS, mat4 &VCS_to_CCS ) {
     obj->draw( gpuProg, WCS_to_VCS, VCS_to_CCS );
   }
@@ -37,6 +57,23 @@ class WavefrontObj : public Object {
     return bvh.rayInt( rayStart, rayDir, objPartIndex, maxParam, intPoint, intNorm, intTexCoords, intParam, mat, intPartIndex );
   }
 
+  bool occluded( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam, int &occluderPart ) {
+    return bvh.occluded( rayStart, rayDir, objPartIndex, maxParam, occluderPart );
+  }
+
+  bool partOccludes( int partIndex, vec3 rayStart, vec3 rayDir, float maxParam ) {
+    return bvh.triangleOccludes( partIndex, rayStart, rayDir, maxParam );
+  }
+
+  BBox bbox() {
+    BBox b;
+    if (bvh.nodes != NULL)
+      b = bvh.nodes[0].bbox;
+    else
+      b.makeEmpty();
+    return b;
+  }
+
   vec3 textureColour( vec3 &p, int objPartIndex, float &alpha, vec3 &texCoords ) {
     return bvh.textureColour( p, objPartIndex, alpha, texCoords );
   }